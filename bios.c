@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -123,7 +124,11 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* 
+		SIGUSR1 is not blocked while its handler runs: nesting is prevented by
+		the soft interrupt-disable flag (see cpu_disable_interrupts).
+	 */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -156,6 +161,14 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/*
+	The soft interrupt-disable flag of the core. When set, SIGUSR1 is
+	still delivered, but the handler returns at once, leaving the interrupt
+	pending in intr_pending; cpu_enable_interrupts() dispatches it later.
+	This avoids a pthread_sigmask() system call per preemption toggle.
+ */
+static _Thread_local volatile sig_atomic_t intr_disabled;
+
 
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
@@ -353,7 +366,12 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	/* Interrupts are disabled; they remain pending */
+	if(intr_disabled) return;
+
+	intr_disabled = 1;
 	dispatch_interrupts(core);
+	cpu_enable_interrupts();
 }
 
 
@@ -992,10 +1010,21 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
+
+void cpu_relax()
+{
+	sched_yield();
+}
 
 
 void cpu_core_halt()
 {
+	cpu_disable_interrupts();
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
@@ -1012,19 +1041,16 @@ void cpu_core_halt()
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
+	/* Do not sleep if an interrupt was deferred while disabled */
+	if(core->intr_pending == 0) {
+		siginfo_t info;
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		(void)rc;
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1034,7 +1060,12 @@ void cpu_core_halt()
 
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
+	/* 
+		Unblock SIGUSR1 before dispatching, since a handler may switch
+		to a context that expects the signal to be deliverable.
+	 */
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1054,9 +1085,9 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
@@ -1073,6 +1104,20 @@ void cpu_core_restart_one()
 
 }
 
+uint cpu_core_restart_many(uint n)
+{
+	uint count = 0;
+	uint32_t hv = halt_vector;
+
+	while(count < n && hv != 0) {
+		uint c = __builtin_ctz(hv);
+		hv &= hv - 1;
+		if(c < physical_cores && __core_restart(c))
+			count++;
+	}
+	return count;
+}
+
 void cpu_core_restart_all()
 {
 	for(uint c=0; c < ncores; c++)
@@ -1092,52 +1137,160 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return intr_disabled == 0;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int was_disabled = intr_disabled;
+	intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return was_disabled == 0;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	intr_disabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	/* 
+		Dispatch the interrupts deferred while disabled. An interrupt
+		arriving after the check will be dispatched by the signal handler.
+	 */
+	Core* core;
+	while((core = curr_core())->intr_pending) {
+		intr_disabled = 1;
+		dispatch_interrupts(core);
+		intr_disabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+
+int cpu_fast_context_switch = 1;
+
+#ifdef BIOS_FAST_CONTEXT_SWITCH
+
+/*
+	The fast context switch.
+
+	void fast_swap_context(void** oldsp, void* newsp);
+
+	Push the callee-saved registers of the SysV ABI, including the SSE and
+	x87 control words, onto the current stack, save the stack pointer into
+	*oldsp, and pop the same from the stack at newsp.
+
+	A new context is given a stack that looks as if it had been switched 
+	out, returning to fast_context_start, with the function to call in r12.
+ */
+void fast_swap_context(void** oldsp, void* newsp);
+void fast_context_start(void);
+
+__asm__(
+	".text\n"
+	".globl fast_swap_context\n"
+	".type fast_swap_context, @function\n"
+	"fast_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size fast_swap_context, .-fast_swap_context\n"
+
+	".globl fast_context_start\n"
+	".type fast_context_start, @function\n"
+	"fast_context_start:\n"
+	"	andq $-16, %rsp\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size fast_context_start, .-fast_context_start\n"
+);
+
+/* The initial frame of a new context, as popped by fast_swap_context */
+struct fast_frame {
+	uint32_t mxcsr, fpucw;
+	uint64_t r15, r14, r13, r12, rbx, rbp;
+	void* ret;
+	void* pad;
+};
+
+static void fast_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	struct fast_frame* frame = (struct fast_frame*)top - 1;
+
+	*frame = (struct fast_frame) {
+		.mxcsr = 0x1F80,       /* the defaults of the ABI */
+		.fpucw = 0x037F,
+		.r12 = (uint64_t) ctx_func,
+		.ret = fast_context_start
+	};
+	ctx->sp = frame;
 }
 
+#endif
 
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
+#ifdef BIOS_FAST_CONTEXT_SWITCH
+  if(cpu_fast_context_switch) {
+    fast_initialize_context(ctx, ss_sp, ss_size, ctx_func);
+    return;
+  }
+#endif
+
   /* Init the context from this context! */
-  getcontext(ctx);
-  ctx->uc_link = NULL;
+  getcontext(&ctx->uc);
+  ctx->uc.uc_link = NULL;
 
   /* initialize the context stack */
-  ctx->uc_stack.ss_sp = ss_sp;
-  ctx->uc_stack.ss_size = ss_size;
-  ctx->uc_stack.ss_flags = 0;
-
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
-  makecontext(ctx, (void*) ctx_func, 0);
+  ctx->uc.uc_stack.ss_sp = ss_sp;
+  ctx->uc.uc_stack.ss_size = ss_size;
+  ctx->uc.uc_stack.ss_flags = 0;
+
+  /* 
+     SIGUSR1 stays unblocked in every context; interrupts are disabled by the
+     soft flag, which is per core and not part of the context.
+   */
+  ctx->uc.uc_sigmask = core_signal_set;
+  makecontext(&ctx->uc, (void*) ctx_func, 0);
 }
 
 
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 {
-	swapcontext(oldctx, newctx);
+#ifdef BIOS_FAST_CONTEXT_SWITCH
+	if(cpu_fast_context_switch) {
+		fast_swap_context(&oldctx->sp, newctx->sp);
+		return;
+	}
+#endif
+	swapcontext(&oldctx->uc, &newctx->uc);
 }
 
 
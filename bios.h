@@ -302,6 +302,14 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of CPUs of the host.
+
+	Each core is a host thread. When there are more cores than host CPUs,
+	some cores are not running at any moment.
+ */
+uint cpu_physical_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -344,7 +352,7 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Disabling interrupts only sets a per-core flag; no system call is made.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -370,6 +378,16 @@ int cpu_interrupts_enabled();
 void cpu_enable_interrupts();
 
 
+/**
+	@brief Hint that the core is busy-waiting for another core.
+
+	A core spinning on a lock should call this now and then. Our cores are
+	host threads, and the core being waited for may not be running on a host
+	CPU; this gives the host CPU away, so that it can make progress.
+ */
+void cpu_relax();
+
+
 /**
 	@brief Halt the core until an interrupt arrives. 
 
@@ -387,8 +405,9 @@ void cpu_core_halt();
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted, 0 otherwise
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -397,6 +416,16 @@ void cpu_core_restart(uint c);
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart up to @c n halted cores.
+
+	This call will restart halted cores, as with @c cpu_core_restart_one(),
+	until @c n cores have been restarted or no halted core remains.
+	@param n the maximum number of cores to restart
+	@returns the number of cores restarted
+*/
+uint cpu_core_restart_many(uint n);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -405,10 +434,39 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/*
+	On x86-64, contexts are switched by a short assembly routine, which
+	saves only the callee-saved registers and the stack pointer on the
+	stack. Define BIOS_UCONTEXT_SWITCH to always use swapcontext().
+ */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT_SWITCH)
+#define BIOS_FAST_CONTEXT_SWITCH
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
-typedef ucontext_t cpu_context_t;
+typedef struct cpu_context {
+#ifdef BIOS_FAST_CONTEXT_SWITCH
+	void* sp;           /**< @brief The saved stack pointer (fast switch) */
+#endif
+	ucontext_t uc;      /**< @brief The saved context (swapcontext) */
+} cpu_context_t;
+
+/**
+	@brief Select the fast context switch.
+
+	When this is set (the default), and the fast context switch is available,
+	@c cpu_initialize_context and @c cpu_swap_context use it; else they use 
+	@c makecontext and @c swapcontext. It must only be changed when no
+	context exists, e.g., before @c vm_boot.
+
+	The fast switch does not save or restore the signal mask. This is correct
+	as long as contexts are only switched with interrupts disabled, which is
+	the case in the scheduler. A new context starts with the interrupts
+	disabled (as with @c makecontext, whose signal mask blocks everything).
+*/
+extern int cpu_fast_context_switch;
 
 
 /**
@@ -62,7 +62,8 @@ void tinyos_pseudo_console()
 	fcb[0]->streamobj = NULL;
 	fcb[1]->streamobj = NULL;
 
-	fcb[0]->streamfunc = &__stdio_ops;
-	fcb[1]->streamfunc = &__stdio_ops;
+	__atomic_store_n(&fcb[0]->streamfunc, &__stdio_ops, __ATOMIC_RELEASE);
+	__atomic_store_n(&fcb[1]->streamfunc, &__stdio_ops, __ATOMIC_RELEASE);
+	FCB_publish(2, fid, fcb);
 
 }
@@ -1,6 +1,11 @@
 
 
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -20,11 +25,176 @@
 
 
 /*
- 	Pre-emption aware mutex.
+	Lock statistics.
+	----------------
+
+	When built with LOCK_STATISTICS (make LOCKSTAT=1), every lock operation
+	is accounted to the address of the lock, in a hash table. For each lock
+	we count the acquisitions, the contended acquisitions, the spin iterations
+	and the times the waiter yielded or slept, and sum the time spent waiting
+	for the lock and holding it. Since all the fields are updated by the
+	holder of the lock, the hold time only needs a timestamp per lock.
+
+	A lock can be given a name with lockstat_name(); the report groups locks
+	by name, so that e.g. all the TCB.sched_lock's are summed together.
+	Locks without a name are grouped by their type. The name stays with the
+	address, so a lock that reuses the memory of a freed one inherits its
+	name, unless it is named again.
+
+	Without LOCK_STATISTICS, the hooks below compile away.
+ */
+#if defined(LOCK_STATISTICS)
+
+/* The number of slots of the table (a power of 2), and the probes per lookup */
+#define LOCKSTAT_SLOTS 16384
+#define LOCKSTAT_PROBES 64
+
+typedef struct lock_stat {
+	void* lock;					/* the lock address, or NULL for a free slot */
+	const char* name;			/* the name of the lock */
+	unsigned long acquired;		/* number of acquisitions */
+	unsigned long contended;	/* acquisitions that had to wait */
+	unsigned long spins;		/* spin iterations while waiting */
+	unsigned long yields;		/* times a waiter yielded or slept */
+	unsigned long wait;			/* total wait time (nsec) */
+	unsigned long hold;			/* total hold time (nsec) */
+	unsigned long held_since;	/* time of the last acquisition */
+} lock_stat;
+
+static lock_stat lockstat_table[LOCKSTAT_SLOTS];
+
+/* Locks that do not fit in the table; their hold time is not tracked */
+static lock_stat lockstat_overflow = { .name = "(untracked locks)" };
+
+static inline unsigned long lockstat_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ul + ts.tv_nsec;
+}
+
+/* Find the entry of a lock. If @c kind is not NULL, add a missing entry under that name. */
+static lock_stat* lockstat_get(void* lock, const char* kind)
+{
+	size_t h = ((uintptr_t)lock >> 3) * 0x9E3779B97F4A7C15ul;
+	for(int i = 0; i < LOCKSTAT_PROBES; i++) {
+		lock_stat* ls = &lockstat_table[(h + i) & (LOCKSTAT_SLOTS-1)];
+		void* key = __atomic_load_n(&ls->lock, __ATOMIC_ACQUIRE);
+		if(key == NULL && kind == NULL)
+			break;
+		if(key == NULL && __atomic_compare_exchange_n(&ls->lock, &key, lock, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			const char* noname = NULL;
+			__atomic_compare_exchange_n(&ls->name, &noname, kind, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			return ls;
+		}
+		if(key == lock) return ls;
+	}
+	return &lockstat_overflow;
+}
+
+void lockstat_name(void* lock, const char* name)
+{
+	lock_stat* ls = lockstat_get(lock, name);
+	if(ls != &lockstat_overflow)
+		__atomic_store_n(&ls->name, name, __ATOMIC_RELAXED);
+}
+
+/*
+	Called by the new holder of a lock. If the acquisition was contended,
+	@c since is the time the wait started, else it is 0.
+ */
+static void lockstat_acquired(void* lock, const char* kind, 
+	unsigned long since, unsigned long spins, unsigned long yields)
+{
+	lock_stat* ls = lockstat_get(lock, kind);
+	unsigned long now = lockstat_clock();
+	__atomic_fetch_add(&ls->acquired, 1, __ATOMIC_RELAXED);
+	if(since) {
+		__atomic_fetch_add(&ls->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ls->spins, spins, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ls->yields, yields, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ls->wait, now - since, __ATOMIC_RELAXED);
+	}
+	ls->held_since = now;
+}
+
+/* Called by the holder of a lock, before it releases it */
+static void lockstat_released(void* lock)
+{
+	lock_stat* ls = lockstat_get(lock, NULL);
+	if(ls != &lockstat_overflow)
+		ls->hold += lockstat_clock() - ls->held_since;
+}
+
+/* A line of the report: the sum of the locks of a name */
+typedef struct lockstat_line {
+	lock_stat sum;
+	unsigned long locks;
+} lockstat_line;
+
+static int lockstat_compare(const void* a, const void* b)
+{
+	const lockstat_line* x = a;
+	const lockstat_line* y = b;
+	return (x->sum.wait < y->sum.wait) - (x->sum.wait > y->sum.wait);
+}
+
+void lockstat_report()
+{
+	static lockstat_line line[LOCKSTAT_SLOTS+1];
+	int n = 0;
+
+	for(int i = 0; i <= LOCKSTAT_SLOTS; i++) {
+		lock_stat* ls = (i < LOCKSTAT_SLOTS) ? &lockstat_table[i] : &lockstat_overflow;
+		if(ls->acquired == 0) continue;
+		int j;
+		for(j = 0; j < n; j++)
+			if(strcmp(line[j].sum.name, ls->name) == 0) break;
+		if(j == n)
+			line[n++] = (lockstat_line){ .sum.name = ls->name };
+		line[j].locks++;
+		line[j].sum.acquired += ls->acquired;
+		line[j].sum.contended += ls->contended;
+		line[j].sum.spins += ls->spins;
+		line[j].sum.yields += ls->yields;
+		line[j].sum.wait += ls->wait;
+		line[j].sum.hold += ls->hold;
+	}
+	qsort(line, n, sizeof(lockstat_line), lockstat_compare);
+
+	fprintf(stderr, "Lock statistics, by total wait time:\n");
+	fprintf(stderr, "%-26s %6s %10s %10s %12s %8s %10s %10s\n", "lock", "locks",
+		"acquired", "contended", "spins", "yields", "wait(ms)", "hold(ms)");
+	for(int j = 0; j < n; j++) {
+		lock_stat* sum = &line[j].sum;
+		fprintf(stderr, "%-26s %6lu %10lu %10lu %12lu %8lu %10.3f %10.3f\n",
+			sum->name, line[j].locks, sum->acquired, sum->contended, 
+			sum->spins, sum->yields, 1E-6*sum->wait, 1E-6*sum->hold);
+	}
+
+	/* Start afresh for the next boot */
+	memset(lockstat_table, 0, sizeof(lockstat_table));
+	lockstat_overflow = (lock_stat){ .name = lockstat_overflow.name };
+}
+
+#else
+
+#define lockstat_clock() 0ul
+static inline void lockstat_acquired(void* lock, const char* kind, 
+	unsigned long since, unsigned long spins, unsigned long yields) { }
+static inline void lockstat_released(void* lock) { }
+
+#endif
+
+
+/*
+ 	Pre-emption aware spinlock.
  	-------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	This spinlock will spin if preemption is off, and yield now and then
+ 	if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -32,35 +202,450 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+static void spinlock_acquire(spinlock_t* lock, const char* kind)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+#define SPINLOCK_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
+  unsigned long since = 0, spins = 0, yields = 0;
   while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
+    if(! since) since = lockstat_clock() | 1;
+    int spin=SPINLOCK_SPINS;
     while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
 #endif
+      spins++;
       if(spin>0) 
       	spin--; 
       else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
+      	spin=SPINLOCK_SPINS; 
+      	if(cpu_interrupts_enabled()) {
+      		yields++;
       		yield(SCHED_MUTEX); 
+      	}
       }
     }
   }
-#undef MUTEX_SPINS
+  lockstat_acquired(lock, kind, since, spins, yields);
+#undef SPINLOCK_SPINS
+}
+
+
+void spin_lock(spinlock_t* lock)
+{
+  spinlock_acquire(lock, "(spinlock)");
 }
 
 
-void Mutex_Unlock(Mutex* lock)
+void spin_unlock(spinlock_t* lock)
 {
+  lockstat_released(lock);
   __atomic_clear(lock, __ATOMIC_RELEASE);
 }
 
 
+/*
+	Ticket lock.
+	------------
+
+	The scheduler locks are very hot: every wakeup, sleep and context
+	switch takes one or more of them. A test-and-set lock makes all waiters
+	write the same cache line, and hands the lock to whichever waiter
+	happens to win, so a core can starve under contention.
+
+	A ticket lock takes one atomic increment of @c next per acquisition;
+	the waiters then only read @c owner, until it reaches their ticket,
+	and are served in order. Each waiter backs off in proportion to its
+	distance from the head of the queue, to keep the traffic on @c owner
+	low while the lock is handed down the queue.
+
+	Our cores are host threads, and there may be fewer host CPUs than
+	cores. Then, the waiter next in line is often not running, and a FIFO
+	lock would stall every core until the host schedules it. In this case,
+	waiters do not queue up; they retry ticket_trylock() instead, like a
+	test-and-set lock. In both cases, a waiter that spins for a while gives
+	its host CPU away, much like pause-loop exiting in a hypervisor.
+ */
+static inline int ticket_try(ticketlock_t* lock)
+{
+	ticketlock_t old = { .word = __atomic_load_n(&lock->word, __ATOMIC_RELAXED) };
+	if(old.owner != old.next) return 0;
+	ticketlock_t new = old;
+	new.next++;
+	return __atomic_compare_exchange_n(&lock->word, &old.word, new.word, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void ticket_lock(ticketlock_t* lock)
+{
+#define TICKETLOCK_SPINS 1000
+
+	int spin = TICKETLOCK_SPINS;
+	unsigned long since = 0, spins = 0, yields = 0;
+
+	if(cpu_cores() > cpu_physical_cores()) {
+		while(! ticket_try(lock)) {
+			if(! since) since = lockstat_clock() | 1;
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+			spins++;
+			if(--spin <= 0) {
+				spin = TICKETLOCK_SPINS;
+				yields++;
+				cpu_relax();
+			}
+		}
+		lockstat_acquired(lock, "(ticketlock)", since, spins, yields);
+		return;
+	}
+
+	uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	uint16_t owner;
+	while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+		if(! since) since = lockstat_clock() | 1;
+		/* Back off in proportion to our place in the queue */
+		uint16_t d = ticket - owner;
+		for(uint16_t i = d; i > 0; i--) {
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+		spins += d;
+		if((spin -= d) <= 0) {
+			spin = TICKETLOCK_SPINS;
+			yields++;
+			cpu_relax();
+		}
+	}
+	lockstat_acquired(lock, "(ticketlock)", since, spins, yields);
+#undef TICKETLOCK_SPINS
+}
+
+
+int ticket_trylock(ticketlock_t* lock)
+{
+	if(! ticket_try(lock)) return 0;
+	lockstat_acquired(lock, "(ticketlock)", 0, 0, 0);
+	return 1;
+}
+
+
+void ticket_unlock(ticketlock_t* lock)
+{
+	lockstat_released(lock);
+	/* Only the holder writes owner */
+	__atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+
+/*
+	Sleeping mutex.
+	---------------
+
+	The owner word holds the owning thread (or 0), with bit MUTEX_WAITERS set 
+	when there are threads asleep in the waitset. Locking and unlocking 
+	without contention is a single compare-and-swap.
+
+	A thread that finds the mutex locked spins while the owner runs on some
+	core, since then the mutex will probably be released soon. Otherwise,
+	it joins the waitset and sleeps. Unlocking a mutex with waiters wakes
+	up exactly one of them, the first, which then retries. The mutex is not 
+	passed to the waiter: a running thread may take it first, which avoids
+	convoys of threads that wait to be scheduled only to pass the mutex on.
+ */
+
+#define MUTEX_WAITERS ((uintptr_t)1)
+
+/* The maximum number of spins while waiting for a running owner */
+#define MUTEX_SPINS 1000
+
+/** \cond HELPER Helper structure for mutex waiters. */
+typedef struct __mx_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	int handoff;				/* wake up with wakeup_to */
+	int level;					/* the priority level of the thread (see sched_level) */
+	rlnode lend_node;			/* become part of the lenders of the owner */
+	TCB* lent_to;				/* the owner that inherited our level, or NULL */
+} __mx_waiter;
+/** \endcond */
+
+/*
+	The owner token of the caller. Before the scheduler starts, there is no
+	current thread, and the core stands for it.
+ */
+static inline uintptr_t mutex_self()
+{
+	TCB* tcb = cur_thread();
+	return (tcb != NULL) ? (uintptr_t)tcb : (uintptr_t)&cctx[cpu_core_id];
+}
+
+/* The thread of an owner token, or NULL if the owner is a core */
+static inline TCB* mutex_owner_thread(uintptr_t owner)
+{
+	owner &= ~MUTEX_WAITERS;
+	if(owner >= (uintptr_t)cctx && owner < (uintptr_t)(cctx + MAX_CORES))
+		return NULL;
+	return (TCB*) owner;
+}
+
+int mutex_priority_inheritance = 1;
+
+/*
+	A waiter lends its level to the owner of the mutex: it joins the 
+	lenders of the owner, which inherits its level. The owner takes the
+	lenders of a mutex back when it unlocks the mutex, and keeps the 
+	highest level of the rest, which wait for the other mutexes it holds
+	(see Mutex_Unlock). A lender is only changed under the waitset_lock
+	of its mutex, and the lenders of a thread under its lenders_lock.
+ */
+static void mutex_lend(__mx_waiter* waiter, TCB* tcb)
+{
+	if(waiter->lent_to == tcb) return;
+	assert(waiter->lent_to == NULL);
+
+	int oldpre = preempt_off;
+	ticket_lock(&tcb->lenders_lock);
+	rlist_push_back(&tcb->lenders, rlnode_init(&waiter->lend_node, waiter));
+	ticket_unlock(&tcb->lenders_lock);
+	if(oldpre) preempt_on;
+
+	waiter->lent_to = tcb;
+	sched_inherit(tcb, waiter->level);
+}
+
+/*
+	Let the owner of the mutex inherit the level of a waiter. The owner
+	cannot release the mutex while we hold the waitset_lock and the waiters 
+	bit is set, therefore its TCB is valid (unless it exited holding the 
+	mutex, which is an error).
+
+	*** MUST BE CALLED WITH mx->waitset_lock HELD ***
+ */
+static inline void mutex_inherit(uintptr_t owner, __mx_waiter* waiter)
+{
+	TCB* tcb = mutex_owner_thread(owner);
+	if(mutex_priority_inheritance && tcb != NULL)
+		mutex_lend(waiter, tcb);
+}
+
+/*
+	Let the new owner of the mutex inherit the levels of the remaining
+	waiters, which were lent to the previous owner.
+
+	*** MUST BE CALLED WITH mx->waitset_lock HELD ***
+ */
+static void mutex_inherit_waiters(Mutex* mx, __mx_waiter* self)
+{
+	if(! mutex_priority_inheritance || mx->waitset == NULL) return;
+
+	__mx_waiter* w = mx->waitset;
+	do {
+		mutex_lend(w, self->thread);
+		w = w->node.next->obj;
+	} while(w != mx->waitset);
+}
+
+/*
+	Take back the levels that the waiters of the mutex lent to the current
+	thread, and drop to the highest level of the remaining lenders. A waiter
+	of another mutex either joins the lenders before we look at them, or
+	raises our level after we dropped it; either way, its level is kept.
+
+	*** MUST BE CALLED WITH mx->waitset_lock HELD AND PREEMPTION OFF ***
+ */
+static void mutex_uninherit(Mutex* mx)
+{
+	TCB* tcb = cur_thread();
+	if(tcb == NULL) return;
+
+	ticket_lock(&tcb->lenders_lock);
+	__mx_waiter* w = mx->waitset;
+	if(w != NULL)
+		do {
+			if(w->lent_to == tcb) {
+				rlist_remove(&w->lend_node);
+				w->lent_to = NULL;
+			}
+			w = w->node.next->obj;
+		} while(w != mx->waitset);
+
+	sched_uninherit();
+	int level = -1;
+	for(rlnode* p = tcb->lenders.next; p != &tcb->lenders; p = p->next) {
+		__mx_waiter* l = p->obj;
+		if(l->level > level)
+			level = l->level;
+	}
+	ticket_unlock(&tcb->lenders_lock);
+
+	sched_inherit(tcb, level);
+}
+
+/* Check whether a thread is currently running on some core. */
+static inline int mutex_owner_running(uintptr_t owner)
+{
+	/* Only look at the core table; the owner's TCB may be gone already */
+	for(uint c=0; c < cpu_cores(); c++)
+		if((uintptr_t)cctx[c].current_thread == owner)
+			return 1;
+	return 0;
+}
+
+/* Try to take the mutex, if it has no owner. */
+static inline int mutex_trylock(Mutex* mx, uintptr_t self)
+{
+	uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+	while((owner & ~MUTEX_WAITERS) == 0) {
+		if(__atomic_compare_exchange_n(&mx->owner, &owner, self | owner, 0, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
+
+/* Remove a waiter from the waitset of the mutex. */
+static inline void mutex_remove_waiter(Mutex* mx, __mx_waiter* w)
+{
+	if(mx->waitset == w) {
+		__mx_waiter* nextw = w->node.next->obj;
+		mx->waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+/*
+	Wait in the waitset of the mutex until we take it, and return the
+	number of times we slept. If @c queued is set, the waiter is already
+	in the waitset (see cv_morph()).
+
+	The waiter stays in the waitset until it takes the mutex, so that
+	Mutex_Unlock wakes up the same waiter, until it has run.
+ */
+static unsigned long mutex_lock_queued(Mutex* mx, uintptr_t self, __mx_waiter* waiter, int queued)
+{
+	unsigned long sleeps = 0;
+
+	spinlock_acquire(&mx->waitset_lock, "Mutex.waitset_lock");
+	while(1) {
+		uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+		if((owner & ~MUTEX_WAITERS) == 0) {
+			/* The mutex is free; keep the waiters bit if others wait */
+			int others = queued ? (waiter->node.next != &waiter->node) : (mx->waitset != NULL);
+			if(__atomic_compare_exchange_n(&mx->owner, &owner, 
+					self | (others ? MUTEX_WAITERS : 0), 0, 
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+			continue;
+		}
+		if(!(owner & MUTEX_WAITERS) && 
+			! __atomic_compare_exchange_n(&mx->owner, &owner, owner | MUTEX_WAITERS, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+
+		if(! queued) {
+			waiter->level = sched_level(waiter->thread);
+			if(mx->waitset)
+				rlist_push_back(& ((__mx_waiter*)mx->waitset)->node, & waiter->node);
+			else
+				mx->waitset = waiter;
+			queued = 1;
+		}
+		mutex_inherit(owner, waiter);
+
+		sleeps++;
+		sleep_releasing(STOPPED, &mx->waitset_lock, SCHED_MUTEX, NO_TIMEOUT);
+		spinlock_acquire(&mx->waitset_lock, "Mutex.waitset_lock");
+	}
+	if(queued) {
+		assert(waiter->lent_to == NULL);
+		mutex_remove_waiter(mx, waiter);
+		mutex_inherit_waiters(mx, waiter);
+	}
+	spin_unlock(&mx->waitset_lock);
+
+	return sleeps;
+}
+
+static void mutex_lock_slow(Mutex* mx, uintptr_t self)
+{
+	unsigned long since = lockstat_clock() | 1, spins = 0;
+
+	/* Adaptive spinning */
+	for(int spin = MUTEX_SPINS; spin > 0; spin--, spins++) {
+		if(mutex_trylock(mx, self)) {
+			lockstat_acquired(mx, "(Mutex)", since, spins, 0);
+			return;
+		}
+		uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED) & ~MUTEX_WAITERS;
+		if(owner != 0 && !mutex_owner_running(owner))
+			break;
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	__mx_waiter waiter = { .thread = cur_thread(), .handoff = 0 };
+	assert(waiter.thread != NULL);
+	rlnode_init(& waiter.node, &waiter);
+
+	unsigned long sleeps = mutex_lock_queued(mx, self, &waiter, 0);
+	lockstat_acquired(mx, "(Mutex)", since, spins, sleeps);
+}
+
+
+void Mutex_Lock(Mutex* mx)
+{
+	uintptr_t self = mutex_self();
+	uintptr_t owner = 0;
+	if(! __atomic_compare_exchange_n(&mx->owner, &owner, self, 0, 
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		mutex_lock_slow(mx, self);
+	else
+		lockstat_acquired(mx, "(Mutex)", 0, 0, 0);
+}
+
+
+void Mutex_Unlock(Mutex* mx)
+{
+	lockstat_released(mx);
+	uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+	while(! (owner & MUTEX_WAITERS)) {
+		if(__atomic_compare_exchange_n(&mx->owner, &owner, 0, 0, 
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	/* 
+		Drop the level that the waiters lent us, except for the level that
+		we owe to the waiters of the other mutexes we hold. Once it is 
+		dropped, the waiter that we wake up may preempt us; this must wait 
+		until the waitset_lock is released, else the waiter would spin on it.
+		Preemption goes off only after the waitset_lock is taken, because
+		a spinlock_acquire without preemption cannot yield to a holder
+		that was preempted.
+	 */
+	spinlock_acquire(&mx->waitset_lock, "Mutex.waitset_lock");
+	int oldpre = preempt_off;
+	mutex_uninherit(mx);
+
+	/* Release the mutex and wake up the first waiter */
+	__mx_waiter* waiter = mx->waitset;
+	__atomic_store_n(&mx->owner, waiter ? MUTEX_WAITERS : 0, __ATOMIC_RELEASE);
+	if(waiter) {
+		if(waiter->handoff)
+			wakeup_to(waiter->thread);
+		else
+			wakeup(waiter->thread);
+	}
+	spin_unlock(&mx->waitset_lock);
+
+	if(oldpre) preempt_on;
+}
+
+
 /*
 	Condition variables.	
 */
@@ -73,6 +658,9 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	Mutex* mutex;				/* the mutex released by the waiter */
+	__mx_waiter mxw;			/* the waiter in the waitset of the mutex */
+	sig_atomic_t morphed;		/* this is set if mxw was queued on the mutex */
 } __cv_waiter;
 /** \endcond */
 
@@ -121,10 +709,13 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.mutex = mutex, .morphed = 0 };
 	rlnode_init(& waiter.node, &waiter);
+	waiter.mxw.thread = waiter.thread;
+	rlnode_init(& waiter.mxw.node, &waiter.mxw);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -138,34 +729,99 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
-
-	Mutex_Lock(mutex);
+	spin_unlock(&(cv->waitset_lock));
+
+	if(waiter.morphed) {
+		/* We were moved to the waitset of the mutex */
+		unsigned long since = lockstat_clock() | 1;
+		unsigned long sleeps = mutex_lock_queued(mutex, (uintptr_t)waiter.thread, &waiter.mxw, 1);
+		lockstat_acquired(mutex, "(Mutex)", since, 0, sleeps);
+	} else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
 
+/*
+	Wait morphing.
+	--------------
+
+	A waiter is usually signalled by a thread that holds the mutex of
+	the waiter. If we woke it up, it would run only to find the mutex
+	locked, and sleep again on the mutex. Instead, while the mutex is 
+	locked, a signalled waiter is moved to the waitset of the mutex,
+	without waking it up; Mutex_Unlock will wake it up when the mutex
+	is free.
+
+	If the waiter was to be handed the core, it is handed the core when
+	it is woken up by Mutex_Unlock.
+ */
+int cv_wait_morphing = 1;
+
+/*
+	Move a signalled waiter to the waitset of its mutex, if the mutex
+	is locked, and return 1. Else, return 0; then the waiter must be
+	woken up.
+
+	*** MUST BE CALLED WITH cv->waitset_lock HELD ***
+ */
+static int cv_morph(__cv_waiter* waiter, int handoff)
+{
+	if(! cv_wait_morphing) return 0;
+
+	Mutex* mx = waiter->mutex;
+	int morphed = 0;
+
+	spinlock_acquire(&mx->waitset_lock, "Mutex.waitset_lock");
+	uintptr_t owner = __atomic_load_n(&mx->owner, __ATOMIC_RELAXED);
+	while((owner & ~MUTEX_WAITERS) != 0) {
+		/* Set the waiters bit, so that the owner will wake us up */
+		if((owner & MUTEX_WAITERS) || 
+			__atomic_compare_exchange_n(&mx->owner, &owner, owner | MUTEX_WAITERS, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			waiter->mxw.handoff = handoff;
+			waiter->mxw.level = sched_level(waiter->thread);
+			mutex_inherit(owner, &waiter->mxw);
+			if(mx->waitset)
+				rlist_push_back(& ((__mx_waiter*)mx->waitset)->node, & waiter->mxw.node);
+			else
+				mx->waitset = &waiter->mxw;
+			waiter->morphed = 1;
+			morphed = 1;
+			break;
+		}
+	}
+	spin_unlock(&mx->waitset_lock);
+
+	return morphed;
+}
+
+
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
+
+  If @c handoff is set, the waiter is woken up by @c wakeup_to, 
+  so that it runs next on this core.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(cv_morph(waiter, handoff) ||
+				(handoff ? wakeup_to(waiter->thread) : wakeup(waiter->thread))) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -173,6 +829,43 @@ static inline void cv_signal(CondVar* cv)
 }
 
 
+/* The number of waiters woken up together by cv_broadcast */
+#define CV_BATCH 64
+
+/**
+  @internal
+  Helper for Cond_Broadcast. This method removes all the waiters of
+  the condition variable. The ones whose mutex is locked are moved to its
+  waitset (see cv_morph), and the rest are woken up in batches with 
+  @c wakeup_many.
+ */
+static void cv_broadcast(CondVar* cv)
+{
+	__cv_waiter* waiters[CV_BATCH];
+	TCB* threads[CV_BATCH];
+
+	while(cv->waitset) {
+		int n = 0;
+		while(cv->waitset && n < CV_BATCH) {
+			__cv_waiter* waiter = cv->waitset;
+			remove_from_ring(cv, waiter);
+			waiter->removed = 1;
+			if(cv_morph(waiter, 0)) {
+				waiter->signalled = 1;
+				continue;
+			}
+			waiters[n] = waiter;
+			threads[n] = waiter->thread;
+			n++;
+		}
+		if(n == 0) break;
+		wakeup_many(threads, n);
+		for(int i = 0; i < n; i++)
+			if(threads[i] != NULL)
+				waiters[i]->signalled = 1;
+	}
+}
+
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
@@ -188,104 +881,513 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
+  cv_signal(cv, 0);
+  spin_unlock(&(cv->waitset_lock));
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
+  cv_broadcast(cv);
+  spin_unlock(&(cv->waitset_lock));
+}
+
+
+
+
+/*
+	Futexes.
+	--------
+
+	The threads waiting on user addresses are kept in a hash table of
+	wait queues, keyed by the address. Each bucket has its own spinlock,
+	so that threads waiting on unrelated addresses do not contend. The 
+	value at the address is checked while holding the lock of the bucket, 
+	and FutexWake takes the same lock, so a wakeup cannot be missed. 
+ */
+
+/* The number of buckets in the futex table (a power of 2) */
+#define FUTEX_BUCKETS 256
+
+/** \cond HELPER Helper structure for futex waiters. */
+typedef struct __futex_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	int* addr;					/* the address waited on */
+	int timed;					/* this is set if the wait has a timeout */
+	sig_atomic_t woken;			/* this is set if the thread is woken by FutexWake */
+	sig_atomic_t removed;		/* this is set if the waiter is removed 
+								   from the ring */
+} __futex_waiter;
+/** \endcond */
+
+static struct futex_bucket {
+	spinlock_t lock;			/* protects the waitset */
+	__futex_waiter* waitset;	/* the ring of waiters, or NULL */
+} futex_table[FUTEX_BUCKETS];
+
+static inline struct futex_bucket* futex_bucket(int* addr)
+{
+	uintptr_t h = ((uintptr_t)addr >> 2) * 0x9E3779B97F4A7C15ul;
+	return &futex_table[h >> (64 - 8)];
+}
+
+static inline void futex_remove(struct futex_bucket* b, __futex_waiter* w)
+{
+	if(b->waitset == w) {
+		__futex_waiter* nextw = w->node.next->obj;
+		b->waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
 }
 
 
+int FutexWait(int* addr, int expected, timeout_t timeout)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	__futex_waiter waiter = { .thread = cur_thread(), .addr = addr, 
+		.timed = (timeout != TIMEOUT_INFINITE), .woken = 0, .removed = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	spinlock_acquire(&b->lock, "futex_bucket.lock");
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected) {
+		spin_unlock(&b->lock);
+		return -1;
+	}
+	if(b->waitset)
+		rlist_push_back(& b->waitset->node, & waiter.node);
+	else
+		b->waitset = &waiter;
+
+	sleep_releasing(STOPPED, &b->lock, SCHED_USER, 
+		(timeout == TIMEOUT_INFINITE) ? NO_TIMEOUT : timeout*1000ul);
 
+	/* Without a timeout, only FutexWake wakes us up, after removing us */
+	if(! waiter.timed && __atomic_load_n(&waiter.removed, __ATOMIC_ACQUIRE))
+		return 0;
 
+	spinlock_acquire(&b->lock, "futex_bucket.lock");
+	if(! waiter.removed)
+		futex_remove(b, &waiter);
+	spin_unlock(&b->lock);
+
+	return waiter.woken ? 0 : -1;
+}
+
+
+/* The number of waiters woken up together by FutexWake */
+#define FUTEX_BATCH 64
 
 /*
- *
- * The kernel locks
- *
+  The waiters without a timeout are removed under the lock, and woken up 
+  after it is released, in batches, with wakeup_many. This way, releasing 
+  many threads (e.g., at a barrier) does not keep the bucket locked. This 
+  is safe because nothing else can wake up these waiters; a waiter with a 
+  timeout is woken up under the lock, since it may also wake up by itself.
  */
+int FutexWake(int* addr, unsigned int n)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+	TCB* threads[FUTEX_BATCH];
+	unsigned int count = 0;
+
+	while(count < n) {
+		int k = 0;
+
+		spinlock_acquire(&b->lock, "futex_bucket.lock");
+		__futex_waiter* w = b->waitset;
+		while(w != NULL && count < n && k < FUTEX_BATCH) {
+			/* The next waiter, or NULL at the end of the ring */
+			__futex_waiter* nextw = w->node.next->obj;
+			if(nextw == b->waitset) nextw = NULL;
+
+			if(w->addr == addr) {
+				futex_remove(b, w);
+				if(w->timed) {
+					w->removed = 1;
+					/* A waiter that timed out does not count */
+					if(wakeup(w->thread)) {
+						w->woken = 1;
+						count++;
+					}
+				} else {
+					w->woken = 1;
+					__atomic_store_n(&w->removed, 1, __ATOMIC_RELEASE);
+					threads[k++] = w->thread;
+					count++;
+				}
+			}
+			w = nextw;
+		}
+		spin_unlock(&b->lock);
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+		if(k > 0)
+			wakeup_many(threads, k);
+		if(w == NULL) break;
+	}
+
+	return count;
+}
+
+
+
+
+/*
+	Semaphores and barriers.
+	------------------------
+
+	These live in user memory and are built on the futexes: the calls
+	sleep only when they must, and wake up only when somebody sleeps.
+
+	The barrier is sense-reversing: a thread reads the phase before it 
+	arrives, and waits until the phase changes. The last thread to arrive 
+	resets the count, advances the phase and wakes up all the waiters of 
+	the phase with a single FutexWake, which passes them to the scheduler 
+	in batches. Since the waiters do not re-acquire any lock after they 
+	are woken up, nothing serializes the release of a phase.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+/* The number of times a barrier waiter checks the phase before sleeping */
+#define BARRIER_SPINS 2000
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+static int sem_trywait(Semaphore* sem)
+{
+	int c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while(c > 0)
+		if(__atomic_compare_exchange_n(&sem->count, &c, c-1, 1, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+static int sem_wait(Semaphore* sem, timeout_t timeout)
+{
+	TimerDuration deadline = (timeout == TIMEOUT_INFINITE) ? 0 
+		: bios_clock() + timeout*1000ul;
+
+	while(! sem_trywait(sem)) {
+		timeout_t remaining = TIMEOUT_INFINITE;
+		if(timeout != TIMEOUT_INFINITE) {
+			TimerDuration now = bios_clock();
+			if(now >= deadline) return 0;
+			remaining = (deadline - now + 999) / 1000;
+		}
 
-void kernel_lock()
+		/* Sem_Post increments the count and then checks the waiters */
+		__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+		FutexWait(&sem->count, 0, remaining);
+		__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+
+void Sem_Wait(Semaphore* sem)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	sem_wait(sem, TIMEOUT_INFINITE);
+}
+
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout)
+{
+	return sem_wait(sem, timeout);
+}
+
+void Sem_Post(Semaphore* sem)
+{
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0)
+		FutexWake(&sem->count, 1);
+}
+
+
+int Barrier_Wait(Barrier* bar, unsigned int n)
+{
+	assert(n > 0);
+	int phase = __atomic_load_n(&bar->phase, __ATOMIC_ACQUIRE);
+
+	if(__atomic_add_fetch(&bar->count, 1, __ATOMIC_ACQ_REL) == n) {
+		/* The count must be reset before any waiter gets released */
+		__atomic_store_n(&bar->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&bar->phase, (int)((unsigned)phase + 1), __ATOMIC_RELEASE);
+		FutexWake(&bar->phase, UINT_MAX);
+		return 1;
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+
+	/* Spin for a while, if the other threads run on cores of their own */
+	if(cpu_cores() > 1 && cpu_cores() <= cpu_physical_cores())
+		for(int spin = BARRIER_SPINS; spin > 0; spin--) {
+			if(__atomic_load_n(&bar->phase, __ATOMIC_ACQUIRE) != phase)
+				return 0;
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+
+	while(__atomic_load_n(&bar->phase, __ATOMIC_ACQUIRE) == phase)
+		FutexWait(&bar->phase, phase, TIMEOUT_INFINITE);
+	return 0;
 }
 
-void kernel_unlock()
+
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	These are also built on the futexes. A writer first counts itself in 
+	`writers`, which stops new readers, and then takes the writer bit of 
+	`state`. Readers wait on `writers` until it drops to 0, and writers 
+	wait on `rseq`, which is changed whenever they should look again.
+
+	A per-core lock counts the entries and the exits of its readers in the
+	slot of their core. A reader that moves to another core exits from the
+	slot of the new core, so a slot by itself means nothing, and a single
+	sum of entries minus exits may miss a reader that moved while it was
+	being summed. Instead, the exits are summed before the entries; both
+	only grow, so if the two sums are equal, there was a moment between 
+	them with no reader inside. After taking the writer bit, a writer waits
+	for such a moment. A reader that enters and sees a writer leaves at
+	once, and waits for the writers to finish.
+ */
+
+static inline RwLockSlot* rwlock_slot(RwLock* rw)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	return &rw->slots[cpu_core_id % RWLOCK_SLOTS];
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+static unsigned int rwlock_readers(RwLock* rw)
+{
+	if(rw->slots == NULL)
+		return __atomic_load_n(&rw->state, __ATOMIC_SEQ_CST) & ~RWLOCK_WRITER;
+
+	unsigned int exits = 0, entries = 0;
+	for(int i = 0; i < RWLOCK_SLOTS; i++)
+		exits += __atomic_load_n(&rw->slots[i].exits, __ATOMIC_SEQ_CST);
+	for(int i = 0; i < RWLOCK_SLOTS; i++)
+		entries += __atomic_load_n(&rw->slots[i].entries, __ATOMIC_SEQ_CST);
+	return entries - exits;
+}
+
+/* Make at most n waiting writers look again */
+static void rwlock_kick_writers(RwLock* rw, unsigned int n)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	__atomic_add_fetch(&rw->rseq, 1, __ATOMIC_SEQ_CST);
+	FutexWake(&rw->rseq, n);
+}
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+static void rwlock_wait_writers(RwLock* rw)
+{
+	int w;
+	while((w = __atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST)) != 0)
+		FutexWait(&rw->writers, w, TIMEOUT_INFINITE);
+}
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+static void rwlock_read_leave(RwLock* rw)
+{
+	if(rw->slots == NULL) {
+		int left = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_SEQ_CST);
+		if(left == 0 && __atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) != 0)
+			rwlock_kick_writers(rw, 1);
+		return;
+	}
 
-	return ret;
+	/* In a per-core lock, the writer that holds the writer bit may wait for us */
+	__atomic_add_fetch(&rwlock_slot(rw)->exits, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) != 0)
+		rwlock_kick_writers(rw, UINT_MAX);
 }
 
-void kernel_signal(CondVar* cv) 
-{ 
-	Cond_Signal(cv); 
+
+void RwLock_ReadLock(RwLock* rw)
+{
+	if(rw->slots == NULL) {
+		for(;;) {
+			rwlock_wait_writers(rw);
+			int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+			while(!(s & RWLOCK_WRITER) && __atomic_load_n(&rw->writers, __ATOMIC_RELAXED) == 0)
+				if(__atomic_compare_exchange_n(&rw->state, &s, s+1, 1, 
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+					return;
+		}
+	}
+
+	for(;;) {
+		__atomic_add_fetch(&rwlock_slot(rw)->entries, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) == 0)
+			return;
+		rwlock_read_leave(rw);
+		rwlock_wait_writers(rw);
+	}
 }
 
-void kernel_broadcast(CondVar* cv) 
-{ 
-	Cond_Broadcast(cv); 
+
+void RwLock_WriteLock(RwLock* rw)
+{
+	uintptr_t self = mutex_self();
+	unsigned long since = 0, sleeps = 0;
+
+	assert(__atomic_load_n(&rw->owner, __ATOMIC_RELAXED) != self);
+	__atomic_add_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST);
+
+	/* Take the writer bit */
+	for(;;) {
+		int seq = __atomic_load_n(&rw->rseq, __ATOMIC_SEQ_CST);
+		int s = 0;
+		if(__atomic_compare_exchange_n(&rw->state, &s, RWLOCK_WRITER, 0, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+		if(! since) since = lockstat_clock() | 1;
+		FutexWait(&rw->rseq, seq, TIMEOUT_INFINITE);
+		sleeps++;
+	}
+
+	/* Wait for the readers of a per-core lock to leave */
+	if(rw->slots != NULL)
+		for(;;) {
+			int seq = __atomic_load_n(&rw->rseq, __ATOMIC_SEQ_CST);
+			if(rwlock_readers(rw) == 0)
+				break;
+			if(! since) since = lockstat_clock() | 1;
+			FutexWait(&rw->rseq, seq, TIMEOUT_INFINITE);
+			sleeps++;
+		}
+
+	__atomic_store_n(&rw->owner, self, __ATOMIC_RELAXED);
+	lockstat_acquired(rw, "(RwLock)", since, 0, sleeps);
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+
+void RwLock_Unlock(RwLock* rw)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	if(__atomic_load_n(&rw->owner, __ATOMIC_RELAXED) != mutex_self()) {
+		rwlock_read_leave(rw);
+		return;
+	}
+
+	lockstat_released(rw);
+	__atomic_store_n(&rw->owner, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&rw->state, 0, __ATOMIC_RELEASE);
+
+	/* Pass the lock to the next writer, or let the readers in */
+	if(__atomic_sub_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST) > 0)
+		rwlock_kick_writers(rw, 1);
+	else
+		FutexWake(&rw->writers, UINT_MAX);
 }
 
 
 
 
+/*
+	Read-copy-update.
+	-----------------
+
+	Readers are not preemptible, therefore a core that passes through
+	gain() holds no reference that it read before. A global epoch is
+	advanced when every core has seen it at a quiescent state, or is idle.
+	An object unlinked in epoch e may still be read until every core has
+	seen epoch e+1, that is, until the epoch reaches e+2.
+
+	Each core keeps its callbacks in a list, in the order of their epochs,
+	and runs them from gain(). Only a core with callbacks tries to advance 
+	the epoch; the others just record it.
+ */
+
+static unsigned int rcu_epoch;
+
+static inline int rcu_core_quiet(CCB* core, unsigned int epoch)
+{
+	return __atomic_load_n(&core->rcu_seen, __ATOMIC_SEQ_CST) == epoch
+		|| core->current_thread == &core->idle_thread;
+}
+
+static void rcu_advance(unsigned int epoch)
+{
+	for(uint c=0; c < cpu_cores(); c++)
+		if(! rcu_core_quiet(&cctx[c], epoch))
+			return;
+	__atomic_compare_exchange_n(&rcu_epoch, &epoch, epoch+1, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void rcu_call(rcu_head* head, void (*func)(void*), void* obj)
+{
+	int oldpre = preempt_off;
+	rlnode_init(&head->node, head);
+	head->func = func;
+	head->obj = obj;
+	head->epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+	rlist_push_back(&cctx[cpu_core_id].rcu_pending, &head->node);
+	if(oldpre) preempt_on;
+}
+
+void rcu_free(rcu_head* head, void* ptr)
+{
+	rcu_call(head, free, ptr);
+}
+
+void rcu_quiescent()
+{
+	CCB* core = &cctx[cpu_core_id];
+	unsigned int epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+	if(core->rcu_seen != epoch)
+		__atomic_store_n(&core->rcu_seen, epoch, __ATOMIC_SEQ_CST);
+
+	if(is_rlist_empty(&core->rcu_pending)) return;
+
+	rcu_advance(epoch);
+	epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+	while(! is_rlist_empty(&core->rcu_pending)) {
+		rcu_head* head = core->rcu_pending.next->obj;
+		if(epoch - head->epoch < 2) break;
+		rlist_pop_front(&core->rcu_pending);
+		head->func(head->obj);
+	}
+}
+
+void rcu_flush()
+{
+	CCB* core = &cctx[cpu_core_id];
+	while(! is_rlist_empty(&core->rcu_pending)) {
+		rcu_head* head = rlist_pop_front(&core->rcu_pending)->obj;
+		head->func(head->obj);
+	}
+}
+
+
+
+
+/*
+ *
+ * Kernel waits
+ *
+ */
+
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
+/*
+  The kernel signals hand the core to the first waiter. The signaller
+  is usually about to block in kernel_wait() (e.g., a pipe writer that
+  waits for the reply), and then the waiter runs next on this core, for
+  the rest of the timeslice, instead of waiting at some run queue.
+ */
+void kernel_signal(CondVar* cv) 
+{ 
+	spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
+	cv_signal(cv, sched_wakeup_handoff);
+	spin_unlock(&(cv->waitset_lock));
+}
+
+void kernel_broadcast(CondVar* cv) 
+{ 
+	spinlock_acquire(&(cv->waitset_lock), "CondVar.waitset_lock");
+	cv_signal(cv, sched_wakeup_handoff);
+	cv_broadcast(cv);
+	spin_unlock(&(cv->waitset_lock));
+}
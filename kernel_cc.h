@@ -32,37 +32,117 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+/**
+	@brief Lock a spinlock.
+
+	If preemption is on, the caller yields after spinning for a while.
+	Spinlocks protect short critical sections, e.g. the wait set of a
+	mutex or a condition variable, where a thread cannot sleep. The
+	scheduler uses ticket locks instead (see below).
+ */
+void spin_lock(spinlock_t* lock);
+
+/**
+	@brief Unlock a spinlock.
+ */
+void spin_unlock(spinlock_t* lock);
+
+/**
+	@brief Lock a ticket lock.
+
+	Waiters acquire the lock in FIFO order. This must be called in the
+	non-preemptive domain only, as the caller never yields while waiting.
+ */
+void ticket_lock(ticketlock_t* lock);
+
+/**
+	@brief Try to lock a ticket lock without waiting.
+
+	@returns 1 if the lock was acquired, else 0.
+ */
+int ticket_trylock(ticketlock_t* lock);
+
+/**
+	@brief Unlock a ticket lock.
  */
+void ticket_unlock(ticketlock_t* lock);
+
 
 /**
-	@brief Lock the kernel.
+	@brief Name a lock, for the lock statistics.
+
+	In a build with lock statistics (`make LOCKSTAT=1`), the kernel
+	counts the acquisitions, the contended acquisitions, the spins and
+	the yields, and measures the wait and hold time, of every lock
+	(@c Mutex, @c spinlock_t or @c ticketlock_t). The report, printed when
+	the VM shuts down, sums up the locks of the same name. Locks without
+	a name are reported under their type.
+
+	In a normal build, this does nothing.
  */
-void kernel_lock();
+#if defined(LOCK_STATISTICS)
+void lockstat_name(void* lock, const char* name);
+#else
+static inline void lockstat_name(void* lock, const char* name) { }
+#endif
 
 /**
-	@brief Unlock the kernel.
+	@brief Print the lock statistics to stderr, and reset them.
+
+	This is called by @c boot() after the VM shuts down. In a normal
+	build, this does nothing.
+ */
+#if defined(LOCK_STATISTICS)
+void lockstat_report();
+#else
+static inline void lockstat_report() { }
+#endif
+
+
+/*
+ * Kernel synchronization.
+ *
+ * There is no global kernel lock. Each kernel object (the process table,
+ * the file table, each pipe, the port map) is protected by its own Mutex,
+ * and system calls wait on kernel conditions releasing that Mutex.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	The mutex must be locked by the caller. It is released while the
+	thread sleeps, and it is locked again before the call returns.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
+/** @brief Wait morphing for condition variables.
+
+	When this is set (the default), a waiter signalled while its mutex
+	is locked is moved to the waitset of the mutex, instead of being woken
+	up; it is woken up when the mutex is unlocked. It can be changed
+	before @c boot, for benchmarking.
+ */
+extern int cv_wait_morphing;
+
+/** @brief Priority inheritance for mutexes.
+
+	When this is set (the default), a thread that sleeps waiting for a
+	mutex lends its priority level to the owner of the mutex, until the
+	owner unlocks a mutex that has waiters (see @c sched_inherit). It can 
+	be changed before @c boot, for benchmarking.
+ */
+extern int mutex_priority_inheritance;
 
 /**
 	@brief Signal a kernel condition to one waiter.
-
-	This call must be made 
   */
 void kernel_signal(CondVar* cv);
 
@@ -72,15 +152,6 @@ void kernel_signal(CondVar* cv);
 void kernel_broadcast(CondVar* cv);
 
 
-/**
-	@brief Put thread to sleep, unlocking the kernel.
-
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
-  */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
-
-
 
 /** @brief Set the preemption status for the current core.
 
@@ -108,6 +179,75 @@ void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 #define preempt_on  cpu_enable_interrupts()
 
 
+/** @brief A callback deferred by RCU (see @c rcu_call).
+
+	An object that is read under @c rcu_read_lock embeds one of these, to
+	be released after all readers that may have seen it are done.
+ */
+typedef struct rcu_head {
+	rlnode node;				/**< @brief In the callback list of a core */
+	void (*func)(void* obj);	/**< @brief The callback */
+	void* obj;					/**< @brief The argument of the callback */
+	unsigned int epoch;			/**< @brief The RCU epoch when the callback was queued */
+} rcu_head;
+
+/** @brief Begin an RCU read-side critical section.
+
+	Between @c rcu_read_lock and @c rcu_read_unlock, a thread may follow
+	pointers to objects whose release is deferred with @c rcu_call, 
+	without any lock; the objects stay valid until the section ends.
+	The section is not preemptible, and it must not sleep or yield.
+	Sections may nest.
+
+	@code
+	int oldpre = rcu_read_lock();
+	socket_cb* scb = __atomic_load_n(&PORTMAP[port], __ATOMIC_ACQUIRE);
+	...
+	rcu_read_unlock(oldpre);
+	@endcode
+
+	@returns the previous preemption status, to pass to @c rcu_read_unlock
+ */
+static inline int rcu_read_lock() { return preempt_off; }
+
+/** @brief End an RCU read-side critical section.
+	@see rcu_read_lock
+ */
+static inline void rcu_read_unlock(int oldpre) { if(oldpre) preempt_on; }
+
+/** @brief Call a function after an RCU grace period.
+
+	The caller has already unlinked an object, so that new readers cannot
+	find it. After every reader that may still hold it has left its 
+	read-side section, @c func(obj) is called by the current core, from 
+	the scheduler (in @c gain). Therefore, @c func must not sleep or take
+	a Mutex.
+
+	@param head the rcu_head, usually embedded in @c obj
+	@param func the function to call
+	@param obj the argument of @c func
+ */
+void rcu_call(rcu_head* head, void (*func)(void*), void* obj);
+
+/** @brief Free a block with @c free(), after an RCU grace period.
+	@see rcu_call
+ */
+void rcu_free(rcu_head* head, void* ptr);
+
+/** @brief Report a quiescent state of the current core.
+
+	This is called by the scheduler, when the core switches threads. 
+	It also runs the callbacks of the core whose grace period is over.
+ */
+void rcu_quiescent();
+
+/** @brief Run all the callbacks of the current core, without waiting.
+
+	This is called when the core stops scheduling, and no readers remain.
+ */
+void rcu_flush();
+
+
 #endif
 
 
@@ -68,7 +68,7 @@ void serial_tx_handler();
 
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
+  Mutex lock;
   CondVar rx_ready;
 } serial_dcb_t;
 
@@ -103,6 +103,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->lock);
 
   uint count =  0;
 
@@ -113,12 +114,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->lock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->lock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -210,7 +212,8 @@ void initialize_devices()
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].lock = MUTEX_INIT;
+    lockstat_name(&serial_dcb[i].lock, "serial_dcb.lock");
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -224,7 +227,7 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
   if(minor >= devtable[major].devnum)
     return -1;
   *obj = devtable[major].dev_fops.Open(minor);
-  *ops = &devtable[major].dev_fops;
+  __atomic_store_n(ops, &devtable[major].dev_fops, __ATOMIC_RELEASE);
   return 0;
 }
 
@@ -9,6 +9,8 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_socket.h"
+#include "kernel_cc.h"
 
 
 
@@ -26,6 +28,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  sched_policy policy;
 } boot_rec;
 
 
@@ -38,7 +41,8 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_sockets();
+    initialize_scheduler(boot_rec.policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -66,6 +70,14 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.args = args;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  lockstat_report();
+}
+
+
+void set_boot_policy(sched_policy policy)
+{
+  boot_rec.policy = policy;
 }
 
 
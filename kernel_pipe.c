@@ -32,6 +32,8 @@ static file_ops writer_operations = {
 pipe_cb* init_pipe(FCB* fcb[2]){
 	pipe_cb* pipe = (pipe_cb*)xmalloc(sizeof(pipe_cb));
 
+	pipe->lock = MUTEX_INIT;
+	lockstat_name(&pipe->lock, "pipe_cb.lock");
 	pipe->reader = fcb[0];
 	pipe->writer = fcb[1];
 	
@@ -41,6 +43,8 @@ pipe_cb* init_pipe(FCB* fcb[2]){
 	pipe->w_position = 0;
 	pipe->r_position = 0;
 
+	pipe->refcount = 2;
+
 	return pipe;
 }
 
@@ -68,13 +72,50 @@ int sys_Pipe(pipe_t* pipe)
 
 	fcb[0]->streamobj = pipeCB;
 	fcb[1]->streamobj = pipeCB;
-	fcb[0]->streamfunc = &reader_operations;
-	fcb[1]->streamfunc = &writer_operations;
+	__atomic_store_n(&fcb[0]->streamfunc, &reader_operations, __ATOMIC_RELEASE);
+	__atomic_store_n(&fcb[1]->streamfunc, &writer_operations, __ATOMIC_RELEASE);
+	FCB_publish(2, fid, fcb);
 
 	return 0;
 }
 
 
+/*
+	Copy up to n bytes into the buffer, as many as fit, in at most two
+	pieces around the end of the buffer. Returns the number of bytes copied.
+ */
+static int pipe_copy_in(pipe_cb* pipe, const char* buf, unsigned int n)
+{
+	int used = (pipe->w_position - pipe->r_position + PIPE_BUFFER_SIZE) % PIPE_BUFFER_SIZE;
+	int count = PIPE_BUFFER_SIZE - 1 - used;
+	if(count > n) count = n;
+
+	int first = PIPE_BUFFER_SIZE - pipe->w_position;
+	if(first > count) first = count;
+	memcpy(pipe->BUFFER + pipe->w_position, buf, first);
+	memcpy(pipe->BUFFER, buf + first, count - first);
+	pipe->w_position = (pipe->w_position + count) % PIPE_BUFFER_SIZE;
+	return count;
+}
+
+/*
+	Copy up to n bytes out of the buffer, as many as are available.
+	Returns the number of bytes copied.
+ */
+static int pipe_copy_out(pipe_cb* pipe, char* buf, unsigned int n)
+{
+	int count = (pipe->w_position - pipe->r_position + PIPE_BUFFER_SIZE) % PIPE_BUFFER_SIZE;
+	if(count > n) count = n;
+
+	int first = PIPE_BUFFER_SIZE - pipe->r_position;
+	if(first > count) first = count;
+	memcpy(buf, pipe->BUFFER + pipe->r_position, first);
+	memcpy(buf + first, pipe->BUFFER, count - first);
+	pipe->r_position = (pipe->r_position + count) % PIPE_BUFFER_SIZE;
+	return count;
+}
+
+
 /** @brief Write operation.
 
 Write up to 'size' bytes from 'buf' to the stream 'this'.
@@ -85,25 +126,27 @@ int pipe_write(void* pipecb_t, const char* buf, unsigned int n){
 	
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
 	
-	if(pipe == NULL || pipe->reader == NULL || pipe->writer == NULL)
+	if(pipe == NULL) return -1;
+
+	Mutex_Lock(&(pipe->lock));
+	if(pipe->reader == NULL || pipe->writer == NULL) {
+		Mutex_Unlock(&(pipe->lock));
 		return -1;
+	}
 
-	int position = 0;
-	
-	
 	while(check_condition(pipe)) 
-		kernel_wait(&(pipe->has_space), SCHED_PIPE);
+		kernel_wait(&(pipe->lock), &(pipe->has_space), SCHED_PIPE);
 
-	
-	while(position != n && position < PIPE_BUFFER_SIZE) {
-		if(check_condition(pipe)) break;
-
-		pipe->BUFFER[pipe->w_position] = buf[position];
-		pipe->w_position = (pipe->w_position + 1)% PIPE_BUFFER_SIZE;
-		position++;
+	/* The reader may have closed while we waited */
+	if(pipe->reader == NULL) {
+		Mutex_Unlock(&(pipe->lock));
+		return -1;
 	}
 
+	int position = pipe_copy_in(pipe, buf, n);
+
 	kernel_broadcast(&(pipe->has_data));
+	Mutex_Unlock(&(pipe->lock));
 	return position;
 }
 
@@ -127,38 +170,67 @@ int pipe_read(void* pipecb_t, char* buf, unsigned int n){
 	
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
 
-	if(pipe == NULL || pipe->reader == NULL) return -1;
+	if(pipe == NULL) return -1;
+
+	Mutex_Lock(&(pipe->lock));
+	if(pipe->reader == NULL) {
+		Mutex_Unlock(&(pipe->lock));
+		return -1;
+	}
 
 	int position = 0;
 	if(pipe->writer == NULL){
-		while(pipe->r_position < pipe->w_position){
-			if(position == n) return position;
-
-			buf[position] = pipe->BUFFER[pipe->r_position];
-			pipe->r_position = (pipe->r_position + 1) % PIPE_BUFFER_SIZE;
-			position++;
-		}
-
+		position = pipe_copy_out(pipe, buf, n);
+		Mutex_Unlock(&(pipe->lock));
 		return position;
 	}
 
 	while(pipe->r_position == pipe->w_position && pipe->writer != NULL)
-		kernel_wait(&(pipe->has_data), SCHED_PIPE);
+		kernel_wait(&(pipe->lock), &(pipe->has_data), SCHED_PIPE);
 
-	while(position != n && position < PIPE_BUFFER_SIZE){
-		if(pipe->r_position == pipe->w_position) break;
-
-		buf[position] = pipe->BUFFER[pipe->r_position];
-		pipe->r_position = (pipe->r_position + 1) % PIPE_BUFFER_SIZE;
-		position++;
-	}
+	position = pipe_copy_out(pipe, buf, n);
 
 
 	kernel_broadcast(&(pipe->has_space));
+	Mutex_Unlock(&(pipe->lock));
 	return position;
 }
 
 
+/*
+	A pipe is freed when both its ends are released. The ends belong to
+	the reader and writer FCBs, or to the two sockets of a connection, each
+	of which holds one end of each of its two pipes. Like the sockets, the
+	pipe is freed after an RCU grace period.
+ */
+static void pipe_release(pipe_cb* pipe)
+{
+	if(__atomic_sub_fetch(&pipe->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		rcu_free(&pipe->rcu, pipe);
+}
+
+int pipe_writer_shutdown(pipe_cb* pipe)
+{
+	if(pipe == NULL) return -1;
+
+	Mutex_Lock(&(pipe->lock));
+	pipe->writer = NULL;
+	kernel_broadcast(&(pipe->has_data));
+	Mutex_Unlock(&(pipe->lock));
+	return 0;
+}
+
+int pipe_reader_shutdown(pipe_cb* pipe)
+{
+	if(pipe == NULL) return -1;
+
+	Mutex_Lock(&(pipe->lock));
+	pipe->reader = NULL;
+	kernel_broadcast(&(pipe->has_space));
+	Mutex_Unlock(&(pipe->lock));
+	return 0;
+}
+
 /** @brief Close writer operation.
 
 Close the stream object, deallocating any resources held by it.
@@ -169,17 +241,8 @@ This function returns 0 is it was successful and -1 if not.
 int pipe_writer_close(void* _pipecb){
 	pipe_cb* pipe = (pipe_cb*) _pipecb;
 
-	if(pipe == NULL) return -1;
-
-	pipe->writer = NULL;
-
-	if(pipe->reader == NULL){
-		pipe = NULL;
-		free(pipe);
-		return 0;
-	}
-	
-	kernel_broadcast(&(pipe->has_data));
+	if(pipe_writer_shutdown(pipe) != 0) return -1;
+	pipe_release(pipe);
 	return 0;
 }
 
@@ -193,18 +256,8 @@ This function returns 0 is it was successful and -1 if not.
 int pipe_reader_close(void* _pipecb){
 	pipe_cb* pipe = (pipe_cb*) _pipecb;
 
-	if(pipe == NULL) return -1;
-
-	pipe->reader = NULL;
-
-	if(pipe->writer == NULL){
-		pipe = NULL;
-		free(pipe);
-		return 0;
-	}
-	
-
-	kernel_broadcast(&(pipe->has_space));
+	if(pipe_reader_shutdown(pipe) != 0) return -1;
+	pipe_release(pipe);
 	return 0;
 }
 
@@ -16,6 +16,7 @@
 #include "tinyos.h"
 #include "util.h"
 #include "kernel_dev.h"
+#include "kernel_cc.h"
 
 /*******************************************
  *
@@ -32,6 +33,8 @@
   are stored all the metadata that relate to the thread.
 */
 typedef struct pipe_control_block {
+  Mutex lock;        /**< @brief protects the pipe; held while waiting on its conditions */
+
   FCB* reader;
   FCB* writer;
 
@@ -42,6 +45,9 @@ typedef struct pipe_control_block {
   int r_position; /**< @brief read position in buffer */
 
   char BUFFER[PIPE_BUFFER_SIZE]; /**< @brief bounded (cyclic) byte buffer */
+
+  int refcount;      /**< @brief The ends not yet released; the pipe is freed at 0 (atomic) */
+  rcu_head rcu;      /**< @brief Defers the free of the pipe */
 } pipe_cb;
 
 
@@ -114,6 +120,21 @@ int pipe_writer_close(void* _pipecb);
 
 int pipe_reader_close(void* _pipecb);
 
+/** @brief Shut down the write end of a pipe, without releasing it.
+
+Reads return 0 once the buffer is empty. The end must still be released
+with @c pipe_writer_close. Shutting down an end twice is not an error.
+This is used by sockets, whose pipes are released when they are closed.
+*/
+int pipe_writer_shutdown(pipe_cb* pipe);
+
+/** @brief Shut down the read end of a pipe, without releasing it.
+
+Writes return -1. The end must still be released with @c pipe_reader_close.
+@see pipe_writer_shutdown
+*/
+int pipe_reader_shutdown(pipe_cb* pipe);
+
 int return_error(void* pipe_t, char *buf, unsigned int n);
 
 int return_error_const(void* pipe_t, const char *buf, unsigned int n);
@@ -0,0 +1,502 @@
+
+#include <assert.h>
+
+#include "kernel_sched.h"
+#include "util.h"
+
+
+/**
+	@file kernel_policy.c
+
+	@brief The scheduling policies.
+
+	Each policy orders the ready threads in the run queue of a core,
+	and adjusts the scheduling data of a thread at the end of each
+	timeslice. The policy is selected at boot (see @c set_boot_policy).
+
+	All run queue operations are called with @c core->rq_lock held.
+  */
+
+
+/* Return the first thread in list that may run on core c, or NULL.
+   Normally, this is the head of the list. */
+static rlnode* rq_list_find(rlnode* list, uint c)
+{
+	for (rlnode* n = list->next; n != list; n = n->next)
+		if (sched_allowed(n->tcb, c))
+			return n;
+	return NULL;
+}
+
+static void noop_on_tick(CCB* core) { }
+
+static TimerDuration default_quantum(TCB* tcb) { return QUANTUM; }
+
+static void noop_init_thread(TCB* tcb) { }
+
+static int never_preempts(TCB* tcb, TCB* current) { return 0; }
+
+
+/***************************************
+ *
+ * Multi-level feedback queue
+ *
+ ***************************************/
+
+/* Every this many usec, all threads are boosted to the top level */
+#define MLFQ_BOOST_PERIOD (100*QUANTUM)
+
+/* Define this to select the next MLFQ level by a linear scan of the run
+   queue, instead of the bitmap (see rq_highest()). Used to compare the two:
+   uncomment the line below, run 'make' (kernel_policy.o is rebuilt) and
+   then './validate_api bench_yield_latency'. */
+//#define SCHED_LINEAR_SCAN
+
+/*
+  The bitmap of non-empty MLFQ levels of a run queue.
+*/
+static inline void rq_bitmap_set(CCB* core, int level)
+{
+	core->rq_bitmap[level / 64] |= (uint64_t)1 << (level % 64);
+}
+
+static inline void rq_bitmap_clear(CCB* core, int level)
+{
+	core->rq_bitmap[level / 64] &= ~((uint64_t)1 << (level % 64));
+}
+
+/*
+  Return the highest non-empty level of the run queue, or -1 if
+  the run queue is empty. With SCHED_LINEAR_SCAN defined above, the
+  levels are scanned one by one and the bitmap is not read.
+ */
+static inline int rq_highest(CCB* core)
+{
+#ifndef SCHED_LINEAR_SCAN
+	for (int w = RQ_BITMAP_WORDS - 1; w >= 0; w--)
+		if (core->rq_bitmap[w])
+			return 64 * w + 63 - __builtin_clzll(core->rq_bitmap[w]);
+#else
+	for (int i = QUEUE_NUMBER - 1; i >= 0; i--)
+		if (!is_rlist_empty(&core->rq[i]))
+			return i;
+#endif
+	return -1;
+}
+
+/* 
+  The time slice of each level. A thread that exhausts its slice is demoted
+  by one level, so the slice doubles every 8 demotions, up to 8 quanta.
+  The top levels, which hold threads doing I/O, get half a quantum.
+ */
+TimerDuration mlfq_quantum[QUEUE_NUMBER] = {
+	[0 ... QUEUE_NUMBER-25] = 8*QUANTUM,
+	[QUEUE_NUMBER-24 ... QUEUE_NUMBER-17] = 4*QUANTUM,
+	[QUEUE_NUMBER-16 ... QUEUE_NUMBER-9] = 2*QUANTUM,
+	[QUEUE_NUMBER-8 ... QUEUE_NUMBER-3] = QUANTUM,
+	[QUEUE_NUMBER-2 ... QUEUE_NUMBER-1] = QUANTUM/2
+};
+
+/*
+  The priority boost.
+
+  Periodically, all threads are moved to the top level, so that threads
+  demoted to the bottom levels do not starve. Instead of moving every
+  thread, a boost just advances the global boost epoch, in O(1). Each
+  thread and each run queue remember the epoch they last saw, and they
+  catch up lazily:
+  - a thread is moved to the top level when it is next enqueued, selected
+    or when it yields, 
+  - a run queue is merged into its top level (in O(QUEUE_NUMBER), no
+    matter how many threads it holds) when it is next used.
+ */
+static volatile unsigned int mlfq_epoch;
+static volatile TimerDuration mlfq_last_boost;
+
+/* Move a thread of an old epoch to the top level */
+static inline void mlfq_refresh(TCB* tcb)
+{
+	unsigned int epoch = mlfq_epoch;
+	if (tcb->boost_epoch != epoch) {
+		tcb->priority = QUEUE_NUMBER - 1;
+		tcb->boost_epoch = epoch;
+	}
+}
+
+/* Merge the run queue of an old epoch into its top level, in level order */
+static void mlfq_catch_up(CCB* core)
+{
+	unsigned int epoch = mlfq_epoch;
+	if (core->rq_epoch == epoch)
+		return;
+
+	for (int prior = rq_highest(core); prior >= 0; prior--) {
+		if (prior < QUEUE_NUMBER - 1 && !is_rlist_empty(&core->rq[prior]))
+			rlist_append(&core->rq[QUEUE_NUMBER - 1], &core->rq[prior]);
+	}
+	for (int w = 0; w < RQ_BITMAP_WORDS; w++)
+		core->rq_bitmap[w] = 0;
+	if (!is_rlist_empty(&core->rq[QUEUE_NUMBER - 1]))
+		rq_bitmap_set(core, QUEUE_NUMBER - 1);
+
+	core->rq_epoch = epoch;
+}
+
+static void mlfq_init(CCB* core)
+{
+	for (int i = 0; i < QUEUE_NUMBER; ++i)
+		rlnode_init(&core->rq[i], NULL);
+	for (int w = 0; w < RQ_BITMAP_WORDS; w++)
+		core->rq_bitmap[w] = 0;
+
+	/* This is the same for every core */
+	mlfq_epoch = 0;
+	mlfq_last_boost = bios_clock();
+	core->rq_epoch = 0;
+}
+
+static void mlfq_init_thread(TCB* tcb)
+{
+	tcb->priority = QUEUE_NUMBER/2; /* It is logical to assume that the priority of a thread in the SCHED list should be in the middle of the list, 
+					                   neither the highest nor the lowest. */
+	tcb->boost_epoch = mlfq_epoch;
+}
+
+/* The level of a thread, raised to its inherited level */
+static inline int mlfq_effective(TCB* tcb)
+{
+	int inherited = __atomic_load_n(&tcb->inherited, __ATOMIC_RELAXED);
+	return (inherited > tcb->priority) ? inherited : tcb->priority;
+}
+
+static void mlfq_enqueue(CCB* core, TCB* tcb)
+{
+	mlfq_catch_up(core);
+	mlfq_refresh(tcb);
+	tcb->rq_level = mlfq_effective(tcb);
+	rlist_push_back(&core->rq[tcb->rq_level], &tcb->sched_node);
+	rq_bitmap_set(core, tcb->rq_level);
+}
+
+static TCB* mlfq_pick_next(CCB* core, uint c)
+{
+	mlfq_catch_up(core);
+	int max_prior = rq_highest(core);
+
+	/* Search the non-empty lists, highest first */
+	for (int prior = max_prior; prior >= 0; prior--) {
+		if (is_rlist_empty(&core->rq[prior]))
+			continue;
+		rlnode* sel = rq_list_find(&core->rq[prior], c);
+		if (sel != NULL) {
+			rlist_remove(sel);
+			if (is_rlist_empty(&core->rq[prior]))
+				rq_bitmap_clear(core, prior);
+			mlfq_refresh(sel->tcb);
+			return sel->tcb;
+		}
+	}
+	return NULL;
+}
+
+/* The thread may be in rq[rq_level], or in the top level after a catch-up */
+static void mlfq_remove(CCB* core, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&core->rq[tcb->rq_level]))
+		rq_bitmap_clear(core, tcb->rq_level);
+	if (is_rlist_empty(&core->rq[QUEUE_NUMBER - 1]))
+		rq_bitmap_clear(core, QUEUE_NUMBER - 1);
+	mlfq_refresh(tcb);
+}
+
+static void mlfq_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration used)
+{
+	mlfq_refresh(tcb);
+
+	/* if the thread is waiting for I/O grant it the highest priority */
+	if(cause == SCHED_IO && tcb->priority < QUEUE_NUMBER-1)
+		tcb->priority++;
+
+	/* if the thread's quantum has expired decrease its priority */
+	if(cause == SCHED_QUANTUM && tcb->priority > 0)
+		tcb->priority--;
+}
+
+static void mlfq_on_tick(CCB* core)
+{
+	/* Advance the boost epoch, if it is time. Only one core will succeed. */
+	TimerDuration last = mlfq_last_boost;
+	TimerDuration now = bios_clock();
+	if (now - last >= MLFQ_BOOST_PERIOD
+		&& __atomic_compare_exchange_n(&mlfq_last_boost, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&mlfq_epoch, 1, __ATOMIC_RELEASE);
+}
+
+static TimerDuration mlfq_quantum_of(TCB* tcb)
+{
+	return mlfq_quantum[tcb->priority];
+}
+
+/* The level of a thread, taking a pending boost and inheritance into account */
+static int mlfq_level(TCB* tcb)
+{
+	return (tcb->boost_epoch != mlfq_epoch) ? QUEUE_NUMBER - 1 : mlfq_effective(tcb);
+}
+
+static int mlfq_preempts(TCB* tcb, TCB* current)
+{
+	return mlfq_level(tcb) > mlfq_level(current);
+}
+
+const sched_policy_ops mlfq_policy = {
+	.name = "mlfq",
+	.init = mlfq_init,
+	.init_thread = mlfq_init_thread,
+	.enqueue = mlfq_enqueue,
+	.pick_next = mlfq_pick_next,
+	.remove = mlfq_remove,
+	.on_yield = mlfq_on_yield,
+	.on_tick = mlfq_on_tick,
+	.quantum = mlfq_quantum_of,
+	.preempts = mlfq_preempts,
+	.level = mlfq_level
+};
+
+
+/***************************************
+ *
+ * Round-robin
+ *
+ ***************************************/
+
+/* The round-robin policy uses only rq[0] of the core */
+
+static void rr_init(CCB* core)
+{
+	rlnode_init(&core->rq[0], NULL);
+}
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+	rlist_push_back(&core->rq[0], &tcb->sched_node);
+}
+
+static TCB* rr_pick_next(CCB* core, uint c)
+{
+	rlnode* sel = rq_list_find(&core->rq[0], c);
+	if (sel == NULL)
+		return NULL;
+	rlist_remove(sel);
+	return sel->tcb;
+}
+
+static void rr_remove(CCB* core, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+}
+
+static void rr_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration used) { }
+
+const sched_policy_ops rr_policy = {
+	.name = "rr",
+	.init = rr_init,
+	.init_thread = noop_init_thread,
+	.enqueue = rr_enqueue,
+	.pick_next = rr_pick_next,
+	.remove = rr_remove,
+	.on_yield = rr_on_yield,
+	.on_tick = noop_on_tick,
+	.quantum = default_quantum,
+	.preempts = never_preempts
+};
+
+
+/***************************************
+ *
+ * Fair share
+ *
+ ***************************************/
+
+/*
+  The fair policy runs the ready thread with the smallest virtual runtime,
+  i.e., the thread that has received the least CPU time. The ready threads
+  of a core are kept in an AVL tree ordered by (vruntime, address).
+
+  A thread that was sleeping (or is new) would have a very small vruntime,
+  and it would monopolize the core. Therefore, when a thread enters the run
+  queue, its vruntime is raised to at least core->min_vruntime less a small
+  credit, where core->min_vruntime tracks the vruntime of the threads
+  picked on the core.
+ */
+
+/* The vruntime credit given to a thread entering the run queue */
+#define FAIR_WAKEUP_CREDIT (QUANTUM/2)
+
+static inline int fair_height(TCB* t) { return t ? t->rq_height : 0; }
+
+static inline int fair_less(TCB* a, TCB* b)
+{
+	return a->vruntime < b->vruntime || (a->vruntime == b->vruntime && a < b);
+}
+
+static inline void fair_update(TCB* t)
+{
+	int hl = fair_height(t->rq_left), hr = fair_height(t->rq_right);
+	t->rq_height = 1 + (hl > hr ? hl : hr);
+}
+
+static TCB* fair_rotate_right(TCB* t)
+{
+	TCB* l = t->rq_left;
+	t->rq_left = l->rq_right;
+	l->rq_right = t;
+	fair_update(t);
+	fair_update(l);
+	return l;
+}
+
+static TCB* fair_rotate_left(TCB* t)
+{
+	TCB* r = t->rq_right;
+	t->rq_right = r->rq_left;
+	r->rq_left = t;
+	fair_update(t);
+	fair_update(r);
+	return r;
+}
+
+/* Restore the AVL property at t, whose subtrees are balanced */
+static TCB* fair_balance(TCB* t)
+{
+	fair_update(t);
+	int bf = fair_height(t->rq_left) - fair_height(t->rq_right);
+	if (bf > 1) {
+		if (fair_height(t->rq_left->rq_left) < fair_height(t->rq_left->rq_right))
+			t->rq_left = fair_rotate_left(t->rq_left);
+		return fair_rotate_right(t);
+	}
+	if (bf < -1) {
+		if (fair_height(t->rq_right->rq_right) < fair_height(t->rq_right->rq_left))
+			t->rq_right = fair_rotate_right(t->rq_right);
+		return fair_rotate_left(t);
+	}
+	return t;
+}
+
+static TCB* fair_insert(TCB* root, TCB* tcb)
+{
+	if (root == NULL) {
+		tcb->rq_left = tcb->rq_right = NULL;
+		tcb->rq_height = 1;
+		return tcb;
+	}
+	if (fair_less(tcb, root))
+		root->rq_left = fair_insert(root->rq_left, tcb);
+	else
+		root->rq_right = fair_insert(root->rq_right, tcb);
+	return fair_balance(root);
+}
+
+static TCB* fair_remove_min(TCB* root, TCB** min)
+{
+	if (root->rq_left == NULL) {
+		*min = root;
+		return root->rq_right;
+	}
+	root->rq_left = fair_remove_min(root->rq_left, min);
+	return fair_balance(root);
+}
+
+static TCB* fair_remove(TCB* root, TCB* tcb)
+{
+	assert(root != NULL);
+	if (root == tcb) {
+		if (root->rq_left == NULL) return root->rq_right;
+		if (root->rq_right == NULL) return root->rq_left;
+
+		TCB* succ;
+		TCB* right = fair_remove_min(root->rq_right, &succ);
+		succ->rq_left = root->rq_left;
+		succ->rq_right = right;
+		return fair_balance(succ);
+	}
+	if (fair_less(tcb, root))
+		root->rq_left = fair_remove(root->rq_left, tcb);
+	else
+		root->rq_right = fair_remove(root->rq_right, tcb);
+	return fair_balance(root);
+}
+
+/* Return the leftmost thread of the tree that may run on core c */
+static TCB* fair_find(TCB* t, uint c)
+{
+	if (t == NULL)
+		return NULL;
+	TCB* sel = fair_find(t->rq_left, c);
+	if (sel != NULL)
+		return sel;
+	if (sched_allowed(t, c))
+		return t;
+	return fair_find(t->rq_right, c);
+}
+
+static void fair_init(CCB* core)
+{
+	core->rq_root = NULL;
+	core->min_vruntime = 0;
+}
+
+static void fair_init_thread(TCB* tcb)
+{
+	tcb->vruntime = 0;
+}
+
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+	if (core->min_vruntime > FAIR_WAKEUP_CREDIT
+		&& tcb->vruntime < core->min_vruntime - FAIR_WAKEUP_CREDIT)
+		tcb->vruntime = core->min_vruntime - FAIR_WAKEUP_CREDIT;
+	core->rq_root = fair_insert(core->rq_root, tcb);
+}
+
+static TCB* fair_pick_next(CCB* core, uint c)
+{
+	TCB* sel = fair_find(core->rq_root, c);
+	if (sel == NULL)
+		return NULL;
+	core->rq_root = fair_remove(core->rq_root, sel);
+	if (sel->vruntime > core->min_vruntime)
+		core->min_vruntime = sel->vruntime;
+	return sel;
+}
+
+static void fair_remove_thread(CCB* core, TCB* tcb)
+{
+	core->rq_root = fair_remove(core->rq_root, tcb);
+}
+
+static void fair_on_yield(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration used)
+{
+	tcb->vruntime += used;
+}
+
+/* The vruntime of the running thread is only updated when it yields, 
+   therefore it may lag by up to a quantum. */
+static int fair_preempts(TCB* tcb, TCB* current)
+{
+	return tcb->vruntime + QUANTUM < current->vruntime;
+}
+
+const sched_policy_ops fair_policy = {
+	.name = "fair",
+	.init = fair_init,
+	.init_thread = fair_init_thread,
+	.enqueue = fair_enqueue,
+	.pick_next = fair_pick_next,
+	.remove = fair_remove_thread,
+	.on_yield = fair_on_yield,
+	.on_tick = noop_on_tick,
+	.quantum = default_quantum,
+	.preempts = fair_preempts
+};
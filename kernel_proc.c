@@ -21,6 +21,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* The process table lock */
+Mutex proc_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -56,6 +59,8 @@ static PCB* pcb_freelist;
 
 void initialize_processes()
 {
+  lockstat_name(&proc_lock, "proc_lock");
+
   /* initialize the PCBs */
   for(Pid_t p=0; p<MAX_PROC; p++) {
     initialize_PCB(&PT[p]);
@@ -79,7 +84,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -127,7 +132,7 @@ PTCB* initialize_PTCB(PCB* pcb)
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -169,9 +174,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   PCB *curproc, *newproc;
   
   /* The new process PCB */ 
+  Mutex_Lock(&proc_lock);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    Mutex_Unlock(&proc_lock);
+    goto finish;  /* We have run out of PIDs! */
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
@@ -186,14 +195,12 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Add new process to the parent's child list */ 
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
-
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
   }
+  Mutex_Unlock(&proc_lock);
+
+  /* Inherit file streams from parent */
+  if(get_pid(newproc) > 1)
+    FCB_inherit(newproc, CURPROC);
 
 
   /* Set the main thread's function */
@@ -214,16 +221,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, 0);
     PTCB* ptcb = initialize_PTCB(newproc);
-    
-    rlnode* node = (rlnode*)xmalloc(sizeof(rlnode));
 
     assert(ptcb!=NULL);
     
-    rlnode_new(node)->ptcb = ptcb;
     rlnode_init(& newproc->ptcb_list, NULL);
-    rlist_push_back(&(newproc->ptcb_list), node);
+    rlist_push_back(&(newproc->ptcb_list), &ptcb->ptcb_list_node);
     newproc->thread_count++;
 
     wakeup(newproc->main_thread);
@@ -243,7 +247,11 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent changes when the process is reparented to init */
+  Mutex_Lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_lock);
+  return ppid;
 }
 
 
@@ -278,7 +286,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -302,7 +310,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -319,15 +327,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_lock);
+  return cpid;
 }
 
 
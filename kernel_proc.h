@@ -65,6 +65,16 @@ typedef struct process_control_block {
 } PCB;
 
 
+/**
+  @brief The process table lock.
+
+  This mutex protects the process table and the process tree (the parent,
+  children and exited lists), as well as the threads of each process
+  (the PTCB list and the state of each PTCB).
+*/
+extern Mutex proc_lock;
+
+
 /**
   @brief Initialize the process table.
 
@@ -39,6 +39,9 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
+/* The scheduling policy, selected at boot */
+static const sched_policy_ops* SCHED_POLICY = &mlfq_policy;
+
 
 /*
 	This can be used in the preemptive context to
@@ -58,27 +61,33 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On x86, the stack grows downward. Each thread is allocated a memory block
+  by mmap, with the TCB at the top and the stack below it. The lowest page of 
+  the block is a guard page, which is made inaccessible.
 
   +-------------+
   |   TCB       |
   +-------------+
-  |             |
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: (a) unified memory area for stack and TCB (b) stack overrun hits
+  the guard page and crashes the thread with a segmentation fault, instead of 
+  corrupting the TCB or other memory (c) the pages of the stack are committed
+  lazily, when they are first touched, so a thread only costs the stack
+  it uses.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  we do not support stack growth anyway! Also, each thread costs two memory
+  mappings of the process (the kernel limits their number, see 
+  /proc/sys/vm/max_map_count).
  */
 
 /*
@@ -86,13 +95,6 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
-
-/**
- * @brief keeps track of the number of yields made. utilized in yield() and upgrade()
- * 
- */
-int numOfYieldCalls = 0;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -101,49 +103,99 @@ int numOfYieldCalls = 0;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
-#if 1 /* This is used in order to compare between R-R and MLFQ implementations */
-#define QUEUE_NUMBER 256
-#endif
-
-#define CALL_LIMIT 128
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (SYSTEM_PAGE_SIZE + (stack_size) + THREAD_TCB_SIZE)
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The base of the memory block of a thread */
+#define THREAD_BASE(tcb) ((void*)(tcb) - (tcb)->stack_size - SYSTEM_PAGE_SIZE)
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Allocate the memory block of a thread, and return the address of its TCB.
+  The memory is reserved with MAP_NORESERVE, so that it is not counted against
+  the commit limit of the host before it is used.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
-
-void* allocate_thread(size_t size)
+static TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-
+	void* ptr = mmap(NULL, THREAD_SIZE(stack_size), PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
-	return ptr;
+	/* The guard page */
+	CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_NONE));
+
+	TCB* tcb = (TCB*)(ptr + SYSTEM_PAGE_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
 }
-#else
+
+static void free_thread(TCB* tcb)
+{
+	CHECK(munmap(THREAD_BASE(tcb), THREAD_SIZE(tcb->stack_size)));
+}
+
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+  The thread cache.
+
+  Allocating a thread block (the TCB and its stack) is expensive, mostly
+  because the stack is page-faulted in anew by every thread. Therefore,
+  each core keeps the blocks of the threads released on it in a list, up
+  to thread_cache_max blocks, and spawn_thread() reuses them. The blocks
+  are chained by their sched_node. Only blocks with the default stack size
+  are cached.
+
+  The cache of a core is only used by the core itself, with preemption off,
+  therefore it needs no lock. An idle core trims its cache to half of
+  thread_cache_max, and the cache is emptied when the scheduler exits.
+*/
+unsigned int thread_cache_max = 64;
 
-void* allocate_thread(size_t size)
+static TCB* thread_cache_get(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	if (stack_size != THREAD_STACK_SIZE)
+		return allocate_thread(stack_size);
+
+	int oldpre = preempt_off;
+	CCB* core = &CURCORE;
+	TCB* tcb = NULL;
+	if (core->thread_cache_size > 0) {
+		tcb = rlist_pop_front(&core->thread_cache)->tcb;
+		core->thread_cache_size--;
+		core->thread_cache_hits++;
+	} else
+		core->thread_cache_misses++;
+	if (oldpre)
+		preempt_on;
+
+	return (tcb != NULL) ? tcb : allocate_thread(stack_size);
 }
-#endif
 
+/* Called with preemption off */
+static void thread_cache_put(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+	if (tcb->stack_size == THREAD_STACK_SIZE && core->thread_cache_size < thread_cache_max) {
+		rlnode_init(&tcb->sched_node, tcb);
+		rlist_push_front(&core->thread_cache, &tcb->sched_node);
+		core->thread_cache_size++;
+	} else
+		free_thread(tcb);
+}
 
+/* Free blocks of the cache of this core, until at most keep are left */
+static void thread_cache_trim(unsigned int keep)
+{
+	int oldpre = preempt_off;
+	CCB* core = &CURCORE;
+	while (core->thread_cache_size > keep) {
+		/* The blocks at the back were used least recently */
+		TCB* tcb = rlist_pop_back(&core->thread_cache)->tcb;
+		core->thread_cache_size--;
+		free_thread(tcb);
+	}
+	if (oldpre)
+		preempt_on;
+}
 
 
 /*
@@ -165,10 +217,13 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	/* The stack size must be a multiple of page size */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+	TCB* tcb = thread_cache_get(stack_size);
 	PTCB* ptcb = spawn_PTCB(tcb, NULL, 0, NULL);
 
 	/* Set the owner */
@@ -177,10 +232,9 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	/* Set the ptcb*/
 	tcb->ptcb = ptcb;
 
-#ifdef QUEUE_NUMBER
-	tcb->priority = QUEUE_NUMBER/2; /* It is logical to assume that the priority of a thread in the SCHED list should be in the middle of the list, 
-					                   neither the highest nor the lowest. */
-#endif
+	SCHED_POLICY->init_thread(tcb);
+	tcb->inherited = -1;
+	tcb->rq_core = -1;
 
 	/* Initialize the other attributes */
 	tcb->type = NORMAL_THREAD;
@@ -194,27 +248,32 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	tcb->sched_lock = TICKETLOCK_INIT;
+	lockstat_name(&tcb->sched_lock, "TCB.sched_lock");
+	rlnode_init(&tcb->lenders, NULL);
+	tcb->lenders_lock = TICKETLOCK_INIT;
+	lockstat_name(&tcb->lenders_lock, "TCB.lenders_lock");
+	tcb->affinity = CPUMASK_ALL;
+	tcb->last_core = cpu_core_id;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) - tcb->stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called by gain(), after the TCB has been switched out for good.
  */
 void release_TCB(TCB* tcb)
 {
@@ -222,11 +281,9 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	thread_cache_put(tcb);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELEASE);
 }
 
 /***************************************
@@ -241,172 +298,535 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core owns a run queue (see CCB), protected by the core's
+  rq_lock. The order of the run queue is decided by the scheduling
+  policy (see kernel_policy.c), which is selected at boot.
+
+  The state and phase of each thread are protected by the sched_lock
+  of its TCB. Also, the scheduler contains a timing wheel of all the
+  sleeping threads with a timeout, protected by timeout_spinlock.
+
+  Lock order:  tcb->sched_lock  -->  timeout_spinlock  -->  rq_lock.
+  No two rq_locks are ever held at the same time.
+  The expiry of timeouts acquires a sched_lock while holding
+  timeout_spinlock, therefore it only ever tries to lock it.
+*/
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/*
+  Arm the core timer, accounting for the time used so far in the
+  current timeslice (see yield()).
+*/
+static void sched_set_alarm(CCB* core, TimerDuration usec)
+{
+	TimerDuration left = bios_set_timer(usec);
+	core->slice_used += core->slice_alarm - left;
+	core->slice_alarm = usec;
+}
+
+/*
+  The timeout wheel.
+  ------------------
+
+  Threads sleeping with a timeout are kept in a hierarchical timing
+  wheel, linked via their sched_node. Time is measured in ticks of
+  2^TW_TICK_SHIFT usec. Level L of the wheel has TW_SLOTS slots, each
+  covering TW_SLOTS^L ticks, so that insertion and cancellation are O(1).
+
+  As the wheel advances one tick at a time, the due slot of level 0 is
+  moved to the 'due' list, and whenever the index of a level wraps around,
+  the current slot of the next level is cascaded into the lower levels.
+  Each thread is cascaded at most TW_LEVELS-1 times, therefore expiry
+  is amortized O(1).
+
+  A thread is never woken before its wakeup_time, and at most one tick
+  after it.
+ */
+#define TW_TICK_SHIFT 10
+#define TW_LEVEL_BITS 6
+#define TW_SLOTS (1 << TW_LEVEL_BITS)
+#define TW_LEVELS 4
+
+/* Longest delay (in ticks) that fits in the wheel */
+#define TW_MAX_DELAY (((TimerDuration)1 << (TW_LEVEL_BITS * TW_LEVELS)) - 1)
+
+static struct {
+	rlnode slot[TW_LEVELS][TW_SLOTS];
+	rlnode due;                 /* expired threads not yet made ready */
+	volatile TimerDuration now; /* the last tick processed */
+	volatile unsigned int count;/* number of threads in the wheel or due */
+} TIMEOUT_WHEEL;
+
+ticketlock_t timeout_spinlock = TICKETLOCK_INIT; /* spinlock for TIMEOUT_WHEEL */
 
-  Both of these structures are protected by @c sched_spinlock.
+/*
+  Place a thread in the wheel, according to its wakeup time.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
 */
+static inline TimerDuration tw_tick(TCB* tcb)
+{
+	return (tcb->wakeup_time + (1 << TW_TICK_SHIFT) - 1) >> TW_TICK_SHIFT;
+}
 
-#ifdef QUEUE_NUMBER
-rlnode SCHED[QUEUE_NUMBER]; /* The scheduler queue. MLFQ implementation*/
-#else
-rlnode SCHED; /* The scheduler queue. Round Robin implementation. */
-#endif
+static void tw_insert(TCB* tcb)
+{
+	TimerDuration now = TIMEOUT_WHEEL.now;
+	TimerDuration tick = tw_tick(tcb);
+
+	if (tick <= now)
+		tick = now + 1;
+	if (tick - now > TW_MAX_DELAY)
+		tick = now + TW_MAX_DELAY; /* It will be re-inserted when cascaded */
+
+	TimerDuration delta = tick - now;
+	int level = 0;
+	while (delta >= TW_SLOTS) {
+		delta >>= TW_LEVEL_BITS;
+		level++;
+	}
+
+	uint idx = (tick >> (TW_LEVEL_BITS * level)) & (TW_SLOTS - 1);
+	rlist_push_back(&TIMEOUT_WHEEL.slot[level][idx], &tcb->sched_node);
+}
 
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/*
+  Advance the wheel up to tick 'curtick', moving expired threads to the
+  due list.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_advance(TimerDuration curtick)
+{
+	/* With nothing in the wheel, just jump ahead */
+	if (TIMEOUT_WHEEL.count == 0) {
+		if (curtick > TIMEOUT_WHEEL.now)
+			TIMEOUT_WHEEL.now = curtick;
+		return;
+	}
+
+	while (TIMEOUT_WHEEL.now < curtick) {
+		TimerDuration now = ++TIMEOUT_WHEEL.now;
+
+		/* Cascade higher levels whose index wrapped around */
+		for (int level = 1; level < TW_LEVELS; level++) {
+			if ((now >> (TW_LEVEL_BITS * (level - 1))) & (TW_SLOTS - 1))
+				break;
+			uint idx = (now >> (TW_LEVEL_BITS * level)) & (TW_SLOTS - 1);
+			rlnode* slot = &TIMEOUT_WHEEL.slot[level][idx];
+			while (!is_rlist_empty(slot)) {
+				TCB* tcb = rlist_pop_front(slot)->tcb;
+				if (tw_tick(tcb) <= now)
+					rlist_push_back(&TIMEOUT_WHEEL.due, &tcb->sched_node);
+				else
+					tw_insert(tcb);
+			}
+		}
+
+		/* Expire the current slot of level 0 */
+		rlist_append(&TIMEOUT_WHEEL.due, &TIMEOUT_WHEEL.slot[0][now & (TW_SLOTS - 1)]);
+	}
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
 /* Interrupt handle for inter-core interrupts */
 void ici_handler()
-{ /* noop for now... */
+{
+	/* A peer added threads to our run queue, restore the tick if needed */
+	CCB* core = &CURCORE;
+	if (core->tickless && core->rq_size > 0) {
+		core->tickless = 0;
+		sched_set_alarm(core, QUANTUM);
+	}
+
+	/* A peer woke up a thread that outranks our current thread */
+	if (core->preempt_pending) {
+		core->preempt_pending = 0;
+		if (core->rq_size > 0)
+			yield(SCHED_PREEMPT);
+	}
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the timeout wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
+		ticket_lock(&timeout_spinlock);
+
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		tcb->wakeup_time = curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		tw_insert(tcb);
+		TIMEOUT_WHEEL.count++;
+
+		ticket_unlock(&timeout_spinlock);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Remove TCB from the timeout wheel (or the due list).
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->sched_lock AND timeout_spinlock HELD ***
 */
-#ifdef QUEUE_NUMBER
-static void sched_queue_add(TCB* tcb)
+static void sched_cancel_timeout(TCB* tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	rlist_remove(&tcb->sched_node);
+	tcb->wakeup_time = NO_TIMEOUT;
+	TIMEOUT_WHEEL.count--;
+}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+/*
+  Choose the core whose run queue will receive a ready thread.
+
+  We prefer the core that ran the thread last, if it is idle, since its
+  cache is still warm. Else, we use the current core, so that the thread
+  can be stolen by idle peers. If the affinity of the thread excludes
+  both, we use the allowed core with the shortest run queue.
+*/
+static uint sched_place(TCB* tcb)
+{
+	uint cur = cpu_core_id;
+	uint last = tcb->last_core;
+
+	if (last != cur && last < cpu_cores() && sched_allowed(tcb, last)
+		&& cctx[last].current_thread == &cctx[last].idle_thread && cctx[last].rq_size == 0)
+		return last;
+
+	if (sched_allowed(tcb, cur))
+		return cur;
+
+	uint best = cur;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (!sched_allowed(tcb, c)) continue;
+		if (best == cur || cctx[c].rq_size < cctx[best].rq_size)
+			best = c;
+	}
+	assert(best != cur);
+	return best;
+}
+
+int sched_wakeup_preemption = 1;
+
+/*
+  Among the cores in mask that tcb may run on, find the core whose current
+  thread tcb should preempt. This is the core running the lowest-ranked
+  thread that tcb outranks. Return -1 if there is no such core, or if some
+  core that tcb may run on is idle.
+
+  The current threads of the cores are read without locking, therefore
+  the result is only a hint.
+*/
+static int sched_find_victim(TCB* tcb, cpumask_t mask)
+{
+	int victim = -1;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (!sched_allowed(tcb, c)) continue;
+		TCB* cur = cctx[c].current_thread;
+		if (cur == NULL || cur == &cctx[c].idle_thread) return -1;
+		if (!((mask >> c) & 1) || !SCHED_POLICY->preempts(tcb, cur)) continue;
+		if (victim < 0 || SCHED_POLICY->preempts(cctx[victim].current_thread, cur))
+			victim = c;
+	}
+	return victim;
 }
-#else
-static void sched_queue_add(TCB* tcb)
+
+/*
+  Add tcb to the run queue of a core, and remember the core, for
+  sched_inherit().
+
+  *** MUST BE CALLED WITH core->rq_lock HELD ***
+*/
+static inline void sched_rq_insert(CCB* core, TCB* tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED, &tcb->sched_node);
+	SCHED_POLICY->enqueue(core, tcb);
+	core->rq_size++;
+	__atomic_store_n(&tcb->rq_core, (int)(core - cctx), __ATOMIC_RELAXED);
+}
+
+/*
+  Add TCB to the end of a run queue, normally the one of the current core
+  (see sched_place()). 
+
+  If tcb outranks the current thread of a core in preempt, tcb is added
+  to the run queue of that core instead, and the core is sent an ICI to
+  preempt its current thread.
+
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
+*/
+static void sched_queue_add(TCB* tcb, cpumask_t preempt)
+{
+	uint c = sched_place(tcb);
+
+	int victim = -1;
+	if (preempt && sched_wakeup_preemption
+		&& cctx[c].current_thread != NULL && cctx[c].current_thread != &cctx[c].idle_thread) {
+		victim = sched_find_victim(tcb, preempt);
+		if (victim >= 0) c = victim;
+	}
+	CCB* core = &cctx[c];
+
+	ticket_lock(&core->rq_lock);
+
+	sched_rq_insert(core, tcb);
+
+	ticket_unlock(&core->rq_lock);
+
+	if (victim >= 0) {
+		core->preempt_pending = 1;
+		cpu_ici(c);
+		return;
+	}
+
+	if (c != cpu_core_id) {
+		/* Wake up the core, or make it restore its tick */
+		if (!cpu_core_restart(c) && core->tickless)
+			cpu_ici(c);
+		return;
+	}
+
+	/* If our timer was armed beyond the quantum, restore the tick */
+	if (core->tickless) {
+		core->tickless = 0;
+		sched_set_alarm(core, QUANTUM);
+	}
 
-	/* Restart possibly halted cores */
+	/* Restart possibly halted cores, they will steal from us */
 	cpu_core_restart_one();
 }
-#endif
+
+int sched_wakeup_handoff = 1;
+
+/*
+  Add tcb to the run queue of the current core, as the thread to run
+  next (see wakeup_to()). A previous handoff thread of the core stays
+  in the run queue as a normal thread.
+
+  Since the current thread is about to give us the core, peers are not
+  woken up; but we restore the tick, so that tcb will not wait beyond
+  a quantum if the current thread does not block after all.
+
+  *** MUST BE CALLED WITH tcb->sched_lock HELD ***
+*/
+static void sched_queue_handoff(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+
+	ticket_lock(&core->rq_lock);
+
+	sched_rq_insert(core, tcb);
+	core->handoff = tcb;
+
+	ticket_unlock(&core->rq_lock);
+
+	if (core->tickless) {
+		core->tickless = 0;
+		sched_set_alarm(core, QUANTUM);
+	}
+}
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->sched_lock HELD ***
+	If the thread has a timeout, timeout_spinlock is locked if
+	not @c tlocked. If @c handoff is set, the thread is handed the
+	current core (see sched_queue_handoff()).
  */
-static void sched_make_ready(TCB* tcb)
+static void sched_make_ready(TCB* tcb, int tlocked, int handoff)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timeout wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timeout wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+		if (!tlocked) ticket_lock(&timeout_spinlock);
+		sched_cancel_timeout(tcb);
+		if (!tlocked) ticket_unlock(&timeout_spinlock);
 	}
 
 	/* Mark as ready */
 	tcb->state = READY;
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	/* 
+	  Possibly add to the scheduler queue. When called from yield() (to
+	  expire timeouts), we are about to pick the best thread for our core
+	  anyway, so only peers may be preempted.
+	*/
+	if (tcb->phase != CTX_CLEAN)
+		return;
+	if (handoff)
+		sched_queue_handoff(tcb);
+	else
+		sched_queue_add(tcb, tlocked ? CPUMASK_ALL & ~(1u << cpu_core_id) : CPUMASK_ALL);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Return the time (in usec from now) until the nearest pending timeout
+  may expire, or NO_TIMEOUT if there is none.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  For threads in the higher levels of the wheel, we return the next
+  cascade of level 1, which is a lower bound of their expiry.
 */
-static void sched_wakeup_expired_timeouts()
+static TimerDuration sched_next_timeout()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
+	if (TIMEOUT_WHEEL.count == 0)
+		return NO_TIMEOUT;
+
+	ticket_lock(&timeout_spinlock);
+
+	TimerDuration now = TIMEOUT_WHEEL.now;
+	TimerDuration tick = ((now >> TW_LEVEL_BITS) + 1) << TW_LEVEL_BITS;
+
+	if (TIMEOUT_WHEEL.count == 0)
+		tick = NO_TIMEOUT;
+	else if (!is_rlist_empty(&TIMEOUT_WHEEL.due))
+		tick = now;
+	else
+		for (TimerDuration t = now + 1; t < tick; t++)
+			if (!is_rlist_empty(&TIMEOUT_WHEEL.slot[0][t & (TW_SLOTS - 1)])) {
+				tick = t;
+				break;
+			}
+
+	ticket_unlock(&timeout_spinlock);
+
+	if (tick == NO_TIMEOUT)
+		return NO_TIMEOUT;
+
+	TimerDuration expiry = tick << TW_TICK_SHIFT;
 	TimerDuration curtime = bios_clock();
+	return (expiry > curtime) ? expiry - curtime : 0;
+}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+/*
+  Advance the timeout wheel to the current time, and wake up the
+  threads whose timeout has expired.
+
+  Since we hold timeout_spinlock, we can only try to lock the TCBs. If
+  a TCB is busy, we leave it in the due list; some other core is dealing
+  with it, or we will get it at the next call.
+*/
+static void sched_wakeup_expired_timeouts()
+{
+	/* Quick check without locking */
+	if (TIMEOUT_WHEEL.count == 0)
+		return;
+
+	TimerDuration curtick = bios_clock() >> TW_TICK_SHIFT;
+	if (curtick <= TIMEOUT_WHEEL.now && is_rlist_empty(&TIMEOUT_WHEEL.due))
+		return;
+
+	ticket_lock(&timeout_spinlock);
+	tw_advance(curtick);
+
+	rlnode* n = TIMEOUT_WHEEL.due.next;
+	while (n != &TIMEOUT_WHEEL.due) {
+		TCB* tcb = n->tcb;
+		n = n->next;
+		if (!ticket_trylock(&tcb->sched_lock))
+			continue;
+		sched_make_ready(tcb, 1, 0);
+		ticket_unlock(&tcb->sched_lock);
 	}
+	ticket_unlock(&timeout_spinlock);
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Remove from the run queue of a core the first thread that may run
+  on core c, and return it. Return NULL if there is no such thread.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->rq_lock HELD ***
 */
-#ifdef QUEUE_NUMBER
-static TCB* sched_queue_select(enum SCHED_CAUSE cause, TCB* current)
+static TCB* sched_rq_pop(CCB* core, uint c)
 {
-	
-	int max_prior = 0;
+	if (core->rq_size == 0)
+		return NULL;
+
+	TCB* tcb = SCHED_POLICY->pick_next(core, c);
+	if (tcb != NULL) {
+		core->rq_size--;
+		__atomic_store_n(&tcb->rq_core, -1, __ATOMIC_RELAXED);
+		if (tcb == core->handoff)
+			core->handoff = NULL;
+	}
 
-	for(int i=QUEUE_NUMBER-1; i>=0; i--) {
-		int empty = is_rlist_empty(&SCHED[i]);
+	return tcb;
+}
 
-		if(!empty){
-			max_prior = i;
-			break;
+/*
+  Steal a thread from the run queue of the busiest peer core, among
+  those that may run on this core. Return NULL if there is none.
+ */
+static TCB* sched_steal()
+{
+	CCB* victim = NULL;
+	unsigned int maxsize = 0;
+
+	/* Find the busiest peer, without locking */
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (c == cpu_core_id) continue;
+		if (cctx[c].rq_size > maxsize) {
+			maxsize = cctx[c].rq_size;
+			victim = &cctx[c];
 		}
 	}
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[max_prior]);
+	/* Stealing is opportunistic, do not queue up behind the victim */
+	if (victim == NULL || !ticket_trylock(&victim->rq_lock))
+		return NULL;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	TCB* tcb = sched_rq_pop(victim, cpu_core_id);
+	ticket_unlock(&victim->rq_lock);
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
-
-	next_thread->its = QUANTUM;
-
-	return next_thread;
+	return tcb;
 }
-#else
+
+/*
+  Select the next thread to run on this core. This is the handoff
+  thread of the core, or the head of our own run queue or, if it is
+  empty, a thread stolen from a peer. If there is no other ready thread,
+  we continue with the current thread, if it is ready and may run on this
+  core, or else with the idle thread.
+
+  The handoff thread runs for the rest of the timeslice of the current
+  thread, if any.
+*/
 static TCB* sched_queue_select(TCB* current)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED);
+	CCB* core = &CURCORE;
+
+	ticket_lock(&core->rq_lock);
+	TCB* next_thread = core->handoff;
+	core->handoff = NULL;
+	if (next_thread != NULL && sched_allowed(next_thread, cpu_core_id)) {
+		SCHED_POLICY->remove(core, next_thread);
+		core->rq_size--;
+		__atomic_store_n(&next_thread->rq_core, -1, __ATOMIC_RELAXED);
+		ticket_unlock(&core->rq_lock);
+		next_thread->its = (current->type != IDLE_THREAD && current->rts > 0) 
+			? current->rts : SCHED_POLICY->quantum(next_thread);
+		return next_thread;
+	}
+	next_thread = sched_rq_pop(core, cpu_core_id);
+	ticket_unlock(&core->rq_lock);
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (next_thread == NULL)
+		next_thread = sched_steal();
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY && sched_allowed(current, cpu_core_id))
+			? current : &core->idle_thread;
 
-	next_thread->its = QUANTUM;
+	next_thread->its = (next_thread->type == IDLE_THREAD) ? QUANTUM : SCHED_POLICY->quantum(next_thread);
 
 	return next_thread;
 }
-#endif
 
 
 /*
@@ -420,14 +840,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	ticket_lock(&tcb->sched_lock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		sched_make_ready(tcb, 0, 0);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	ticket_unlock(&tcb->sched_lock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -436,10 +856,187 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup_to(TCB* tcb)
+{
+	int ret = 0;
+
+	int oldpre = preempt_off;
+
+	ticket_lock(&tcb->sched_lock);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb, 0, sched_allowed(tcb, cpu_core_id));
+		ret = 1;
+	}
+
+	ticket_unlock(&tcb->sched_lock);
+
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  A thread that was made READY and CTX_CLEAN is not in any list and no
+  other core will touch it, until it is added to a run queue. Therefore,
+  we first make every thread ready, chaining the ones to queue by their
+  sched_node, and then we add them to the run queues, without holding
+  their sched_lock. We keep the rq_lock of a core while consecutive
+  threads are placed on that core.
+ */
+int wakeup_many(TCB** tcbs, int n)
+{
+	int woken = 0;
+	rlnode batch;
+	rlnode_init(&batch, NULL);
+
+	int oldpre = preempt_off;
+
+	for (int i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+		ticket_lock(&tcb->sched_lock);
+		if (tcb->state == STOPPED || tcb->state == INIT) {
+			if (tcb->wakeup_time != NO_TIMEOUT) {
+				ticket_lock(&timeout_spinlock);
+				sched_cancel_timeout(tcb);
+				ticket_unlock(&timeout_spinlock);
+			}
+			tcb->state = READY;
+			if (tcb->phase == CTX_CLEAN)
+				rlist_push_back(&batch, &tcb->sched_node);
+			woken++;
+		} else
+			tcbs[i] = NULL;
+		ticket_unlock(&tcb->sched_lock);
+	}
+
+	/* The number of threads added to each core */
+	uint added[MAX_CORES] = { 0 };
+	CCB* locked = NULL;
+	while (!is_rlist_empty(&batch)) {
+		TCB* tcb = rlist_pop_front(&batch)->tcb;
+		uint c = sched_place(tcb);
+		CCB* core = &cctx[c];
+		if (core != locked) {
+			if (locked) ticket_unlock(&locked->rq_lock);
+			ticket_lock(&core->rq_lock);
+			locked = core;
+		}
+		sched_rq_insert(core, tcb);
+		added[c]++;
+	}
+	if (locked) ticket_unlock(&locked->rq_lock);
+
+	/* Wake up the cores, as in sched_queue_add() */
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (added[c] == 0 || c == cpu_core_id) continue;
+		if (!cpu_core_restart(c) && cctx[c].tickless)
+			cpu_ici(c);
+	}
+	if (added[cpu_core_id] > 0) {
+		CCB* core = &CURCORE;
+		if (core->tickless) {
+			core->tickless = 0;
+			sched_set_alarm(core, QUANTUM);
+		}
+		cpu_core_restart_many(added[cpu_core_id]);
+	}
+
+	if (oldpre)
+		preempt_on;
+
+	return woken;
+}
+
+int sched_level(TCB* tcb)
+{
+	return SCHED_POLICY->level ? SCHED_POLICY->level(tcb) : -1;
+}
+
+/*
+  The inherited level is raised with a CAS, by any waiter, and dropped
+  by the thread itself. A thread in a run queue is moved under the
+  rq_lock of its core, after its level was raised; it is enqueued again
+  at the level that the policy sees then. If the thread is not in a run
+  queue (rq_core is -1), the policy will see the new level when the thread
+  is next enqueued or preempted.
+ */
+void sched_inherit(TCB* tcb, int level)
+{
+	if (level < 0)
+		return;
+
+	int old = __atomic_load_n(&tcb->inherited, __ATOMIC_RELAXED);
+	do {
+		if (old >= level)
+			return;
+	} while (!__atomic_compare_exchange_n(&tcb->inherited, &old, level, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	int oldpre = preempt_off;
+
+	int c = __atomic_load_n(&tcb->rq_core, __ATOMIC_RELAXED);
+	if (c >= 0) {
+		CCB* core = &cctx[c];
+		ticket_lock(&core->rq_lock);
+		if (tcb->rq_core == c) {
+			SCHED_POLICY->remove(core, tcb);
+			SCHED_POLICY->enqueue(core, tcb);
+		}
+		ticket_unlock(&core->rq_lock);
+	}
+
+	if (oldpre)
+		preempt_on;
+}
+
+void sched_uninherit()
+{
+	TCB* tcb = cur_thread();
+	if (tcb != NULL && tcb->inherited >= 0)
+		__atomic_store_n(&tcb->inherited, -1, __ATOMIC_RELAXED);
+}
+
+/*
+  As in sched_inherit(), the run queue of the thread is checked again under
+  its rq_lock, since the thread may have been picked meanwhile.
+ */
+void sched_set_affinity(TCB* tcb, cpumask_t mask)
+{
+	int oldpre = preempt_off;
+	ticket_lock(&tcb->sched_lock);
+
+	__atomic_store_n(&tcb->affinity, mask, __ATOMIC_RELAXED);
+
+	int c = __atomic_load_n(&tcb->rq_core, __ATOMIC_RELAXED);
+	if (c >= 0 && !sched_allowed(tcb, c)) {
+		CCB* core = &cctx[c];
+		int moved = 0;
+		ticket_lock(&core->rq_lock);
+		if (tcb->rq_core == c) {
+			SCHED_POLICY->remove(core, tcb);
+			core->rq_size--;
+			tcb->rq_core = -1;
+			if (tcb == core->handoff)
+				core->handoff = NULL;
+			moved = 1;
+		}
+		ticket_unlock(&core->rq_lock);
+
+		if (moved)
+			sched_queue_add(tcb, 0);
+	}
+
+	ticket_unlock(&tcb->sched_lock);
+	if (oldpre)
+		preempt_on;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+void sleep_releasing(Thread_state state, spinlock_t* mx, enum SCHED_CAUSE cause,
 	TimerDuration timeout)
 {
 	assert(state == STOPPED || state == EXITED);
@@ -447,7 +1044,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	ticket_lock(&tcb->sched_lock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -458,10 +1055,10 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	/* Release mx */
 	if (mx != NULL)
-		Mutex_Unlock(mx);
+		spin_unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	ticket_unlock(&tcb->sched_lock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -473,24 +1070,6 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 
-#ifdef QUEUE_NUMBER
-
-/**
- * @brief For each queue, change the priority of the current process
- */
-void upgrade(){
-	rlnode* current = NULL;
-	int i = QUEUE_NUMBER-1;
-
-	while(!is_rlist_empty(&SCHED[i]) && i > 0){
-		current = rlist_pop_front(&SCHED[i]);
-		rlist_append(&SCHED[i+1], current);
-		current->tcb->priority = QUEUE_NUMBER - 1;
-		--i;
-	}
-	
-	numOfYieldCalls = 0;
-}
 
 
 /* This function is the entry point to the scheduler's context switching */
@@ -499,15 +1078,13 @@ void yield(enum SCHED_CAUSE cause)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
-	
+
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
-
-	/* Update CURTHREAD state */
+	/* Update CURTHREAD state. Only we can change a RUNNING thread. */
 	if (current->state == RUNNING)
 		current->state = READY;
 
@@ -516,38 +1093,27 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
+	/* Let the policy account the timeslice */
+	CCB* core = &CURCORE;
+	if (current->type != IDLE_THREAD)
+		SCHED_POLICY->on_yield(current, cause, core->slice_used + core->slice_alarm - remaining);
+
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
 	/* Get next */
-	TCB* next = sched_queue_select(cause, current);
+	TCB* next = sched_queue_select(current);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	
-
-	/* if the thread is waiting for I/O grant it the highest priority */
-	if(cause == SCHED_IO && current->priority < QUEUE_NUMBER-1)
-		current->priority++;
-	
-	/* if the thread's quantum has expired decrease its priority */
-	if(cause == SCHED_QUANTUM && current->priority > 0)
-		current->priority--;
-	
-	/* if the thread is locked on contention decrease its priority*/
-	if(cause == SCHED_MUTEX && current->last_cause == SCHED_MUTEX && current->priority > 0)
-		current->priority--;
-	
-	numOfYieldCalls++;
-	/* after a certain number of yield calls move every thread to the highest priority*/
-	if(numOfYieldCalls > CALL_LIMIT) upgrade();
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Let the policy do its housekeeping */
+	SCHED_POLICY->on_tick(core);
 
 	/* Switch contexts */
 	if (current != next) {
+		core->ctx_switches++;
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -557,53 +1123,17 @@ void yield(enum SCHED_CAUSE cause)
 	  */
 	gain(preempt);
 }
-#else
-void yield(enum SCHED_CAUSE cause)
-{
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
-
-	/* We must stop preemption but save it! */
-	int preempt = preempt_off;
-
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
-
-	Mutex_Lock(&sched_spinlock);
-
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
-		current->state = READY;
-
-	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
-	current->last_cause = current->curr_cause;
-	current->curr_cause = cause;
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
-
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	assert(next != NULL);
-
-	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
 
-	/* Switch contexts */
-	if (current != next) {
-		CURTHREAD = next;
-		cpu_swap_context(&current->context, &next->context);
-	}
-
-	/* This is where we get after we are switched back on! A long time
-	   may have passed. Start a new timeslice...
-	  */
-	gain(preempt);
+void yield_to(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	int preempt = preempt_off;
+	wakeup_to(tcb);
+	yield(cause);
+	if (preempt)
+		preempt_on;
 }
-#endif
-
 
 
 /*
@@ -620,42 +1150,68 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	ticket_lock(&current->sched_lock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = cpu_core_id;
+	ticket_unlock(&current->sched_lock);
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		ticket_lock(&prev->sched_lock);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, 0);
+			ticket_unlock(&prev->sched_lock);
 			break;
 		case EXITED:
+			ticket_unlock(&prev->sched_lock);
 			release_TCB(prev);
 			break;
 		case STOPPED:
+			ticket_unlock(&prev->sched_lock);
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* A core between two threads holds no RCU references */
+	rcu_quiescent();
+
+	/* 
+	  Set the alarm. Normally, this is one quantum. But if there is no other
+	  thread in our run queue, there is no need to tick; we just wake up for
+	  the nearest timeout. If some thread is added to our run queue before the
+	  alarm, sched_queue_add() will restore the quantum.
+	*/
+	CCB* core = &CURCORE;
+	TimerDuration alarm = current->rts;
+	core->tickless = 0;
+	if (current->type == IDLE_THREAD || core->rq_size == 0) {
+		TimerDuration next = sched_next_timeout();
+		if (next > TICKLESS_MAX)
+			next = TICKLESS_MAX;
+		if (current->type == IDLE_THREAD || next > alarm) {
+			/* Never arm for 0, this would cancel the timer */
+			alarm = (next > 0) ? next : (1 << TW_TICK_SHIFT);
+			core->tickless = 1;
+		}
+	}
+	bios_set_timer(alarm);
+	core->slice_alarm = alarm;
+	core->slice_used = 0;
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -665,6 +1221,7 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
+		thread_cache_trim(thread_cache_max / 2);
 		cpu_core_halt();
 		yield(SCHED_IDLE);
 	}
@@ -675,24 +1232,47 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
-#ifdef QUEUE_NUMBER
-void initialize_scheduler()
+void initialize_scheduler(sched_policy policy)
 {
-	for(int i=0; i< QUEUE_NUMBER; ++i)
-    	rlnode_init(&SCHED[i], NULL);
-	
-	rlnode_init(&TIMEOUT_LIST, NULL);
-}
-#else
-void initialize_scheduler()
-{
-	
-    rlnode_init(&SCHED, NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	switch (policy) {
+	case SCHED_POLICY_MLFQ: SCHED_POLICY = &mlfq_policy; break;
+	case SCHED_POLICY_RR: SCHED_POLICY = &rr_policy; break;
+	case SCHED_POLICY_FAIR: SCHED_POLICY = &fair_policy; break;
+	default:
+		FATAL("Unknown scheduling policy");
+	}
+
+	lockstat_name(&timeout_spinlock, "timeout_spinlock");
+
+	for (int c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->rq_lock = TICKETLOCK_INIT;
+		lockstat_name(&core->rq_lock, "CCB.rq_lock");
+		core->tickless = 0;
+		core->preempt_pending = 0;
+		core->slice_alarm = 0;
+		core->slice_used = 0;
+		core->ctx_switches = 0;
+		core->rq_size = 0;
+		core->handoff = NULL;
+		rlnode_init(&core->thread_cache, NULL);
+		core->thread_cache_size = 0;
+		core->thread_cache_hits = 0;
+		core->thread_cache_misses = 0;
+		core->rcu_seen = 0;
+		rlnode_init(&core->rcu_pending, NULL);
+		SCHED_POLICY->init(core);
+	}
+
+	for (int level = 0; level < TW_LEVELS; level++)
+		for (int i = 0; i < TW_SLOTS; i++)
+			rlnode_init(&TIMEOUT_WHEEL.slot[level][i], NULL);
+	rlnode_init(&TIMEOUT_WHEEL.due, NULL);
+	TIMEOUT_WHEEL.now = bios_clock() >> TW_TICK_SHIFT;
+	TIMEOUT_WHEEL.count = 0;
 }
-#endif
 
 void run_scheduler()
 {
@@ -708,6 +1288,8 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.inherited = -1;
+	curcore->idle_thread.rq_core = -1;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -715,6 +1297,11 @@ void run_scheduler()
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.sched_lock = TICKETLOCK_INIT;
+	lockstat_name(&curcore->idle_thread.sched_lock, "TCB.sched_lock");
+	rlnode_init(&curcore->idle_thread.lenders, NULL);
+	curcore->idle_thread.lenders_lock = TICKETLOCK_INIT;
+	lockstat_name(&curcore->idle_thread.lenders_lock, "TCB.lenders_lock");
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -726,6 +1313,8 @@ void run_scheduler()
 
 	/* Finished scheduling */
 	assert(CURTHREAD == &CURCORE.idle_thread);
+	rcu_flush();
+	thread_cache_trim(0);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
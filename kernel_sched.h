@@ -24,6 +24,27 @@
 #include "tinyos.h"
 #include "util.h"
 
+/** @brief A ticket spinlock.
+
+  The scheduler locks (@c sched_lock, @c rq_lock and the timeout lock) use
+  a ticket lock instead of @c spinlock_t: waiters are served in arrival
+  order and, while waiting, only read the @c owner field. A ticket lock
+  is only taken in the non-preemptive domain, because a holder that
+  yields would stall every waiter queued behind it.
+
+  See @c ticket_lock() and @c ticket_unlock() in kernel_cc.h.
+ */
+typedef union {
+	uint32_t word; 		/**< @brief Both fields, for compare-and-swap */
+	struct {
+		uint16_t owner;	/**< @brief The ticket currently served */
+		uint16_t next;	/**< @brief The next ticket to hand out */
+	};
+} ticketlock_t;
+
+/** @brief This macro is used to initialize ticket locks. */
+#define TICKETLOCK_INIT ((ticketlock_t){ .word = 0 })
+
 /*****************************
  *
  *  The Thread Control Block
@@ -84,11 +105,12 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A higher-priority thread was woken up (see @c ici_handler) */
 };
 
 /**
@@ -101,6 +123,16 @@ typedef struct thread_control_block {
   PTCB* ptcb;
 	PCB* owner_pcb; /**< @brief This is null for a free TCB */
   int priority;   /**< @brief priority of the TCB in queue*/
+	int inherited; /**< @brief The priority level inherited from a mutex waiter, or -1 (see @c sched_inherit) */
+	rlnode lenders; /**< @brief The waiters of the mutexes held by this thread that lent it their level */
+	ticketlock_t lenders_lock; /**< @brief Lock protecting @c lenders */
+	unsigned int boost_epoch; /**< @brief The last MLFQ boost epoch seen by this thread */
+	int rq_level; /**< @brief The MLFQ level of the run queue list holding this thread */
+	int rq_core; /**< @brief The core whose run queue holds this thread, or -1 */
+	TimerDuration vruntime; /**< @brief Virtual runtime, for the fair policy */
+	struct thread_control_block* rq_left;  /**< @brief Left child in the run queue tree (fair policy) */
+	struct thread_control_block* rq_right; /**< @brief Right child in the run queue tree (fair policy) */
+	int rq_height; /**< @brief Height of the subtree in the run queue tree (fair policy) */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
@@ -117,6 +149,13 @@ typedef struct thread_control_block {
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
+
+	ticketlock_t sched_lock; /**< @brief Lock protecting @c state and @c phase of this thread */
+
+	size_t stack_size; /**< @brief The size of the thread stack */
+
+	cpumask_t affinity; /**< @brief The cores this thread may be scheduled on */
+	uint last_core; /**< @brief The core this thread last ran on */
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -135,6 +174,7 @@ typedef struct thread_control_block {
 /** @brief Thread stack size.
 
   The default thread stack size in TinyOS is 128 kbytes.
+  A different size can be given to @c spawn_thread.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
@@ -144,9 +184,52 @@ typedef struct thread_control_block {
  *
  ************************/
 
+/** @brief Number of priority levels of the MLFQ policy. */
+#define QUEUE_NUMBER 256
+
+/** @brief Number of 64-bit words in the bitmap of non-empty MLFQ levels. */
+#define RQ_BITMAP_WORDS ((QUEUE_NUMBER + 63) / 64)
+
+/** @brief The time slice (in microseconds) of each MLFQ level.
+
+  This table is indexed by @c TCB.priority. The defaults give long slices
+  to the low (batch) levels and short slices to the high (interactive)
+  levels. It can be changed before @c boot.
+ */
+extern TimerDuration mlfq_quantum[QUEUE_NUMBER];
+
+/** @brief Preemption of lower-priority threads on wakeup.
+
+  When this is set (the default), waking up a thread sends an ICI to the
+  core running the lowest-priority thread that the woken thread outranks.
+  It can be changed before @c boot, for benchmarking.
+ */
+extern int sched_wakeup_preemption;
+
+/** @brief Handoff of the core to threads woken by kernel signals.
+
+  When this is set (the default), @c kernel_signal and @c kernel_broadcast
+  wake up a waiter with @c wakeup_to, so that it runs next on the core
+  of the signaller. It can be changed before @c boot, for benchmarking.
+ */
+extern int sched_wakeup_handoff;
+
+/** @brief The size of the thread cache of each core.
+
+  Each core keeps up to this many blocks (TCB and stack) of released
+  threads, and reuses them for new threads. The hit rate of the cache
+  can be seen in @c CCB.thread_cache_hits and @c CCB.thread_cache_misses.
+  It can be changed before @c boot; 0 disables the cache.
+ */
+extern unsigned int thread_cache_max;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a run queue of @c READY threads, protected by @c rq_lock.
+  A core normally runs threads from its own run queue; when the queue is
+  empty, it steals work from the busiest peer before halting.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -155,12 +238,94 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	ticketlock_t rq_lock; /**< @brief Lock for the run queue of this core */
+	volatile unsigned int rq_size; /**< @brief Number of threads in the run queue */
+	rlnode rq[QUEUE_NUMBER]; /**< @brief The run queue, one list per MLFQ level (round-robin uses @c rq[0]) */
+	uint64_t rq_bitmap[RQ_BITMAP_WORDS]; /**< @brief Bit @c i is set iff @c rq[i] is not empty (MLFQ) */
+	unsigned int rq_epoch; /**< @brief The last boost epoch seen by the run queue (MLFQ) */
+	TCB* rq_root; /**< @brief The run queue, as a tree ordered by vruntime (fair policy) */
+	TimerDuration min_vruntime; /**< @brief Lower bound of the vruntime of queued threads (fair policy) */
+	TCB* handoff; /**< @brief A thread of the run queue to run next (see @c wakeup_to), or NULL */
+
+	unsigned long ctx_switches; /**< @brief Number of context switches on this core */
+	rlnode thread_cache; /**< @brief Blocks of released threads, for reuse (see @c thread_cache_max) */
+	unsigned int thread_cache_size; /**< @brief Number of blocks in @c thread_cache */
+	unsigned long thread_cache_hits; /**< @brief Number of threads spawned from @c thread_cache */
+	unsigned long thread_cache_misses; /**< @brief Number of threads spawned with a new block */
+	volatile int tickless; /**< @brief Set when the core timer was armed beyond one quantum */
+	volatile int preempt_pending; /**< @brief Set by a peer that wants the current thread preempted */
+	TimerDuration slice_alarm; /**< @brief The last period the core timer was armed with */
+	TimerDuration slice_used; /**< @brief Time used in the current timeslice, before the last arming */
+	unsigned int rcu_seen; /**< @brief The last RCU epoch seen at a quiescent state (see @c rcu_quiescent) */
+	rlnode rcu_pending; /**< @brief RCU callbacks queued on this core, oldest first */
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduling policy.
+
+  A policy orders the @c READY threads in the run queue of each core, and
+  adjusts the scheduling data of each thread at the end of its timeslice.
+  The policy of the kernel is selected at boot time (see @c set_boot_policy).
+
+  The run queue operations are called with @c core->rq_lock held. The
+  size of the run queue (@c core->rq_size) is maintained by the scheduler.
+ */
+typedef struct sched_policy_ops {
+	const char* name; /**< @brief The name of the policy */
+
+	/** @brief Initialize the run queue of a core. */
+	void (*init)(CCB* core);
+
+	/** @brief Initialize the scheduling data of a new thread. */
+	void (*init_thread)(TCB* tcb);
+
+	/** @brief Add a ready thread to the run queue of a core. */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove and return the next thread of the run queue of @c core 
+	  that may run on core @c c, or return NULL if there is none. */
+	TCB* (*pick_next)(CCB* core, uint c);
+
+	/** @brief Remove thread @c tcb from the run queue of @c core. */
+	void (*remove)(CCB* core, TCB* tcb);
+
+	/** @brief Account the end of the timeslice of a thread, which used
+	  @c used microseconds of cpu time. */
+	void (*on_yield)(TCB* tcb, enum SCHED_CAUSE cause, TimerDuration used);
+
+	/** @brief Called at every invocation of the scheduler on a core. 
+	  This is called without @c core->rq_lock held. */
+	void (*on_tick)(CCB* core);
+
+	/** @brief Return the time slice of a thread that is about to run. */
+	TimerDuration (*quantum)(TCB* tcb);
+
+	/** @brief Return true if the woken thread @c tcb should preempt the
+	  running thread @c current. This is called without any lock held. */
+	int (*preempts)(TCB* tcb, TCB* current);
+
+	/** @brief Return the priority level of a thread, including an inherited
+	  level. This is NULL for policies without priority levels. */
+	int (*level)(TCB* tcb);
+} sched_policy_ops;
+
+/** @brief The multi-level feedback queue policy */
+extern const sched_policy_ops mlfq_policy;
+/** @brief The round-robin policy */
+extern const sched_policy_ops rr_policy;
+/** @brief The fair policy, ordering threads by virtual runtime */
+extern const sched_policy_ops fair_policy;
+
+/** @brief Return true if thread @c tcb may run on core @c c. */
+static inline int sched_allowed(TCB* tcb, uint c)
+{
+	return (tcb->affinity >> c) & 1;
+}
+
+
 /** 
   @brief The current thread.
 
@@ -182,6 +347,14 @@ extern CCB cctx[MAX_CORES];
 */
 #define CURPROC (cur_thread()->owner_pcb)
 
+/**
+  @brief The set of all the cores of the machine.
+*/
+static inline cpumask_t sched_cores_mask()
+{
+	return (cpu_cores() >= 8*sizeof(cpumask_t)) ? CPUMASK_ALL : ((cpumask_t)1 << cpu_cores()) - 1;
+}
+
 /**
   @brief A timeout constant, denoting no timeout for sleep.
 */
@@ -200,9 +373,12 @@ extern CCB cctx[MAX_CORES];
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the stack of the new thread, or 0 for 
+                @c THREAD_STACK_SIZE. It is rounded up to a multiple of
+                the page size.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -216,15 +392,90 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, handing it this core.
+
+  This is like @c wakeup(), but the thread is added to the run queue
+  of the current core, and it will run next, when the current thread
+  yields or sleeps. It then runs for the rest of the timeslice of the
+  current thread. Use this when the current thread is about to block
+  waiting for @c tcb (e.g., in a ping-pong over a pipe).
+
+  Other cores are not woken up to run @c tcb. If the thread may not run 
+  on the current core, this is the same as @c wakeup().
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+*/
+int wakeup_to(TCB* tcb);
+
+/**
+  @brief Wakeup a batch of blocked threads.
+
+  This is like calling @c wakeup() on each thread of the array, but the
+  ready threads are added to the run queues in one go, locking each run
+  queue once, and at most as many halted cores are restarted as there are
+  new ready threads. Unlike @c wakeup(), the woken threads do not preempt
+  running threads.
+
+  @param tcbs an array of @c n threads. On return, the entries of the threads
+         that were not @c STOPPED or @c INIT are set to NULL.
+  @param n the number of threads in the array
+  @returns the number of threads made @c READY
+*/
+int wakeup_many(TCB** tcbs, int n);
+
+/**
+  @brief Return the priority level of a thread, or -1.
+
+  This is the level given by the scheduling policy, including an inherited
+  level (see @c sched_inherit). It is -1 if the policy has no levels.
+ */
+int sched_level(TCB* tcb);
+
+/**
+  @brief Let a thread inherit a priority level.
+
+  This is called by a thread that waits for a mutex held by @c tcb, with its
+  own level (see @c sched_level). If the level of @c tcb is lower, it is raised,
+  and if @c tcb waits in a run queue, it is moved to its new level. The
+  inherited level lasts until @c tcb calls @c sched_uninherit.
+
+  @param tcb the thread that holds the mutex
+  @param level the level to inherit
+ */
+void sched_inherit(TCB* tcb, int level);
+
+/**
+  @brief Drop the priority level that the current thread inherited.
+
+  The caller may then inherit again the level that it still owes to other
+  waiters (see @c Mutex_Unlock).
+ */
+void sched_uninherit();
+
+/**
+  @brief Change the affinity of a thread.
+
+  If @c tcb waits in the run queue of a core that the new mask excludes,
+  it is moved to a core that the mask allows (see @c sched_place), since
+  the excluded core will not pick it and its peers may not steal it. 
+  A running thread moves at its next yield.
+
+  @param tcb the thread
+  @param mask the new affinity, which must contain some existing core
+ */
+void sched_set_affinity(TCB* tcb, cpumask_t mask);
+
 /** 
   @brief Block the current thread.
 
 	This call will block the current thread, changing its state to @c STOPPED
-	or @c EXITED. Also, the mutex @c mx, if not `NULL`, will be unlocked, atomically
+	or @c EXITED. Also, the spinlock @c mx, if not `NULL`, will be unlocked, atomically
 	with the blocking of the thread. 
 
 	In particular, what is meant by 'atomically' is that the thread state will change
-	to @c newstate atomically with the mutex unlocking. Note that, the state of
+	to @c newstate atomically with the spinlock unlocking. Note that, the state of
 	the current thread is @c RUNNING. 
 	Therefore, no other state change (such as a wakeup, a yield, another sleep etc) 
 	can happen "between" the thread's state change and the unlocking.
@@ -242,11 +493,11 @@ int wakeup(TCB* tcb);
 	@c wakeup() by another thread.
 
 	@param newstate the new state for the current thread, which must be either stopped or exited
-	@param mx the mutex to unlock.
+	@param mx the spinlock to unlock.
 	@param cause the cause of the sleep
 	@param timeout a timeout for the sleep, or 
    */
-void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+void sleep_releasing(Thread_state newstate, spinlock_t* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
 /**
   @brief Give up the CPU.
@@ -257,6 +508,15 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Give up the CPU to a blocked thread.
+
+  This call wakes up @c tcb by @c wakeup_to() and yields, so that @c tcb
+  runs on this core for the rest of the current timeslice. If @c tcb was
+  not blocked, this is the same as @c yield().
+ */
+void yield_to(TCB* tcb, enum SCHED_CAUSE cause);
+
 /**
   @brief Enter the scheduler.
 
@@ -270,8 +530,9 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+   @param policy the scheduling policy to use
  */
-void initialize_scheduler(void);
+void initialize_scheduler(sched_policy policy);
 
 /**
   @brief Quantum (in microseconds) 
@@ -280,6 +541,15 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief Longest timer period (in microseconds) of a tickless core
+
+  A core that is idle, or runs the only thread in its run queue, arms its
+  timer for the nearest pending timeout instead of the next quantum, but
+  never further away than this.
+  */
+#define TICKLESS_MAX (100000L)
+
 /** @} */
 
 #endif
@@ -23,7 +23,7 @@ socket_cb* init_socket(port_t port, FCB* fcb[1]){
 	scb->type = SOCKET_UNBOUND;
 
 	fcb[0]->streamobj = scb;
-	fcb[0]->streamfunc = & socket_operations;
+	__atomic_store_n(& fcb[0]->streamfunc, & socket_operations, __ATOMIC_RELEASE);
 
 	return scb;
 }
@@ -40,95 +40,162 @@ request_connection* init_request_connection(socket_cb* peer) {
 }
 
 
-Fid_t sys_Socket(port_t port)
-{	
-	if(port < NOPORT || port > MAX_PORT) return	-1;
+/*
+	The port map lock protects the updates of PORTMAP and the connection 
+	setup: the listener queues, the connection requests and the type of 
+	each socket. Once connected, a socket uses its pipes, which have their
+	own locks.
+
+	PORTMAP and the sockets of the fileid table are read without the lock,
+	under rcu_read_lock(). A socket is freed after an RCU grace period, 
+	when the last reference to it is dropped. Its FCB holds one reference,
+	and each system call holds one while it uses the socket.
+ */
+static Mutex portmap_lock = MUTEX_INIT;
+
+socket_cb* PORTMAP[MAX_PORT + 1];
+
+
+void initialize_sockets()
+{
+	lockstat_name(&portmap_lock, "portmap_lock");
+
+	for(int p=0; p<=MAX_PORT; p++)
+		PORTMAP[p] = NULL;
+}
+
+static void socket_decref(socket_cb* scb)
+{
+	if(__atomic_sub_fetch(&scb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		rcu_free(&scb->rcu, scb);
+}
+
+/* Translate a fid to a socket, and take a reference to it, or return NULL */
+static socket_cb* socket_lookup(Fid_t sock)
+{
+	socket_cb* scb = NULL;
+	int oldpre = rcu_read_lock();
+	FCB* fcb = get_fcb(sock);
+	if(fcb != NULL && __atomic_load_n(&fcb->streamfunc, __ATOMIC_RELAXED) == &socket_operations) {
+		scb = fcb->streamobj;
+		unsigned int count = __atomic_load_n(&scb->refcount, __ATOMIC_RELAXED);
+		do {
+			if(count == 0) { scb = NULL; break; }
+		} while(! __atomic_compare_exchange_n(&scb->refcount, &count, count+1, 1,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	}
+	rcu_read_unlock(oldpre);
+	return scb;
+}
+
+/* Check, without the lock, whether a port has a listener */
+static int port_listening(port_t port)
+{
+	int oldpre = rcu_read_lock();
+	socket_cb* listener = __atomic_load_n(&PORTMAP[port], __ATOMIC_ACQUIRE);
+	int ret = (listener != NULL && listener->type == SOCKET_LISTENER);
+	rcu_read_unlock(oldpre);
+	return ret;
+}
 
+
+/* Create an unbound socket on a new fid. */
+static Fid_t socket_create(port_t port, socket_cb** scbp)
+{
 	Fid_t fid[1];
 	FCB* fcb[1];
 
 	int isReserved = FCB_reserve(1, fid, fcb);
 
-	if(!isReserved) return -1;
+	if(!isReserved) return NOFILE;
 
-	socket_cb* scb = init_socket(port, fcb);
+	*scbp = init_socket(port, fcb);
+	FCB_publish(1, fid, fcb);
+	return fid[0];
+}
 
 
-	if(PORTMAP[port] == NULL) PORTMAP[port] = scb;
+Fid_t sys_Socket(port_t port)
+{	
+	if(port < NOPORT || port > MAX_PORT) return	-1;
 
-	return fid[0];
+	socket_cb* scb;
+	Fid_t fid = socket_create(port, &scb);
+
+	if(fid == NOFILE) return -1;
+
+	Mutex_Lock(&portmap_lock);
+	if(PORTMAP[port] == NULL) __atomic_store_n(&PORTMAP[port], scb, __ATOMIC_RELEASE);
+	Mutex_Unlock(&portmap_lock);
+
+	return fid;
 }
 
 int sys_Listen(Fid_t sock)
 {
-	FCB* fcb  = get_fcb(sock);
-
-	if(fcb == NULL || fcb->streamfunc != &socket_operations) return -1;
-
 	/** illegal file id */
-	socket_cb* scb = fcb->streamobj;
+	socket_cb* scb = socket_lookup(sock);
 	if(scb == NULL) return -1;
 
-	/** socket is not bound on a port */
-	if(scb->port <= NOPORT || scb->port > MAX_PORT) return -1;
+	int ret = -1;
+
+	/** socket is not bound on a port, or the port has a listener already */
+	if(scb->port <= NOPORT || scb->port > MAX_PORT || port_listening(scb->port)) {
+		socket_decref(scb);
+		return -1;
+	}
+
+	Mutex_Lock(&portmap_lock);
 
 	/** port bound on the socket is occupied by another listener */
-	if(PORTMAP[scb->port]->type == SOCKET_LISTENER) return -1;
+	if(PORTMAP[scb->port] != NULL && PORTMAP[scb->port]->type == SOCKET_LISTENER) goto finish;
 
 	/** socket is already initialized */
-	if(scb->type != SOCKET_UNBOUND) return -1;
+	if(scb->type != SOCKET_UNBOUND) goto finish;
 
 	scb->type = SOCKET_LISTENER;
 	rlnode_init(&scb->listener.queue, NULL);
 	scb->listener.req_available = COND_INIT;
-	return 0;
+	__atomic_store_n(&PORTMAP[scb->port], scb, __ATOMIC_RELEASE);
+	ret = 0;
+
+finish:
+	Mutex_Unlock(&portmap_lock);
+	socket_decref(scb);
+	return ret;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	FCB* fcb = get_fcb(lsock);
-
-	if(fcb == NULL || fcb->streamfunc != &socket_operations) return NOFILE;
-
-	socket_cb* scb = fcb->streamobj;
-
 	/** illegal file id*/
-	if(scb == NULL) return -1;
+	socket_cb* scb = socket_lookup(lsock);
+	if(scb == NULL) return NOFILE;
 
-	/** socket is not bound on a port */
-	if(scb->port <= NOPORT || scb->port > MAX_PORT) return -1;
+	Fid_t peerFid = -1;
+	Mutex_Lock(&portmap_lock);
 
-	/** socket type is peer*/
-	if(scb->type == SOCKET_PEER) return -1;
-
-	/** port does not have listening socket bound to it */
-	if(PORTMAP[scb->port]->type != SOCKET_LISTENER) return -1;
+	/** socket is not the listener of its port */
+	if(scb->type != SOCKET_LISTENER || PORTMAP[scb->port] != scb) goto finish;
 	
-	scb->refcount++;
-	socket_cb* port = PORTMAP[scb->port];
+	socket_cb* port = scb;
 
-	while(is_rlist_empty(&PORTMAP[scb->port]->listener.queue)){
-		kernel_wait(&PORTMAP[scb->port]->listener.req_available, SCHED_IO);
-		if(PORTMAP[scb->port] == NULL) return -1;
+	while(is_rlist_empty(&port->listener.queue)){
+		kernel_wait(&portmap_lock, &port->listener.req_available, SCHED_IO);
+		if(PORTMAP[scb->port] != scb) goto finish;
 	}
 
-	Fid_t peerFid = sys_Socket(scb->port);
-	if(peerFid == NOFILE) return -1;
-
-	FCB* peerFcb = get_fcb(peerFid);
-	if(peerFcb == NULL) return -1;
-
-	socket_cb* peer = peerFcb->streamobj;
-	if(peer == NULL) return -1;
+	socket_cb* peer;
+	peerFid = socket_create(scb->port, &peer);
+	if(peerFid == NOFILE) { peerFid = -1; goto finish; }
 
 	rlnode* requestNode = rlist_pop_front(& port->listener.queue);
 
 	request_connection* reqConn = requestNode->obj;
 
 	socket_cb* reqPeer = reqConn->peer;
-	if(reqPeer == NULL) return -1;
 
+	FCB* peerFcb = peer->fcb;
 	FCB* fcb_1[2] = {reqPeer->fcb, peerFcb};
 	pipe_cb* pipe_1 = init_pipe(fcb_1);
 	
@@ -147,83 +214,95 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	reqConn->admitted = 1;
 	kernel_signal(&reqConn->connected_cv);
-	if(scb->refcount > 0) scb->refcount--;
 
+finish:
+	Mutex_Unlock(&portmap_lock);
+	socket_decref(scb);
 	return peerFid;
 }
 
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	FCB* fcb = get_fcb(sock);
-	int timeOut;
-
-	if(fcb == NULL || fcb->streamfunc != &socket_operations) return NOFILE;
-
 	if(port <= NOPORT || port > MAX_PORT) return -1;
 
-	socket_cb* peer = fcb->streamobj;
-
 	/** illegal file id*/
+	socket_cb* peer = socket_lookup(sock);
 	if(peer == NULL) return -1;
 
-	socket_cb* listener = PORTMAP[port];
-
-	if(peer->type != SOCKET_UNBOUND) return -1;
+	/** no listener at the port; this is checked again under the lock */
+	if(! port_listening(port)) {
+		socket_decref(peer);
+		return -1;
+	}
 
-	if(listener == NULL) return -1;
+	Mutex_Lock(&portmap_lock);
 
-	if(listener->type != SOCKET_LISTENER) return -1;
+	socket_cb* listener = PORTMAP[port];
 
-	peer->refcount++;
+	if(peer->type != SOCKET_UNBOUND || listener == NULL 
+		|| listener->type != SOCKET_LISTENER) {
+		Mutex_Unlock(&portmap_lock);
+		socket_decref(peer);
+		return -1;
+	}
 
 	request_connection* rc = init_request_connection(peer);
 
-	rlist_push_back(&PORTMAP[port]->listener.queue, &rc->queue_node);
+	rlist_push_back(&listener->listener.queue, &rc->queue_node);
 
-	kernel_signal(&PORTMAP[port]->listener.req_available);
+	kernel_signal(&listener->listener.req_available);
 
 	while(rc->admitted == 0)
 	{
-		timeOut = kernel_timedwait(&rc->connected_cv, SCHED_IO, timeout);
-		if(!timeOut) return -1; 
+		/* The timeout is in msec */
+		if(! kernel_timedwait(&portmap_lock, &rc->connected_cv, SCHED_IO, timeout*1000ul))
+			break;
 	}
-	
-	if(peer->refcount > 0)
-		peer->refcount--;	
+
+	int ret = 0;
+	if(! rc->admitted) {
+		/* Timed out: withdraw the request, so that it is not accepted later */
+		rlist_remove(&rc->queue_node);
+		ret = -1;
+	}
+	Mutex_Unlock(&portmap_lock);
+	socket_decref(peer);
 
 	free(rc);
-	return 0;
+	return ret;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {	
 	int read, write;
-	FCB* fcb = get_fcb(sock);
-
-	if(fcb == NULL || fcb->streamfunc != &socket_operations) return NOFILE;
-
 	if(how <1 || how > 3) return -1;
 
-	socket_cb* scb = fcb->streamobj;
-
-	if(scb == NULL || scb->type != SOCKET_PEER) return -1;
-
-	switch(how) {
-		case SHUTDOWN_READ: 
-			return pipe_reader_close(scb->peer.read_pipe);
-		case SHUTDOWN_WRITE:
-			return pipe_writer_close(scb->peer.write_pipe);
-		case SHUTDOWN_BOTH:
-			read = pipe_reader_close(scb->peer.read_pipe);
-			write = pipe_writer_close(scb->peer.write_pipe);
-			if(read != 0 || write != 0) return -1;
+	socket_cb* scb = socket_lookup(sock);
+	if(scb == NULL) return -1;
 
-			return 0;
-		default:	
-			return -1;
+	int ret = -1;
+	if(scb->type == SOCKET_PEER) {
+		switch(how) {
+			case SHUTDOWN_READ: 
+				ret = pipe_reader_shutdown(scb->peer.read_pipe);
+				break;
+			case SHUTDOWN_WRITE:
+				ret = pipe_writer_shutdown(scb->peer.write_pipe);
+				break;
+			case SHUTDOWN_BOTH:
+				read = pipe_reader_shutdown(scb->peer.read_pipe);
+				write = pipe_writer_shutdown(scb->peer.write_pipe);
+				ret = (read != 0 || write != 0) ? -1 : 0;
+				break;
+			default:	
+				break;
+		}
 	}
+
+	socket_decref(scb);
+	return ret;
 }
 
 
@@ -257,17 +336,24 @@ int socket_close(void* socketcb_t){
 
 	if(scb == NULL) return -1;
 	
+	int ret = 0;
 	if(scb->type == SOCKET_PEER) {
 		read = pipe_reader_close(scb->peer.read_pipe);
 		write = pipe_writer_close(scb->peer.write_pipe);
-		if(read != 0 || write != 0) return -1;
+		if(read != 0 || write != 0) ret = -1;
 	}
 
+	Mutex_Lock(&portmap_lock);
+	if(PORTMAP[scb->port] == scb)
+		__atomic_store_n(&PORTMAP[scb->port], NULL, __ATOMIC_RELAXED);
 	if(scb->type == SOCKET_LISTENER) {
-		PORTMAP[scb->port] = NULL;
-		kernel_signal(& scb->listener.req_available);
+		/* Drop the pending requests; their Connect will time out */
+		while(! is_rlist_empty(& scb->listener.queue))
+			rlist_pop_front(& scb->listener.queue);
+		kernel_broadcast(& scb->listener.req_available);
 	}
+	Mutex_Unlock(&portmap_lock);
 
-	scb = NULL;
-	return 0;
+	socket_decref(scb);
+	return ret;
 }
@@ -31,7 +31,8 @@ typedef struct socket_peer {
 
 
 typedef struct socket_control_block {
-    unsigned int refcount;
+    unsigned int refcount;      /**< @brief Held by the FCB and by system calls (atomic) */
+    rcu_head rcu;               /**< @brief Defers the free of the socket */
     FCB* fcb;
     socket_type type;
     port_t port;
@@ -53,7 +54,15 @@ typedef struct request_connection {
 } request_connection;
 
 
-socket_cb* PORTMAP[MAX_PORT + 1];
+extern socket_cb* PORTMAP[MAX_PORT + 1];
+
+
+/** 
+  @brief Initialization for sockets.
+
+  This function is called at kernel startup.
+ */
+void initialize_sockets();
 
 
 /**
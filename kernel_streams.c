@@ -11,10 +11,36 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/*
+  The file table lock protects the FCB free list and the updates of the
+  fileid tables of all processes. FCB reference counts are atomic, so that
+  a stream can be used without holding the lock.
+
+  The fileid tables are read without the lock, under rcu_read_lock(). An
+  FCB whose count drops to 0 returns to the free list only after an RCU
+  grace period, therefore a reader that found it in a fileid table can
+  still look at its count, and see that it is closed.
+ */
+static Mutex file_lock = MUTEX_INIT;
+
+/* FCBs that finished their grace period, linked by freelist_node.next */
+static rlnode* FCB_released;
+
+/* 
+  A fid between FCB_reserve() and FCB_publish() holds this FCB. It has no
+  stream, so the I/O calls treat the fid as closed, and Close, Dup2 and
+  the process calls leave it alone.
+ */
+static FCB fid_reserved;
+#define FID_RESERVED (& fid_reserved)
+
 
 void initialize_files()
 {
+  lockstat_name(&file_lock, "file_lock");
+
   rlnode_init(&FCB_freelist,NULL);
+  FCB_released = NULL;
   for(int i=0;i<MAX_FILES;i++) {
 
     FT[i].refcount = 0;
@@ -24,36 +50,73 @@ void initialize_files()
 }
 
 
-FCB* acquire_FCB()
+/* Must be called with file_lock held */
+static FCB* acquire_FCB()
 {
+  if(is_rlist_empty(& FCB_freelist)) {
+    rlnode* node = __atomic_exchange_n(& FCB_released, NULL, __ATOMIC_ACQUIRE);
+    while(node != NULL) {
+      rlnode* next = node->next;
+      rlist_push_back(& FCB_freelist, rlnode_init(node, node->obj));
+      node = next;
+    }
+  }
+
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
     return fcb;
   }
   else
     return NULL;
 }
 
-void release_FCB(FCB* fcb)
+/* Must be called with file_lock held */
+static void release_FCB(FCB* fcb)
 {
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
 }
 
+/* 
+  The RCU callback of a released FCB. It cannot take file_lock, so it
+  pushes the FCB on FCB_released, for acquire_FCB().
+ */
+static void recycle_FCB(void* obj)
+{
+  FCB* fcb = obj;
+  rlnode* head = __atomic_load_n(& FCB_released, __ATOMIC_RELAXED);
+  do {
+    fcb->freelist_node.next = head;
+  } while(! __atomic_compare_exchange_n(& FCB_released, &head, & fcb->freelist_node, 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Take a reference to an FCB found without file_lock, unless it is closed */
+static int FCB_tryincref(FCB* fcb)
+{
+  uint count = __atomic_load_n(& fcb->refcount, __ATOMIC_RELAXED);
+  do {
+    if(count == 0) return 0;
+  } while(! __atomic_compare_exchange_n(& fcb->refcount, &count, count+1, 1,
+      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  return 1;
+}
+
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
-    release_FCB(fcb);
+    rcu_call(& fcb->rcu, recycle_FCB, fcb);
     return retval;
   }
   else
@@ -67,6 +130,9 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ok = 0;
+
+    Mutex_Lock(& file_lock);
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
@@ -75,7 +141,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,26 +152,78 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
+	cur->FIDT[fid[i]] = FID_RESERVED;
     }
-    return 1;
+    ok = 1;
+
+finish:
+    Mutex_Unlock(& file_lock);
+    return ok;
 }
 
 
 
+void FCB_publish(size_t num, Fid_t *fid, FCB** fcb)
+{
+    PCB* cur = CURPROC;
+    Mutex_Lock(& file_lock);
+    for(size_t i=0; i<num ; i++) {
+	assert(cur->FIDT[fid[i]]==FID_RESERVED);
+	assert(fcb[i]->streamfunc != NULL);
+	__atomic_store_n(& cur->FIDT[fid[i]], fcb[i], __ATOMIC_RELEASE);
+    }
+    Mutex_Unlock(& file_lock);
+}
+
+
+/* The FCBs were never published, so they can be reused at once */
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(& file_lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
+	assert(cur->FIDT[fid[i]]==FID_RESERVED);
 	cur->FIDT[fid[i]] = NULL;
+	fcb[i]->refcount = 0;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(& file_lock);
+}
+
+
+void FCB_inherit(PCB* newproc, PCB* parent)
+{
+  Mutex_Lock(& file_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    FCB* fcb = parent->FIDT[i];
+    newproc->FIDT[i] = (fcb == FID_RESERVED) ? NULL : fcb;
+    if(newproc->FIDT[i])
+      FCB_incref(newproc->FIDT[i]);
+  }
+  Mutex_Unlock(& file_lock);
+}
+
+
+void FCB_close_all(PCB* pcb)
+{
+  FCB* fidt[MAX_FILEID];
+
+  /* Empty the fileid table, then close outside the lock */
+  Mutex_Lock(& file_lock);
+  for(int i=0;i<MAX_FILEID;i++) {
+    fidt[i] = (pcb->FIDT[i] == FID_RESERVED) ? NULL : pcb->FIDT[i];
+    __atomic_store_n(& pcb->FIDT[i], NULL, __ATOMIC_RELAXED);
+  }
+  Mutex_Unlock(& file_lock);
+
+  for(int i=0;i<MAX_FILEID;i++)
+    if(fidt[i] != NULL)
+      FCB_decref(fidt[i]);
 }
 
 
@@ -124,7 +242,28 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  /* A reserved fid holds FID_RESERVED, which has no stream */
+  FCB* fcb = __atomic_load_n(& CURPROC->FIDT[fid], __ATOMIC_ACQUIRE);
+  if(fcb && __atomic_load_n(& fcb->streamfunc, __ATOMIC_ACQUIRE) == NULL)
+    return NULL;
+  return fcb;
+}
+
+
+/*
+  Translate an fid to an FCB, and take a reference to it, so that 
+  the stream will not be closed (by another thread) while we are using it!
+  If the stream is being closed, this fails as if the fid was closed.
+ */
+static FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  int oldpre = rcu_read_lock();
+  FCB* fcb = get_fcb(fid);
+  if(fcb && ! FCB_tryincref(fcb)) fcb = NULL;
+  rcu_read_unlock(oldpre);
+  return fcb;
 }
 
 
@@ -132,29 +271,19 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
   int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
   /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -164,31 +293,20 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
   int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
   /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
@@ -196,13 +314,19 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(retcode) return retcode;
 
-  FCB* fcb = get_fcb(fd);
+  /* A fid that is being opened is not open yet */
+  Mutex_Lock(& file_lock);
+  FCB* fcb = CURPROC->FIDT[fd];
+  if(fcb == FID_RESERVED)
+    fcb = NULL;
+  else
+    __atomic_store_n(& CURPROC->FIDT[fd], NULL, __ATOMIC_RELAXED);
+  Mutex_Unlock(& file_lock);
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -214,6 +338,7 @@ int sys_Close(int fd)
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  - Either oldfd or newfd is being opened by another thread.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
@@ -221,18 +346,25 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  Mutex_Lock(& file_lock);
+  FCB* old = CURPROC->FIDT[oldfd];
+  FCB* new = CURPROC->FIDT[newfd];
 
-  if(old==NULL) {
+  if(old==NULL || old==FID_RESERVED || new==FID_RESERVED) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    __atomic_store_n(& CURPROC->FIDT[newfd], old, __ATOMIC_RELEASE);
   }
+  else
+    new = NULL;
+  Mutex_Unlock(& file_lock);
+
+  /* Drop the replaced stream outside the lock, as this may close it */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -261,6 +393,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_publish(1, &fid, &fcb);
   
   goto finok;
 finerr:
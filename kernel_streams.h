@@ -3,6 +3,7 @@
 
 #include "tinyos.h"
 #include "kernel_dev.h"
+#include "kernel_cc.h"
 
 /**
 	@file kernel_streams.h
@@ -40,10 +41,11 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter (atomic). */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
-  file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  file_ops* streamfunc;		/**< @brief The stream implementation methods, stored last (release) */
   rlnode freelist_node;		/**< @brief Intrusive list node */
+  rcu_head rcu;				/**< @brief Defers the reuse of a released FCB */
 } FCB;
 
 
@@ -87,6 +89,11 @@ int FCB_decref(FCB* fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
+   The fids are taken, but they do not refer to the FCBs yet, so the
+   other threads of the process see them as closed, and cannot close or
+   duplicate them. The caller sets @c streamobj and then stores 
+   @c streamfunc with release order, and calls @ref FCB_publish.
+
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
@@ -98,13 +105,26 @@ int FCB_decref(FCB* fcb);
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Install reserved FCBs in their fids.
+
+   This makes the fids of a call to @ref FCB_reserve refer to their
+   FCBs, whose streams must be set.
+
+   @param num the number of resources to publish.
+   @param fid array of size at least `num` of `Fid_t`.
+   @param fcb array of size at least `num` of `FCB*`.
+*/
+void FCB_publish(size_t num, Fid_t *fid, FCB** fcb);
+
+
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
    return the fids to the free pool of the current process and
    release the corresponding FCBs.
 
-   This is the opposite of operation @ref FCB_reserve. 
+   This is the opposite of operation @ref FCB_reserve, and it can only
+   be called before @ref FCB_publish.
    Note that this is very different from closing open fids.
    No I/O operation is performed by this function.
 
@@ -118,9 +138,32 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Copy the fileid table of a process to a new process.
+
+   The new process shares the FCBs of @c parent, whose reference
+   counts are increased.
+
+   @param newproc the process receiving the fileid table
+   @param parent the process whose fileid table is copied
+*/
+void FCB_inherit(PCB* newproc, PCB* parent);
+
+
+/** @brief Close all the fids of a process.
+
+   The fileid table of @c pcb is emptied and the reference
+   count of each FCB in it is decreased.
+
+   @param pcb the process whose fids are closed
+*/
+void FCB_close_all(PCB* pcb);
+
+
 /** @brief Translate an fid to an FCB.
 
-	This routine will return NULL if the fid is not legal.
+	This routine will return NULL if the fid is not legal, or if
+	it is reserved but not published yet (see @ref FCB_reserve).
+	No reference to the FCB is taken.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -12,13 +12,13 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
-
+/*
+	There is no kernel lock to take around a system call; each
+	system call locks the kernel objects it uses.
+ */
+#define PRE_CALL
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL
 
 
 /* with return */
@@ -64,16 +64,31 @@ void start_thread()
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadEx(task, argl, args, NULL);
+}
+
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr)
 {
   if(task == NULL) return -1;
 
+  size_t stack_size = (attr != NULL) ? attr->stack_size : 0;
+  if(stack_size != 0 && (stack_size < THREAD_STACK_MIN || stack_size > THREAD_STACK_MAX))
+    return NOTHREAD;
+
   /*spawn a new thread*/
   PCB* pcb = CURPROC;
-  TCB* new_thread = spawn_thread(pcb, start_thread); 
+  TCB* new_thread = spawn_thread(pcb, start_thread, stack_size); 
   PTCB* ptcb = spawn_PTCB(new_thread, task, argl, args);
   
+  Mutex_Lock(&proc_lock);
   rlist_push_back(& pcb->ptcb_list, rlnode_init(&ptcb->ptcb_list_node, ptcb));
   pcb->thread_count++;
+  Mutex_Unlock(&proc_lock);
 
   wakeup(new_thread);
 
@@ -105,28 +120,31 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   /*Find the PTCB from the given Tid*/
   PTCB* ptcb = (PTCB*) tid;
   PCB* pcb = CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&proc_lock);
 
   /* checks if PTCB exists in CURPROC list */
-  if(rlist_find(& pcb->ptcb_list, ptcb, NULL) == NULL) return -1;
+  if(rlist_find(& pcb->ptcb_list, ptcb, NULL) == NULL) goto finish;
 
   /* checks if PTCB is detached */
-  if(ptcb->detached) return -1;
+  if(ptcb->detached) goto finish;
 
   /* checks if thread tries to join itself or if Tid is invalid */
-  if(ptcb == cur_thread()->ptcb || tid == NOTHREAD) return -1;
+  if(ptcb == cur_thread()->ptcb || tid == NOTHREAD) goto finish;
   
   /*increase refcount*/
   ptcb->refcount++;
   
   /*till the thread becomes exited or detached*/ 
   while(!ptcb->exited && !ptcb->detached) {
-    kernel_wait(& ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&proc_lock, & ptcb->exit_cv, SCHED_USER);
   }
   
   ptcb->refcount--;
 
   /*if thread becomes detached it can no longer join */ 
-  if(ptcb->detached) return -1;
+  if(ptcb->detached) goto finish;
 
   if(exitval != NULL) *exitval = ptcb->exitval;
 
@@ -136,7 +154,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     free(ptcb);
   }
 
-  return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
   
 }
 
@@ -148,13 +170,16 @@ int sys_ThreadDetach(Tid_t tid)
   /*find PTCB from the given Tid*/
   PTCB* ptcb = (PTCB*) tid;
   PCB* pcb = CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&proc_lock);
 
   /* check if PTCB exists in CURPROC list */
-  if(rlist_find(& pcb->ptcb_list, ptcb, NULL) == NULL) return -1;
+  if(rlist_find(& pcb->ptcb_list, ptcb, NULL) == NULL) goto finish;
   
 
   /* check if ptcb is exited or if Tid is invalid */
-  if (ptcb->exited || tid == NOTHREAD) return -1;
+  if (ptcb->exited || tid == NOTHREAD) goto finish;
 
   /*if everything is okay, detach the thread */
   if(!ptcb->detached){    
@@ -164,7 +189,11 @@ int sys_ThreadDetach(Tid_t tid)
     kernel_broadcast(& ptcb->exit_cv);
   }
 
-  return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
 }
 
 
@@ -177,6 +206,8 @@ void sys_ThreadExit(int exitval)
   TCB* curThread = cur_thread();
   PTCB* ptcb = curThread->ptcb;
   
+  Mutex_Lock(&proc_lock);
+
   ptcb->exitval = exitval;
   ptcb->exited = 1;
 
@@ -187,9 +218,57 @@ void sys_ThreadExit(int exitval)
   if(curproc->thread_count == 0)
     cleanup_process(curproc);
   
-  kernel_sleep(EXITED, SCHED_USER);
+  Mutex_Unlock(&proc_lock);
+  sleep_releasing(EXITED, NULL, SCHED_USER, NO_TIMEOUT);
 }
 
+/**
+  @brief Set the CPU affinity of the given thread.
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask)
+{
+  PTCB* ptcb = (PTCB*) tid;
+  PCB* pcb = CURPROC;
+
+  /* drop cores that do not exist */
+  mask &= sched_cores_mask();
+  if(mask == 0) return -1;
+
+  int ret = -1;
+  Mutex_Lock(&proc_lock);
+
+  /* check if PTCB exists in CURPROC list */
+  if(tid == NOTHREAD || rlist_find(& pcb->ptcb_list, ptcb, NULL) == NULL) goto finish;
+  if(ptcb->exited) goto finish;
+
+  sched_set_affinity(ptcb->tcb, mask);
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
+}
+
+/**
+  @brief Return the CPU affinity of the given thread.
+  */
+cpumask_t sys_GetThreadAffinity(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*) tid;
+  PCB* pcb = CURPROC;
+
+  cpumask_t mask = 0;
+  Mutex_Lock(&proc_lock);
+
+  /* check if PTCB exists in CURPROC list */
+  if(tid != NOTHREAD && rlist_find(& pcb->ptcb_list, ptcb, NULL) != NULL && !ptcb->exited)
+    mask = ptcb->tcb->affinity & sched_cores_mask();
+
+  Mutex_Unlock(&proc_lock);
+  return mask;
+}
+
+
 /**
  * @brief Clean up the current process.
  * 
@@ -233,16 +312,13 @@ void cleanup_process(PCB* curproc) {
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  FCB_close_all(curproc);
 
- /* clean up the entire list */
-  while(!is_rlist_empty(&(curproc->ptcb_list)))
-    rlist_pop_front(&(curproc->ptcb_list));
+ /* clean up the entire list; every thread has exited */
+  while(!is_rlist_empty(&(curproc->ptcb_list))) {
+    PTCB* ptcb = rlist_pop_front(&(curproc->ptcb_list))->obj;
+    free(ptcb);
+  }
 
 
   /* Disconnect my main_thread */
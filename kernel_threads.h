@@ -76,6 +76,15 @@ PTCB* spawn_PTCB(TCB* tcb, Task task, int argl, void* args);
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief System call to create a new thread with the given attributes.
+
+  @param task a function to execute
+  @param attr the attributes of the thread, or NULL for the defaults
+  @returns the tid of the new thread, or NOTHREAD if the attributes are illegal
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr);
+
 
 /**
   @brief Return the Tid of the current thread.
@@ -137,12 +146,31 @@ int sys_ThreadDetach(Tid_t tid);
   */
 void sys_ThreadExit(int exitval);
 
+/**
+  @brief System call to set the CPU affinity of the given thread.
+
+  @param tid the tid of the thread
+  @param mask the set of cores the thread may run on
+  @returns 0 on success, and -1 on error.
+  @see SetThreadAffinity
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief System call to return the CPU affinity of the given thread.
+
+  @param tid the tid of the thread
+  @returns the affinity mask, or 0 on error.
+  @see GetThreadAffinity
+  */
+cpumask_t sys_GetThreadAffinity(Tid_t tid);
+
 /**
  * @brief Clean up the current process.
  * 
  * This function will be executed when the current
  * process has only one thread remaining and it wants
- * to exit. 
+ * to exit. It must be called with @c proc_lock held.
  * 
  * @param curproc 
  */
@@ -131,6 +131,7 @@ BARE_TEST(test_list_queue,
 		I++;
 	}
 
+	ASSERT(I==n+10);
 	ASSERT(is_rlist_empty(&L));
 
 	I = rlist_pop_back(&L);   /* The list is empty, but the pop_back method does not mind! */
@@ -2,6 +2,7 @@
 #ifndef __TINYOS_H__
 #define __TINYOS_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -35,6 +36,9 @@ typedef int Pid_t;		/* The PID type  */
 */
 typedef unsigned long timeout_t;
 
+/** @brief A timeout that never expires, for the calls that accept one. */
+#define TIMEOUT_INFINITE ((timeout_t)-1)
+
 
 /** @brief The invalid PID */
 #define NOPROC (-1)
@@ -61,22 +65,55 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief A set of cores, as a bit mask.
+
+  Bit @c c of the mask is set iff core @c c is in the set.
+  */
+typedef unsigned int cpumask_t;
+
+/** @brief The set of all cores */
+#define CPUMASK_ALL (~(cpumask_t)0)
+
 
 /*******************************************
  *      Concurrency control
  *******************************************/
 
+/** @brief A spinlock.
+
+    Spinlocks protect very short critical sections in the implementation of 
+    the kernel, e.g., the set of waiters of a mutex or a condition variable.
+    They are not meant for user code, which should use @c Mutex.
+*/
+typedef char spinlock_t;
+
+/** @brief This macro is used to initialize spinlocks. */
+#define SPINLOCK_INIT 0
+
+
 /** @brief A mutex is used to provide mutual exclusion. 
   
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A thread that finds the mutex locked spins for a while, as long as the
+    owner of the mutex is running on some core, and then sleeps in the
+    mutex's queue of waiters. Unlocking a mutex with waiters releases it and
+    wakes up the first waiter, which then tries to lock it again; a thread
+    that comes in meanwhile may take the mutex first, and then the waiter
+    sleeps again, still first in the queue.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  uintptr_t owner;        /**< The owning thread, or 0. Bit 0 is set if there are waiters. */
+  void* waitset;          /**< The waiters, in arrival order */
+  spinlock_t waitset_lock;  /**< A spinlock to protect `waitset` */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,24 +123,25 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL, SPINLOCK_INIT })
 
 
 /** @brief Lock a mutex.
 
-  Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
-  In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
+  Lock a mutex, by waiting if necessary, as long as it takes. While the owner 
+  of the mutex is running on another core, the caller spins; else, it sleeps 
+  until an unlock wakes it up, and tries again.
 
   @see Mutex
   @see Mutex_Unlock
-  @see set_core_preemption
   */
 void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. The mutex is released, and if there are
+    threads waiting for it, the first of them is woken up to try to lock it
+    again. It does not become the owner until it succeeds.
     @see Mutex
     @see Mutex_Lock
 */
@@ -122,7 +160,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  spinlock_t waitset_lock;   /**< A spinlock to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +171,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, SPINLOCK_INIT })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +240,199 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Wait on an address, if it holds the expected value.
+
+  This call is the building block of synchronization objects that live 
+  in user memory, e.g., locks that do not make any system call unless
+  they are contended.
+
+  If `*addr` is equal to @c expected, the calling thread sleeps until 
+  another thread calls @c FutexWake on the same address, or the timeout 
+  expires. Checking the value and going to sleep happen atomically with 
+  respect to @c FutexWake; therefore, a thread that changes `*addr` and 
+  then calls @c FutexWake, will not miss a thread that saw the old value.
+  
+  Like @c Cond_Wait, this call may return for other reasons, so the 
+  caller should check `*addr` again.
+
+  @param addr The address to wait on.
+  @param expected The value that `*addr` must hold for the thread to sleep.
+  @param timeout The time in milliseconds to wait, or @c TIMEOUT_INFINITE.
+  @returns 0 if the thread was woken up by @c FutexWake, or -1 if `*addr` 
+    was not equal to @c expected, or the thread woke up for another reason.
+  @see FutexWake
+ */
+int FutexWait(int* addr, int expected, timeout_t timeout);
+
+/** @brief Wake up threads waiting on an address.
+
+  Wake up at most @c n of the threads that wait on @c addr in 
+  @c FutexWait, in the order they started waiting.
+
+  @param addr The address the threads wait on.
+  @param n The maximum number of threads to wake up.
+  @returns the number of threads woken up.
+  @see FutexWait
+ */
+int FutexWake(int* addr, unsigned int n);
+
+
+/** @brief A counting semaphore.
+
+  A semaphore holds a non-negative count. @c Sem_Wait decrements the count,
+  sleeping while it is zero, and @c Sem_Post increments it. The uncontended
+  calls do not sleep or wake anybody up.
+
+  @see SEM_INIT
+  @see Sem_Wait
+  @see Sem_Post
+ */
+typedef struct {
+  int count;        /**< The value of the semaphore */
+  int waiters;      /**< The number of threads sleeping in @c Sem_Wait */
+} Semaphore;
+
+/** @brief  This macro is used to initialize semaphores.
+
+   It is used as follows:
+  @code
+  Semaphore my_sem = SEM_INIT(1);
+  @endcode
+ */
+#define SEM_INIT(n) ((Semaphore){ (n), 0 })
+
+/** @brief Decrement a semaphore, waiting until its count is positive.
+  @see Sem_Post
+ */
+void Sem_Wait(Semaphore* sem);
+
+/** @brief Decrement a semaphore, waiting at most @c timeout milliseconds.
+  @param sem the semaphore
+  @param timeout The time in milliseconds to wait.
+  @returns 1 if the semaphore was decremented, 0 if the timeout expired
+  @see Sem_Wait
+ */
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout);
+
+/** @brief Increment a semaphore, waking up one waiting thread (if any).
+  @see Sem_Wait
+ */
+void Sem_Post(Semaphore* sem);
+
+
+/** @brief A reusable thread barrier.
+
+  The threads that call @c Barrier_Wait wait until @c n of them have
+  arrived. Then, all of them continue, and the barrier can be used again
+  for the next phase.
+
+  @see BARRIER_INIT
+  @see Barrier_Wait
+ */
+typedef struct {
+  unsigned int count;   /**< The threads that have arrived at the current phase */
+  int phase;            /**< The number of completed phases */
+} Barrier;
+
+/** @brief  This macro is used to initialize barriers.
+
+   It is used as follows:
+  @code
+  Barrier my_barrier = BARRIER_INIT;
+  @endcode
+ */
+#define BARRIER_INIT ((Barrier){ 0, 0 })
+
+/** @brief Wait at a barrier until @c n threads have arrived.
+
+  All threads using the barrier in the same phase must pass the same @c n.
+  The last thread to arrive wakes up all the others at once.
+
+  @param bar the barrier
+  @param n the number of threads that synchronize at each phase
+  @returns 1 to the last thread that arrived at the phase, 0 to the others
+ */
+int Barrier_Wait(Barrier* bar, unsigned int n);
+
+
+/** @brief The number of reader counters of a per-core @c RwLock. */
+#define RWLOCK_SLOTS 32
+
+/** @brief A reader counter of a per-core @c RwLock, on a cache line of its own. */
+typedef struct {
+  unsigned int entries; /**< The readers that entered on the core */
+  unsigned int exits;   /**< The readers that left on the core */
+} __attribute__((aligned(64))) RwLockSlot;
+
+/** @brief A reader-writer lock.
+
+  Many readers can hold the lock together, but a writer holds it alone.
+  Writers are preferred: once a writer waits for the lock, new readers
+  wait until no writer holds it or waits for it.
+
+  By default, the readers are counted in the lock. With @c RWLOCK_PERCORE_INIT,
+  each core counts its readers in a slot of an array of @c RWLOCK_SLOTS, so
+  that readers on different cores do not write the same cache line. Then,
+  taking a read lock is cheaper, but a writer has to look at every slot.
+
+  @see RWLOCK_INIT
+  @see RWLOCK_PERCORE_INIT
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+  @see RwLock_Unlock
+ */
+typedef struct {
+  int state;            /**< The number of readers (if not per-core), plus @c RWLOCK_WRITER */
+  int writers;          /**< The writers that hold or wait for the lock */
+  int rseq;             /**< Changed when a waiting writer should look again */
+  uintptr_t owner;      /**< The writer that holds the lock, or 0 */
+  RwLockSlot* slots;    /**< The per-core reader counters, or NULL */
+} RwLock;
+
+/** @brief The bit of @c RwLock.state that is set while a writer holds the lock. */
+#define RWLOCK_WRITER 0x40000000
+
+/** @brief  This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RwLock my_lock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RwLock){ 0, 0, 0, 0, NULL })
+
+/** @brief  This macro is used to initialize per-core reader-writer locks.
+
+   The argument is an array of @c RWLOCK_SLOTS counters, initialized to 0,
+   which is used by this lock only. It is used as follows:
+  @code
+  RwLockSlot my_slots[RWLOCK_SLOTS];
+  RwLock my_lock = RWLOCK_PERCORE_INIT(my_slots);
+  @endcode
+ */
+#define RWLOCK_PERCORE_INIT(slots) ((RwLock){ 0, 0, 0, 0, (slots) })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  The caller must not hold the lock already.
+  @see RwLock_Unlock
+ */
+void RwLock_ReadLock(RwLock* rw);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  The caller must not hold the lock already.
+  @see RwLock_Unlock
+ */
+void RwLock_WriteLock(RwLock* rw);
+
+/** @brief Unlock a reader-writer lock, locked for reading or writing.
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+ */
+void RwLock_Unlock(RwLock* rw);
+
+
 /*******************************************
  *
  * Process creation
@@ -319,6 +550,42 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** @brief The smallest stack size of a thread, in bytes. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest stack size of a thread, in bytes. */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
+/**
+  @brief Attributes of a new thread.
+
+  A zero field selects the default value.
+
+  @see CreateThreadEx
+ */
+typedef struct thread_attr {
+  size_t stack_size;  /**< @brief The size of the thread stack, in bytes */
+} thread_attr;
+
+/**
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This is like `CreateThread`, but the new thread is created with the
+  attributes in `*attr`. If `attr` is `NULL`, the defaults are used.
+
+  The stack size is rounded up to a multiple of the page size. Stack
+  memory is only reserved when the thread is created; pages are committed
+  when they are first touched, so a large stack costs little unless it is
+  used. A thread that overflows its stack crashes (the page below the stack 
+  is inaccessible), instead of corrupting memory.
+
+  @param task a function to execute
+  @param attr the attributes of the new thread, or `NULL`
+  @returns the tid of the new thread, or `NOTHREAD` if the stack size
+    is not between `THREAD_STACK_MIN` and `THREAD_STACK_MAX`.
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +641,38 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the CPU affinity of the given thread.
+
+  The thread will only be scheduled on the cores in @c mask. Bits
+  of @c mask for cores that do not exist are ignored. If the thread
+  is currently running, or is ready on another core, the new affinity
+  takes effect the next time it is scheduled.
+
+  @param tid the tid of the thread
+  @param mask the set of cores the thread may run on
+  @returns 0 on success, and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the mask contains no existing core.
+  @see GetThreadAffinity
+  */
+int SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Return the CPU affinity of the given thread.
+
+  A new thread has the affinity of @c CPUMASK_ALL, restricted to the
+  existing cores.
+
+  @param tid the tid of the thread
+  @returns the affinity mask of the thread, or 0 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  @see SetThreadAffinity
+  */
+cpumask_t GetThreadAffinity(Tid_t tid);
+
 
 
 /*******************************************
@@ -780,6 +1079,23 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief The scheduling policies of tinyos3.
+
+  @see set_boot_policy
+  */
+typedef enum {
+  SCHED_POLICY_MLFQ,  /**< Multi-level feedback queue (the default). */
+  SCHED_POLICY_RR,    /**< Round-robin. */
+  SCHED_POLICY_FAIR   /**< Fair share, by virtual runtime. */
+} sched_policy;
+
+/** @brief Select the scheduling policy.
+
+  The policy is used by all subsequent calls to @c boot. This allows 
+  comparing the policies on the same binary.
+  */
+void set_boot_policy(sched_policy policy);
+
 
 /** @} */
 
@@ -74,15 +74,14 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
 
-typedef struct barrier {
-	Mutex mx;
-	CondVar cv;
-	unsigned int count, epoch;
-} barrier;
+/** @brief The barrier type of @c BarrierSync, initialized by @c BARRIER_INIT. */
+typedef Barrier barrier;
 
-#define BARRIER_INIT  ((barrier){ MUTEX_INIT, COND_INIT, 0, 0})
 
+/** @brief Wait at barrier @c bar until @c n threads arrive.
 
+  This is the same as @c Barrier_Wait, and is kept for older programs.
+ */
 void BarrierSync(barrier* bar, unsigned int n);
 
 
@@ -450,7 +450,7 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of 
 	the list and return in.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rlist_remove(list->prev); }
 
 /**
 	@brief Return the length of a list.
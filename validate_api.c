@@ -1,15 +1,20 @@
 
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <sys/sysinfo.h>
 
 #include "util.h"
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
 
 /*
  *
@@ -553,6 +558,56 @@ BOOT_TEST(test_dup2_error_on_invalid_fid,
 }
 
 
+#define OPEN_RACE_ROUNDS 2000
+static int open_race_done;
+
+/* Open and close streams, while a sibling closes and copies the same fids */
+static int open_race_opener(int argl, void* args)
+{
+	for(int i=0; i<OPEN_RACE_ROUNDS; i++) {
+		Fid_t fid = OpenNull();
+		pipe_t pipe;
+		int piped = (Pipe(&pipe) == 0);
+		if(fid != NOFILE) Close(fid);
+		if(piped) { Close(pipe.read); Close(pipe.write); }
+	}
+	__atomic_store_n(&open_race_done, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static int open_race_closer(int argl, void* args)
+{
+	for(unsigned int i=0; ! __atomic_load_n(&open_race_done, __ATOMIC_SEQ_CST); i++) {
+		Fid_t fid = i % 4;
+		if(i & 4)
+			Dup2(fid, (fid+1) % 4);
+		else
+			Close(fid);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_open_races_close_and_dup2,
+	"Test that a fid that is being opened cannot be closed or copied by\n"
+	"another thread of the process, until its stream is set."
+	)
+{
+	for(Fid_t fid=0; fid<MAX_FILEID; fid++) Close(fid);
+	open_race_done = 0;
+
+	Tid_t t1 = CreateThread(open_race_opener, 0, NULL);
+	Tid_t t2 = CreateThread(open_race_closer, 0, NULL);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	/* Every fid can be opened again */
+	for(Fid_t fid=0; fid<MAX_FILEID; fid++) Close(fid);
+	for(Fid_t fid=0; fid<MAX_FILEID; fid++)
+		ASSERT(OpenNull() == fid);
+	return 0;
+}
+
+
 BOOT_TEST(test_open_terminals,
 	"Test that every legal terminal can be opened."
 	)
@@ -924,6 +979,7 @@ TEST_SUITE(basic_tests,
 	&test_open_terminals,
 	&test_dup2_error_on_nonfile,
 	&test_dup2_error_on_invalid_fid,
+	&test_open_races_close_and_dup2,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
@@ -1026,6 +1082,220 @@ BOOT_TEST(test_detach_illegal_tid_gives_error,
 
 
 
+BOOT_TEST(test_affinity_illegal_tid_gives_error,
+	"Test that SetThreadAffinity and GetThreadAffinity reject an illegal Tid")
+{
+	ASSERT(SetThreadAffinity(NOTHREAD, CPUMASK_ALL)==-1);
+	ASSERT(GetThreadAffinity(NOTHREAD)==0);
+
+	/* Test with random numbers. Since we only have one thread, any call is an illegal call. */
+	for(int i=0; i<100; i++) {
+		Tid_t random_tid = lrand48();
+		if(random_tid==ThreadSelf()) /* Very unlikely, but still... */
+			continue;
+		ASSERT(SetThreadAffinity(random_tid, CPUMASK_ALL)==-1);
+		ASSERT(GetThreadAffinity(random_tid)==0);
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_affinity_set_get,
+	"Test that the affinity of a thread can be set and read back")
+{
+	Tid_t self = ThreadSelf();
+	cpumask_t all = (cpu_cores() < 32) ? (1u << cpu_cores())-1 : CPUMASK_ALL;
+
+	/* By default, all cores are allowed */
+	ASSERT(GetThreadAffinity(self)==all);
+
+	ASSERT(SetThreadAffinity(self, 1)==0);
+	ASSERT(GetThreadAffinity(self)==1);
+
+	/* Masks without an existing core are rejected */
+	ASSERT(SetThreadAffinity(self, 0)==-1);
+	if(cpu_cores() < 32)
+		ASSERT(SetThreadAffinity(self, ~all)==-1);
+	ASSERT(GetThreadAffinity(self)==1);
+
+	/* Non-existing cores are ignored */
+	ASSERT(SetThreadAffinity(self, CPUMASK_ALL)==0);
+	ASSERT(GetThreadAffinity(self)==all);
+
+	return 0;
+}
+
+
+static int affinity_pinned_thread(int argl, void* args)
+{
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << argl)==0);
+
+	/* After the next yield, we must always run on core argl */
+	yield(SCHED_USER);
+	for(int i=0; i<200; i++) {
+		ASSERT(cpu_core_id == argl);
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_affinity_pins_thread,
+	"Test that a thread only runs on the cores of its affinity",
+	.minimum_cores = 2
+	)
+{
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(affinity_pinned_thread, i % 2, NULL);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
+static int affinity_moved_ran, affinity_moved_core, affinity_spinners_on_2;
+
+/* Keep the run queue of core 2 long, until the moved thread runs */
+static int affinity_spinner(int argl, void* args)
+{
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << 2)==0);
+	yield(SCHED_USER);
+	ASSERT(cpu_core_id == 2);
+	__atomic_fetch_add(&affinity_spinners_on_2, 1, __ATOMIC_SEQ_CST);
+	for(int i=0; i<100000 && !__atomic_load_n(&affinity_moved_ran, __ATOMIC_SEQ_CST); i++)
+		yield(SCHED_USER);
+	return __atomic_load_n(&affinity_moved_ran, __ATOMIC_SEQ_CST);
+}
+
+static int affinity_moved_thread(int argl, void* args)
+{
+	affinity_moved_core = cpu_core_id;
+	__atomic_store_n(&affinity_moved_ran, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+BOOT_TEST(test_affinity_moves_queued_thread,
+	"Test that a thread waiting in the run queue of a core that its new affinity\n"
+	"excludes is moved to an allowed core, even when it would not be stolen.",
+	.minimum_cores = 3
+	)
+{
+	affinity_moved_ran = affinity_spinners_on_2 = 0;
+
+	/* Run on core 0, while core 2 has the busiest run queue */
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1u << 0)==0);
+	yield(SCHED_USER);
+	ASSERT(cpu_core_id == 0);
+	Tid_t spinners[4];
+	for(int i=0; i<4; i++)
+		spinners[i] = CreateThread(affinity_spinner, 0, NULL);
+	while(__atomic_load_n(&affinity_spinners_on_2, __ATOMIC_SEQ_CST) < 4)
+		yield(SCHED_USER);
+
+	/* 
+		The new thread waits in our run queue, where no peer steals it, until
+		we pin it to core 1 (unless we are preempted first, and it runs here).
+	 */
+	Tid_t t = CreateThread(affinity_moved_thread, 0, NULL);
+	ASSERT(SetThreadAffinity(t, 1u << 1)==0);
+	int early = __atomic_load_n(&affinity_moved_ran, __ATOMIC_SEQ_CST);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(early || affinity_moved_core == 1);
+
+	for(int i=0; i<4; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(spinners[i], &exitval)==0);
+		ASSERT(exitval == 1);
+	}
+	return 0;
+}
+
+
+/* Touch about argl bytes of stack */
+static int stack_user_thread(int argl, void* args)
+{
+	char buf[argl];
+	memset(buf, 1, argl);
+	return (argl == 0 || buf[argl-1] == 1);
+}
+
+BOOT_TEST(test_create_thread_ex,
+	"Test that CreateThreadEx creates threads with the given stack size, and rejects illegal sizes"
+	)
+{
+	thread_attr attr = { .stack_size = THREAD_STACK_MIN - 1 };
+	ASSERT(CreateThreadEx(stack_user_thread, 0, NULL, &attr)==NOTHREAD);
+	attr.stack_size = THREAD_STACK_MAX + 1;
+	ASSERT(CreateThreadEx(stack_user_thread, 0, NULL, &attr)==NOTHREAD);
+
+	/* Sizes that are not multiples of the page size are rounded up */
+	size_t sizes[] = { 0, THREAD_STACK_MIN, THREAD_STACK_MIN + 100, 1 << 20, 8 << 20 };
+	for(int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		attr.stack_size = sizes[i];
+		Tid_t t = CreateThreadEx(stack_user_thread, sizes[i] / 2, NULL, &attr);
+		ASSERT(t != NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0 && exitval==1);
+	}
+
+	/* The defaults */
+	Tid_t t = CreateThreadEx(stack_user_thread, 4096, NULL, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+static int policy_test_count;
+
+static int policy_test_thread(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	for(int i=0; i<50; i++) {
+		yield(SCHED_USER);
+		if(i % 10 == argl % 10) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, 1);
+			Mutex_Unlock(&mx);
+		}
+	}
+	__atomic_fetch_add(&policy_test_count, 1, __ATOMIC_SEQ_CST);
+	return argl;
+}
+
+static int policy_test_main(int argl, void* args)
+{
+	Tid_t tids[16];
+	for(int i=0; i<16; i++)
+		tids[i] = CreateThread(policy_test_thread, i, NULL);
+	for(int i=0; i<16; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval==i);
+	}
+	ASSERT(policy_test_count == 16);
+	return 0;
+}
+
+BARE_TEST(test_sched_policies,
+	"Test that threads run to completion under every scheduling policy.",
+	.timeout = 30
+	)
+{
+	sched_policy policies[] = { SCHED_POLICY_MLFQ, SCHED_POLICY_RR, SCHED_POLICY_FAIR };
+	for(int p=0; p<3; p++) {
+		set_boot_policy(policies[p]);
+		for(uint ncores=1; ncores<=4; ncores*=2) {
+			policy_test_count = 0;
+			boot(ncores, 0, policy_test_main, 0, NULL);
+		}
+	}
+	set_boot_policy(SCHED_POLICY_MLFQ);
+}
+
+
 static int create_join_thread_flag;
 
 static int create_join_thread_task(int argl, void* args) {
@@ -1415,6 +1685,12 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_affinity_illegal_tid_gives_error,
+	&test_affinity_set_get,
+	&test_affinity_pins_thread,
+	&test_affinity_moves_queued_thread,
+	&test_create_thread_ex,
+	&test_sched_policies,
 	NULL
 };
 
@@ -1428,7 +1704,7 @@ TEST_SUITE(thread_tests,
  *
  *
  *
- *  Pipe tests
+ *  Synchronization tests
  *
  *
  *
@@ -1436,1119 +1712,2913 @@ TEST_SUITE(thread_tests,
 
 
 
-BOOT_TEST(test_pipe_open,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_futex_wait_mismatch,
+	"Test that FutexWait returns at once when the value is not the expected one,\n"
+	"and that FutexWake returns 0 when nobody waits."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
-
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
-	}
+	int x = 1;
+	ASSERT(FutexWait(&x, 0, TIMEOUT_INFINITE) == -1);
+	ASSERT(FutexWake(&x, 1) == 0);
 	return 0;
 }
 
 
-BOOT_TEST(test_pipe_fails_on_exhausted_fid,
-	"Test that Pipe will fail if the fids are exhausted."
+BOOT_TEST(test_futex_wait_timeout,
+	"Test that FutexWait returns -1 when the timeout expires."
 	)
 {
-	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==0);
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==-1);	
+	int x = 0;
+	TimerDuration t0 = bios_clock();
+	ASSERT(FutexWait(&x, 0, 200) == -1);
+	ASSERT(bios_clock() - t0 >= 100000);
 	return 0;
 }
 
 
+#define FUTEX_WAITERS 5
 
-BOOT_TEST(test_pipe_close_reader,
-	"Open a pipe and put just a little data in it"
-	)
-{
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+static int futex_flag;
+static int futex_woken;
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	Close(pipe.read);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
-	}
+static int futex_waiter(int argl, void* args)
+{
+	while(__atomic_load_n(&futex_flag, __ATOMIC_SEQ_CST) == 0)
+		if(FutexWait(&futex_flag, 0, TIMEOUT_INFINITE) == 0)
+			__atomic_fetch_add(&futex_woken, 1, __ATOMIC_SEQ_CST);
 	return 0;
 }
 
-BOOT_TEST(test_pipe_close_writer,
-	"Open a pipe and put just a little data in it"
+BOOT_TEST(test_futex_wake,
+	"Test that FutexWake wakes up the threads waiting on an address, and\n"
+	"returns the number of threads it woke up."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	futex_flag = 0;
+	futex_woken = 0;
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
+	Tid_t t[FUTEX_WAITERS];
+	for(int i=0; i<FUTEX_WAITERS; i++)
+		t[i] = CreateThread(futex_waiter, 0, NULL);
 
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
-	}
-	Close(pipe.write);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
-	}
+	/* Give the waiters time to block */
+	sleep_thread(1);
+
+	/* Wake up one, then all at once. The first may have waited again. */
+	int woken = FutexWake(&futex_flag, 1);
+	ASSERT(woken <= 1);
+	__atomic_store_n(&futex_flag, 1, __ATOMIC_SEQ_CST);
+	woken += FutexWake(&futex_flag, FUTEX_WAITERS);
+	ASSERT(woken <= FUTEX_WAITERS+1);
+
+	for(int i=0; i<FUTEX_WAITERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(futex_woken == woken);
 	return 0;
 }
 
 
-/* Takes one integer argument, writes that many bytes to stdout.
+/*
+	A lock built on futexes. The state is 0 when unlocked, 1 when locked, 
+	and 2 when locked and there may be waiters. 
  */
-int data_producer(int argl, void* args)
+static void futex_lock(int* f)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
+	int c = 0;
+	if(__atomic_compare_exchange_n(f, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if(c != 2)
+		c = __atomic_exchange_n(f, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		FutexWait(f, 2, TIMEOUT_INFINITE);
+		c = __atomic_exchange_n(f, 2, __ATOMIC_ACQUIRE);
+	}
+}
 
-	Close(0);
+static void futex_unlock(int* f)
+{
+	if(__atomic_exchange_n(f, 0, __ATOMIC_RELEASE) == 2)
+		FutexWake(f, 1);
+}
 
-	char buffer[32768];
+#define FUTEX_LOCKERS 4
+#define FUTEX_LOCKS 2000
 
-	while(nbytes>0) {
-		unsigned int n = (nbytes<32768) ? nbytes : 32768;
-		int rc = Write(1, buffer, n);
-		assert(rc>0);
-		nbytes -= rc;
+static int futex_lock_word;
+static long futex_counter;
+
+static int futex_locker(int argl, void* args)
+{
+	for(int i=0; i<FUTEX_LOCKS; i++) {
+		futex_lock(&futex_lock_word);
+		long c = futex_counter;
+		/* Make the critical section long enough to be preempted */
+		if(i % 100 == 0) fibo(15);
+		futex_counter = c + 1;
+		futex_unlock(&futex_lock_word);
 	}
-	Close(1);
 	return 0;
 }
 
-/* Takes one integer argument. Reads its standard input to exhaustion,
-   asserts it read that many bytes. */
-int data_consumer(int argl, void* args) 
+BOOT_TEST(test_futex_lock,
+	"Test a lock built on FutexWait and FutexWake, with several threads\n"
+	"incrementing a counter."
+	)
 {
-	assert(argl == sizeof(int));
-	int nbytes = *(int*)args;
-	Close(1);
+	futex_lock_word = 0;
+	futex_counter = 0;
 
-	char buffer[16384];
-	int count = 0;
+	Tid_t t[FUTEX_LOCKERS];
+	for(int i=0; i<FUTEX_LOCKERS; i++)
+		t[i] = CreateThread(futex_locker, 0, NULL);
+	for(int i=0; i<FUTEX_LOCKERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
 
-	int rc = 1;
-	while(rc) {
-		rc = Read(0, buffer, 16384);
-		assert(rc>=0);
-		count += rc;
-	}
-	ASSERT(count == nbytes);
+	ASSERT(futex_counter == FUTEX_LOCKERS*FUTEX_LOCKS);
+	ASSERT(futex_lock_word == 0);
 	return 0;
 }
 
 
-BOOT_TEST(test_pipe_single_producer,
-	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+BOOT_TEST(test_sem_timedwait,
+	"Test that Sem_TimedWait decrements a positive semaphore at once, and\n"
+	"returns 0 when the timeout expires."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
+	Semaphore sem = SEM_INIT(2);
+	ASSERT(Sem_TimedWait(&sem, 100) == 1);
+	Sem_Wait(&sem);
+	ASSERT(sem.count == 0);
 
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
-	}
+	TimerDuration t0 = bios_clock();
+	ASSERT(Sem_TimedWait(&sem, 200) == 0);
+	ASSERT(bios_clock() - t0 >= 100000);
 
-	int N = 10000000;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	Sem_Post(&sem);
+	ASSERT(Sem_TimedWait(&sem, 100) == 1);
+	return 0;
+}
 
-	Close(0);
-	Close(1);
 
-	WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+/* A bounded buffer, with a semaphore for the free slots and one for the items */
+#define SEM_BUFSIZE 4
+#define SEM_ITEMS 2000
+#define SEM_PRODUCERS 3
+
+static Semaphore sem_slots, sem_items;
+static Mutex sem_mx;
+static int sem_buffer[SEM_BUFSIZE];
+static unsigned int sem_in, sem_out;
+
+static int sem_producer(int argl, void* args)
+{
+	for(int i=1; i<=SEM_ITEMS; i++) {
+		Sem_Wait(&sem_slots);
+		Mutex_Lock(&sem_mx);
+		sem_buffer[sem_in++ % SEM_BUFSIZE] = i;
+		Mutex_Unlock(&sem_mx);
+		Sem_Post(&sem_items);
+	}
 	return 0;
 }
 
-BOOT_TEST(test_pipe_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+BOOT_TEST(test_sem_buffer,
+	"Test a bounded buffer built with semaphores, with several producers and\n"
+	"one consumer."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-
-	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
-	if(pipe.read != 0) {
-		if(pipe.write==0) {
-			/* Get a null stream! */
-			Fid_t fid = OpenNull();
-			assert(fid!=NOFILE);
-			Dup2(0, fid);
-			pipe.write = fid;
-		}
-		Dup2(pipe.read, 0);
-		Close(pipe.read);
-	}
-	if(pipe.write!=1)  {
-		Dup2(pipe.write, 1);
-		Close(pipe.write);
+	sem_slots = SEM_INIT(SEM_BUFSIZE);
+	sem_items = SEM_INIT(0);
+	sem_mx = MUTEX_INIT;
+	sem_in = sem_out = 0;
+
+	Tid_t t[SEM_PRODUCERS];
+	for(int i=0; i<SEM_PRODUCERS; i++)
+		t[i] = CreateThread(sem_producer, 0, NULL);
+
+	long sum = 0;
+	for(int i=0; i<SEM_PRODUCERS*SEM_ITEMS; i++) {
+		Sem_Wait(&sem_items);
+		Mutex_Lock(&sem_mx);
+		sum += sem_buffer[sem_out++ % SEM_BUFSIZE];
+		Mutex_Unlock(&sem_mx);
+		Sem_Post(&sem_slots);
 	}
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-
-	Close(0);
-	Close(1);
-
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
-	return 0;
-}
-
-
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
-	)
-{
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
-	NULL
-};
-
+	for(int i=0; i<SEM_PRODUCERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+	ASSERT(sum == (long)SEM_PRODUCERS*SEM_ITEMS*(SEM_ITEMS+1)/2);
+	ASSERT(sem_slots.count == SEM_BUFSIZE);
+	ASSERT(sem_items.count == 0);
+	return 0;
+}
 
 
+#define BARRIER_THREADS 6
+#define BARRIER_PHASES 300
 
-/*********************************************
- *
- *
- *
- *  Socket tests
- *
- *
- *
- *********************************************/
+static Barrier test_bar;
+static int barrier_arrived;
+static int barrier_serial;
 
-struct connect_sockets
+static int barrier_thread(int argl, void* args)
 {
-	Fid_t sock1, lsock, *sock2;
-	port_t port;
-};
-
-static int connect_sockets_connect_process(int argl, void* args) {
-	struct connect_sockets* A = args;
-	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	for(int p=0; p<BARRIER_PHASES; p++) {
+		__atomic_fetch_add(&barrier_arrived, 1, __ATOMIC_SEQ_CST);
+		if(Barrier_Wait(&test_bar, BARRIER_THREADS))
+			__atomic_fetch_add(&barrier_serial, 1, __ATOMIC_SEQ_CST);
+		/* Everybody has arrived at this phase */
+		ASSERT(__atomic_load_n(&barrier_arrived, __ATOMIC_SEQ_CST) >= (p+1)*BARRIER_THREADS);
+		if(p % 50 == 0) fibo(15);
+	}
 	return 0;
 }
 
-void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+BOOT_TEST(test_barrier,
+	"Test that Barrier_Wait releases the threads only when all have arrived,\n"
+	"and returns 1 to exactly one thread at each phase."
+	)
 {
-	struct connect_sockets A = { 
-		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
-	};
-
-	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
-	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
-	ASSERT(pid != NOPROC);
-
-	/* accept the child's connection here */
-	*sock2 = Accept(lsock);
-	ASSERT(*sock2 != NOFILE);
-
-	/* Clean up child */
-	ASSERT(WaitChild(pid, NULL)==pid);
+	test_bar = BARRIER_INIT;
+	barrier_arrived = 0;
+	barrier_serial = 0;
+
+	Tid_t t[BARRIER_THREADS-1];
+	for(int i=0; i<BARRIER_THREADS-1; i++)
+		t[i] = CreateThread(barrier_thread, 0, NULL);
+	barrier_thread(0, NULL);
+	for(int i=0; i<BARRIER_THREADS-1; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
+
+	ASSERT(barrier_arrived == BARRIER_THREADS*BARRIER_PHASES);
+	ASSERT(barrier_serial == BARRIER_PHASES);
+	ASSERT(test_bar.phase == BARRIER_PHASES);
+	ASSERT(test_bar.count == 0);
+	return 0;
 }
 
 
-void check_transfer(Fid_t from, Fid_t to)
-{
-	char buffer[12] = {[0]=0};
-	int rc;
-	ASSERT((rc=Write(from,"Hello world", 12))==12);
-	ASSERT((rc=Read(to, buffer, 12))==12);
-	ASSERT((rc=strcmp("Hello world", buffer))==0);
-}
+#define RWLOCK_READERS 4
+#define RWLOCK_WRITERS 2
+#define RWLOCK_OPS 1000
 
+static RwLock test_rw;
+static RwLockSlot test_rw_slots[RWLOCK_SLOTS];
+static int rw_in_readers, rw_in_writers;
+static long rw_x, rw_y;
 
-BOOT_TEST(test_socket_constructor_many_per_port,
-	"Test that Socket succeeds opening many sockets on the same port"
-	)
+static int rw_reader(int argl, void* args)
 {
-	for(Fid_t f=0; f<MAX_FILEID; f++) {
-		ASSERT(Socket(100)!=NOFILE);
+	for(int i=0; i<RWLOCK_OPS; i++) {
+		RwLock_ReadLock(&test_rw);
+		__atomic_fetch_add(&rw_in_readers, 1, __ATOMIC_SEQ_CST);
+		ASSERT(__atomic_load_n(&rw_in_writers, __ATOMIC_SEQ_CST) == 0);
+		ASSERT(rw_x == rw_y);
+		if(i % 100 == 0) fibo(12);
+		__atomic_fetch_sub(&rw_in_readers, 1, __ATOMIC_SEQ_CST);
+		RwLock_Unlock(&test_rw);
 	}
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_out_of_fids,
-	"Test that the socket constructor fails on running out of Fids"
-	)
+static int rw_writer(int argl, void* args)
 {
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)!=NOFILE);
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)==NOFILE);	
+	for(int i=0; i<RWLOCK_OPS; i++) {
+		RwLock_WriteLock(&test_rw);
+		ASSERT(__atomic_fetch_add(&rw_in_writers, 1, __ATOMIC_SEQ_CST) == 0);
+		ASSERT(__atomic_load_n(&rw_in_readers, __ATOMIC_SEQ_CST) == 0);
+		rw_x++;
+		if(i % 100 == 0) fibo(12);
+		rw_y++;
+		__atomic_fetch_sub(&rw_in_writers, 1, __ATOMIC_SEQ_CST);
+		RwLock_Unlock(&test_rw);
+	}
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_illegal_port,
-	"Test that the socket constructor fails on illegal port"
-	)
+static void rwlock_test_run()
 {
-	ASSERT(Socket(NOPORT)!=NOFILE);
-	ASSERT(Socket(1)!=NOFILE);
-	ASSERT(Socket(MAX_PORT)!=NOFILE);
+	rw_in_readers = rw_in_writers = 0;
+	rw_x = rw_y = 0;
 
-	ASSERT(Socket(NOPORT-1)==NOFILE);
-	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
-	ASSERT(Socket(MAX_PORT+10)==NOFILE);
-	return 0;	
-}
+	Tid_t t[RWLOCK_READERS+RWLOCK_WRITERS];
+	for(int i=0; i<RWLOCK_READERS+RWLOCK_WRITERS; i++)
+		t[i] = CreateThread((i < RWLOCK_READERS) ? rw_reader : rw_writer, 0, NULL);
+	for(int i=0; i<RWLOCK_READERS+RWLOCK_WRITERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
 
-BOOT_TEST(test_listen_success,
-	"Test that Listen succeeds on an unbound socket"
-	)
-{
-	ASSERT(Listen(Socket(100))==0);
-	return 0;
+	ASSERT(rw_x == RWLOCK_WRITERS*RWLOCK_OPS);
+	ASSERT(rw_y == rw_x);
+	ASSERT(test_rw.state == 0 && test_rw.writers == 0 && test_rw.owner == 0);
 }
 
-BOOT_TEST(test_listen_fails_on_bad_fid,
-	"Test that Listen fails on an invalid fid"
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock excludes the writers from each other and\n"
+	"from the readers, with and without per-core reader counters."
 	)
 {
-	ASSERT(Listen(7)==-1);
-	ASSERT(Listen(OpenNull())==-1);
-	ASSERT(Listen(NOFILE)==-1);
-	ASSERT(Listen(MAX_FILEID)==-1);	
+	test_rw = RWLOCK_INIT;
+	rwlock_test_run();
+
+	memset(test_rw_slots, 0, sizeof(test_rw_slots));
+	test_rw = RWLOCK_PERCORE_INIT(test_rw_slots);
+	rwlock_test_run();
+	unsigned int entries = 0, exits = 0;
+	for(int i=0; i<RWLOCK_SLOTS; i++) {
+		entries += test_rw_slots[i].entries;
+		exits += test_rw_slots[i].exits;
+	}
+	ASSERT(entries == exits);
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_NOPORT,
-	"Test that Listen fails on a socket defined on NOPORT"
-	)
-{
-	ASSERT(Listen(Socket(NOPORT))==-1);
-	return 0;
-}
 
-BOOT_TEST(test_listen_fails_on_occupied_port,
-	"Test that Listen fails on an occupied port"
-	)
+static int rw_reader_nested(int argl, void* args)
 {
-	Fid_t f = Socket(100);
-	ASSERT(Listen(f)==0);
-	ASSERT(Listen(Socket(100))==-1);
-	Close(f);
-	ASSERT(Listen(Socket(100))==0);	
+	/* Readers can hold the lock together */
+	RwLock_ReadLock(&test_rw);
+	__atomic_fetch_add(&rw_in_readers, 1, __ATOMIC_SEQ_CST);
+	int n;
+	while((n = __atomic_load_n(&rw_in_readers, __ATOMIC_SEQ_CST)) < 2)
+		FutexWait(&rw_in_readers, n, 10);
+	RwLock_Unlock(&test_rw);
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_initialized_socket,
-	"Test that Listen fails on a socket that has been previously initialized by Listen"
+BOOT_TEST(test_rwlock_shared,
+	"Test that two readers can hold a reader-writer lock at the same time, and\n"
+	"that a waiting writer gets the lock before new readers."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);	
-	ASSERT(Listen(lsock)==-1);	
-	Fid_t sock[2];
-	sock[0] = Socket(200);
-	connect_sockets(sock[0], lsock, sock+1, 100);
-	ASSERT(Listen(sock[0])==-1);
-	ASSERT(Listen(sock[1])==-1);
+	test_rw = RWLOCK_INIT;
+	rw_in_readers = 0;
+	Tid_t t1 = CreateThread(rw_reader_nested, 0, NULL);
+	Tid_t t2 = CreateThread(rw_reader_nested, 0, NULL);
+	ASSERT(ThreadJoin(t1, NULL) == 0);
+	ASSERT(ThreadJoin(t2, NULL) == 0);
+
+	/* A writer waits for a reader; a new reader waits for the writer */
+	RwLock_ReadLock(&test_rw);
+	rw_in_readers = rw_in_writers = 0;
+	rw_x = rw_y = 0;
+	Tid_t w = CreateThread(rw_writer, 0, NULL);
+	while(__atomic_load_n(&test_rw.writers, __ATOMIC_SEQ_CST) == 0)
+		FutexWait(&test_rw.writers, 0, 10);
+	RwLock_Unlock(&test_rw);
+	RwLock_ReadLock(&test_rw);
+	ASSERT(rw_x >= 1);
+	RwLock_Unlock(&test_rw);
+	ASSERT(ThreadJoin(w, NULL) == 0);
 	return 0;
 }
 
 
-BOOT_TEST(test_accept_succeds,
-	"Test that accept succeeds on a legal connection"
-	)
+static Mutex pi_nested_mx[2];
+
+/* The levels are set directly, since the MLFQ would move them around */
+static int pi_nested_waiter(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
+	cur_thread()->priority = QUEUE_NUMBER-1;
+	Mutex_Lock(&pi_nested_mx[argl]);
+	Mutex_Unlock(&pi_nested_mx[argl]);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_bad_fid,
-	"Test that Accept fails on an invalid fid"
+BOOT_TEST(test_mutex_nested_inheritance,
+	"Test that a thread that holds two mutexes, each with a high-priority\n"
+	"waiter, keeps the inherited level until it unlocks both."
 	)
 {
-	ASSERT(Accept(7)==-1);
-	ASSERT(Accept(OpenNull())==-1);
-	ASSERT(Accept(NOFILE)==-1);
-	ASSERT(Accept(MAX_FILEID)==-1);
-	
+	TCB* self = cur_thread();
+	self->priority = 0;
+	pi_nested_mx[0] = pi_nested_mx[1] = MUTEX_INIT;
+	Mutex_Lock(&pi_nested_mx[0]);
+	Mutex_Lock(&pi_nested_mx[1]);
+
+	Tid_t t[2];
+	for(int i=0; i<2; i++)
+		t[i] = CreateThread(pi_nested_waiter, i, NULL);
+	/* Wait until both waiters have lent us their level */
+	for(size_t lenders = 0; lenders < 2; ) {
+		yield(SCHED_USER);
+		int pre = preempt_off;
+		ticket_lock(&self->lenders_lock);
+		lenders = rlist_len(&self->lenders);
+		ticket_unlock(&self->lenders_lock);
+		if(pre) preempt_on;
+	}
+	ASSERT(self->inherited == QUEUE_NUMBER-1);
+
+	/* The waiter of the second mutex still needs us */
+	Mutex_Unlock(&pi_nested_mx[0]);
+	ASSERT(self->inherited == QUEUE_NUMBER-1);
+
+	Mutex_Unlock(&pi_nested_mx[1]);
+	ASSERT(self->inherited == -1);
+
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(t[i], NULL) == 0);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_unbound_socket,
-	"Test that Accept fails on an uninitialized socket"
-	)
+
+/* 
+	Objects of test_rcu_torture: state 0 is free, 1 published, 2 retired.
+	Every RCU_TORTURE_OBJS updates wait for a grace period, that is, for
+	every reader core to pass through gain(). The pool is large, so that
+	the test needs few grace periods and is not slow on a host with fewer
+	CPUs than cores.
+ */
+#define RCU_TORTURE_OBJS 64
+#define RCU_TORTURE_UPDATES 2000
+
+static struct rcu_torture_obj {
+	int state;
+	int gen;
+	rcu_head rcu;
+} rcu_torture_pool[RCU_TORTURE_OBJS];
+
+static struct rcu_torture_obj* rcu_torture_ptr;
+static int rcu_torture_done, rcu_torture_errors, rcu_torture_reclaimed;
+
+static void rcu_torture_reclaim(void* obj)
 {
-	ASSERT(Accept(Socket(100))==-1);
-	return 0;
+	struct rcu_torture_obj* o = obj;
+	__atomic_store_n(&o->state, 0, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&rcu_torture_reclaimed, 1, __ATOMIC_SEQ_CST);
 }
 
-BOOT_TEST(test_accept_fails_on_connected_socket,
-	"Test that Accept fails on a connected socket"
-	)
+static int rcu_torture_reader(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
-	ASSERT(Accept(srv)==-1);		
+	for(int n=1; ! __atomic_load_n(&rcu_torture_done, __ATOMIC_SEQ_CST); n++) {
+		int oldpre = rcu_read_lock();
+		struct rcu_torture_obj* o = __atomic_load_n(&rcu_torture_ptr, __ATOMIC_SEQ_CST);
+		int gen = __atomic_load_n(&o->gen, __ATOMIC_SEQ_CST);
+		/* Linger, so that the writer retires o meanwhile */
+		for(int i=0; i<1000; i++)
+			if(__atomic_load_n(&o->state, __ATOMIC_SEQ_CST) == 0
+				|| __atomic_load_n(&o->gen, __ATOMIC_SEQ_CST) != gen) {
+				__atomic_fetch_add(&rcu_torture_errors, 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+		rcu_read_unlock(oldpre);
+		if(n % 16 == 0) yield(SCHED_USER);
+	}
 	return 0;
 }
 
-BOOT_TEST(test_accept_reusable,
-	"Test that Accept can be called on the same socket many times to create different connections."
+BOOT_TEST(test_rcu_torture,
+	"Test that an object retired with rcu_call is not reclaimed while a reader\n"
+	"may still hold it, and that every retired object is eventually reclaimed.",
+	.timeout = 30
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
-	uint n = MAX_FILEID/2 - 1;
-	Fid_t cli[n], srv[n];
-
-	for(uint i=0;i<n;i++) {
-		cli[i] = Socket(NOPORT);
-		connect_sockets(cli[i], lsock, srv+i, 100);
-	}
-	for(uint i=0;i<n;i++)
-		for(uint j=0;j<n;j++)  {
-			ASSERT(cli[i]!=srv[j]);
-			if(i==j) continue;
-			ASSERT(srv[i]!=srv[j]);
-			ASSERT(cli[i]!=cli[j]);
+	for(int i=0; i<RCU_TORTURE_OBJS; i++)
+		rcu_torture_pool[i] = (struct rcu_torture_obj){ .state = 0, .gen = 0 };
+	rcu_torture_pool[0].state = 1;
+	rcu_torture_ptr = &rcu_torture_pool[0];
+	rcu_torture_done = rcu_torture_errors = rcu_torture_reclaimed = 0;
+
+	int nreaders = cpu_cores();
+	Tid_t readers[nreaders];
+	for(int i=0; i<nreaders; i++)
+		readers[i] = CreateThread(rcu_torture_reader, 0, NULL);
+
+	for(int u=0; u<RCU_TORTURE_UPDATES; ) {
+		/* Reuse a reclaimed object, or wait for a grace period */
+		struct rcu_torture_obj* o = NULL;
+		for(int i=0; i<RCU_TORTURE_OBJS && o==NULL; i++) {
+			int free = 0;
+			if(__atomic_compare_exchange_n(&rcu_torture_pool[i].state, &free, 1,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				o = &rcu_torture_pool[i];
 		}
+		if(o == NULL) { yield(SCHED_USER); continue; }
 
-	return 0;
-}
+		__atomic_fetch_add(&o->gen, 1, __ATOMIC_SEQ_CST);
+		struct rcu_torture_obj* old = __atomic_exchange_n(&rcu_torture_ptr, o, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&old->state, 2, __ATOMIC_SEQ_CST);
+		rcu_call(&old->rcu, rcu_torture_reclaim, old);
+		u++;
+	}
 
+	__atomic_store_n(&rcu_torture_done, 1, __ATOMIC_SEQ_CST);
+	for(int i=0; i<nreaders; i++)
+		ASSERT(ThreadJoin(readers[i], NULL) == 0);
+	ASSERT(rcu_torture_errors == 0);
 
-/* Helper for test_accept_fails_on_exhausted_fid */
-static int accept_connection_assert_fail(int argl, void* args) 
-{
-	ASSERT(argl==sizeof(Fid_t));
-	Fid_t lsock = * (Fid_t*) args;
-	ASSERT(Accept(lsock)==NOFILE);
+	/* With the readers gone, the remaining callbacks run within a few ticks */
+	int n;
+	for(int i=0; i<200 && (n = __atomic_load_n(&rcu_torture_reclaimed, __ATOMIC_SEQ_CST)) < RCU_TORTURE_UPDATES; i++)
+		FutexWait(&rcu_torture_reclaimed, n, 10);
+	ASSERT(rcu_torture_reclaimed == RCU_TORTURE_UPDATES);
 	return 0;
 }
 
 
-BOOT_TEST(test_accept_fails_on_exhausted_fid,
-	"Test that Accept will fail if the fids of the process are exhausted."
+TEST_SUITE(sync_tests,
+	"A suite of tests for the synchronization system calls."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
+	&test_futex_wait_mismatch,
+	&test_futex_wait_timeout,
+	&test_futex_wake,
+	&test_futex_lock,
+	&test_sem_timedwait,
+	&test_sem_buffer,
+	&test_barrier,
+	&test_rwlock,
+	&test_rwlock_shared,
+	&test_mutex_nested_inheritance,
+	&test_rcu_torture,
+	NULL
+};
 
-	/* If MAX_FILEID is odd, allocate an extra fid */
-	if( (MAX_FILEID & 1) == 1 )  OpenNull();
 
-	/* Allocate pairs of fids */
-	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
-		Fid_t cli = Socket(NOPORT);
-		Fid_t srv;
-		ASSERT(cli != NOFILE);
-		connect_sockets(cli,lsock,&srv,100);
-	}
 
-	/* Ok, we should be able to get another client */
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
 
-	/* Call accept on another process and verify it fails */
-	Pid_t pid = Exec(accept_connection_assert_fail, sizeof(lsock), &lsock);
-	ASSERT(pid!=NOPROC);
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
+ *
+ *********************************************/
 
-	/* Now, if we try a connection we should fail! */
-	ASSERT(Connect(cli, 100, 1000)==-1);
-	ASSERT(WaitChild(pid, NULL)==pid);
-	return 0;
-}
 
 
-static int unblocking_accept_connection(int argl, void* args) 
+BOOT_TEST(test_pipe_open,
+	"Open a pipe and put just a little data in it"
+	)
 {
-	Fid_t lsock = argl;
-	ASSERT(Accept(lsock)==NOFILE);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
 	return 0;
 }
 
 
-
-BOOT_TEST(test_accept_unblocks_on_close,
-	"Test that Accept will unblock if the listening socket is closed."
+BOOT_TEST(test_pipe_fails_on_exhausted_fid,
+	"Test that Pipe will fail if the fids are exhausted."
 	)
 {
+	pipe_t pipe;
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==0);
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==-1);	
+	return 0;
+}
+
+
+
+BOOT_TEST(test_pipe_close_reader,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	Close(pipe.read);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_close_writer,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	Close(pipe.write);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
+	}
+	return 0;
+}
+
+
+/* Takes one integer argument, writes that many bytes to stdout.
+ */
+int data_producer(int argl, void* args)
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+
+	Close(0);
+
+	char buffer[32768];
+
+	while(nbytes>0) {
+		unsigned int n = (nbytes<32768) ? nbytes : 32768;
+		int rc = Write(1, buffer, n);
+		assert(rc>0);
+		nbytes -= rc;
+	}
+	Close(1);
+	return 0;
+}
+
+/* Takes one integer argument. Reads its standard input to exhaustion,
+   asserts it read that many bytes. */
+int data_consumer(int argl, void* args) 
+{
+	assert(argl == sizeof(int));
+	int nbytes = *(int*)args;
+	Close(1);
+
+	char buffer[16384];
+	int count = 0;
+
+	int rc = 1;
+	while(rc) {
+		rc = Read(0, buffer, 16384);
+		assert(rc>=0);
+		count += rc;
+	}
+	ASSERT(count == nbytes);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_single_producer,
+	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 10000000;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+
+	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
+	if(pipe.read != 0) {
+		if(pipe.write==0) {
+			/* Get a null stream! */
+			Fid_t fid = OpenNull();
+			assert(fid!=NOFILE);
+			Dup2(0, fid);
+			pipe.write = fid;
+		}
+		Dup2(pipe.read, 0);
+		Close(pipe.read);
+	}
+	if(pipe.write!=1)  {
+		Dup2(pipe.write, 1);
+		Close(pipe.write);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	)
+{
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_multi_producer,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Socket tests
+ *
+ *
+ *
+ *********************************************/
+
+struct connect_sockets
+{
+	Fid_t sock1, lsock, *sock2;
+	port_t port;
+};
+
+static int connect_sockets_connect_process(int argl, void* args) {
+	struct connect_sockets* A = args;
+	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	return 0;
+}
+
+void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+{
+	struct connect_sockets A = { 
+		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
+	};
+
+	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+
+	/* accept the child's connection here */
+	*sock2 = Accept(lsock);
+	ASSERT(*sock2 != NOFILE);
+
+	/* Clean up child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+}
+
+
+void check_transfer(Fid_t from, Fid_t to)
+{
+	char buffer[12] = {[0]=0};
+	int rc;
+	ASSERT((rc=Write(from,"Hello world", 12))==12);
+	ASSERT((rc=Read(to, buffer, 12))==12);
+	ASSERT((rc=strcmp("Hello world", buffer))==0);
+}
+
+
+BOOT_TEST(test_socket_constructor_many_per_port,
+	"Test that Socket succeeds opening many sockets on the same port"
+	)
+{
+	for(Fid_t f=0; f<MAX_FILEID; f++) {
+		ASSERT(Socket(100)!=NOFILE);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_out_of_fids,
+	"Test that the socket constructor fails on running out of Fids"
+	)
+{
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)!=NOFILE);
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)==NOFILE);	
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_illegal_port,
+	"Test that the socket constructor fails on illegal port"
+	)
+{
+	ASSERT(Socket(NOPORT)!=NOFILE);
+	ASSERT(Socket(1)!=NOFILE);
+	ASSERT(Socket(MAX_PORT)!=NOFILE);
+
+	ASSERT(Socket(NOPORT-1)==NOFILE);
+	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
+	ASSERT(Socket(MAX_PORT+10)==NOFILE);
+	return 0;	
+}
+
+BOOT_TEST(test_listen_success,
+	"Test that Listen succeeds on an unbound socket"
+	)
+{
+	ASSERT(Listen(Socket(100))==0);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_bad_fid,
+	"Test that Listen fails on an invalid fid"
+	)
+{
+	ASSERT(Listen(7)==-1);
+	ASSERT(Listen(OpenNull())==-1);
+	ASSERT(Listen(NOFILE)==-1);
+	ASSERT(Listen(MAX_FILEID)==-1);	
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_NOPORT,
+	"Test that Listen fails on a socket defined on NOPORT"
+	)
+{
+	ASSERT(Listen(Socket(NOPORT))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_occupied_port,
+	"Test that Listen fails on an occupied port"
+	)
+{
+	Fid_t f = Socket(100);
+	ASSERT(Listen(f)==0);
+	ASSERT(Listen(Socket(100))==-1);
+	Close(f);
+	ASSERT(Listen(Socket(100))==0);	
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_initialized_socket,
+	"Test that Listen fails on a socket that has been previously initialized by Listen"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);	
+	ASSERT(Listen(lsock)==-1);	
+	Fid_t sock[2];
+	sock[0] = Socket(200);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	ASSERT(Listen(sock[0])==-1);
+	ASSERT(Listen(sock[1])==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_succeds,
+	"Test that accept succeeds on a legal connection"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_bad_fid,
+	"Test that Accept fails on an invalid fid"
+	)
+{
+	ASSERT(Accept(7)==-1);
+	ASSERT(Accept(OpenNull())==-1);
+	ASSERT(Accept(NOFILE)==-1);
+	ASSERT(Accept(MAX_FILEID)==-1);
+	
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_unbound_socket,
+	"Test that Accept fails on an uninitialized socket"
+	)
+{
+	ASSERT(Accept(Socket(100))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_connected_socket,
+	"Test that Accept fails on a connected socket"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(Accept(srv)==-1);		
+	return 0;
+}
+
+BOOT_TEST(test_accept_reusable,
+	"Test that Accept can be called on the same socket many times to create different connections."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	uint n = MAX_FILEID/2 - 1;
+	Fid_t cli[n], srv[n];
+
+	for(uint i=0;i<n;i++) {
+		cli[i] = Socket(NOPORT);
+		connect_sockets(cli[i], lsock, srv+i, 100);
+	}
+	for(uint i=0;i<n;i++)
+		for(uint j=0;j<n;j++)  {
+			ASSERT(cli[i]!=srv[j]);
+			if(i==j) continue;
+			ASSERT(srv[i]!=srv[j]);
+			ASSERT(cli[i]!=cli[j]);
+		}
+
+	return 0;
+}
+
+
+/* Helper for test_accept_fails_on_exhausted_fid */
+static int accept_connection_assert_fail(int argl, void* args) 
+{
+	ASSERT(argl==sizeof(Fid_t));
+	Fid_t lsock = * (Fid_t*) args;
+	ASSERT(Accept(lsock)==NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_fails_on_exhausted_fid,
+	"Test that Accept will fail if the fids of the process are exhausted."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* If MAX_FILEID is odd, allocate an extra fid */
+	if( (MAX_FILEID & 1) == 1 )  OpenNull();
+
+	/* Allocate pairs of fids */
+	for(uint i=0;i< (MAX_FILEID-1)/2 ; i++) {		
+		Fid_t cli = Socket(NOPORT);
+		Fid_t srv;
+		ASSERT(cli != NOFILE);
+		connect_sockets(cli,lsock,&srv,100);
+	}
+
+	/* Ok, we should be able to get another client */
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+
+	/* Call accept on another process and verify it fails */
+	Pid_t pid = Exec(accept_connection_assert_fail, sizeof(lsock), &lsock);
+	ASSERT(pid!=NOPROC);
+
+	/* Now, if we try a connection we should fail! */
+	ASSERT(Connect(cli, 100, 1000)==-1);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+static int unblocking_accept_connection(int argl, void* args) 
+{
+	Fid_t lsock = argl;
+	ASSERT(Accept(lsock)==NOFILE);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_accept_unblocks_on_close,
+	"Test that Accept will unblock if the listening socket is closed."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Tid_t t = CreateThread(unblocking_accept_connection, lsock, NULL);
+
+	/* Here, we just wait some time, (of course, this is technically a race condition :-( */
+	fibo(30);
+	Close(lsock);
+
+	ThreadJoin(t,NULL);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_connect_fails_on_bad_fid,
+	"Test that Connect will fail if given a bad fid."
+	)
+{
+	ASSERT(Accept(7)==-1);
+	ASSERT(Accept(OpenNull())==-1);
+	ASSERT(Accept(NOFILE)==-1);
+	ASSERT(Accept(MAX_FILEID)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_bad_socket,
+	"Test that Connect will fail if given a listening or connected socket."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	ASSERT(Connect(lsock, 100, 1000)==-1);
+	Fid_t cli, srv;
+	cli = Socket(NOPORT);
+	ASSERT(cli!=NOFILE);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	ASSERT(Connect(cli, 100, 1000)==-1);
+	ASSERT(Connect(srv, 100, 1000)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_illegal_port,
+	"Test that connect fails if given an illegal port."
+	)
+{
+	Fid_t cli = Socket(10);
+	ASSERT(Connect(cli, NOPORT, 100)==-1);
+	ASSERT(Connect(cli, MAX_PORT+1, 100)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_non_listened_port,
+	"Test that Connect fails on a port that has no listener."
+	)
+{
+	Fid_t cli = Socket(10);
+	ASSERT(Connect(cli, 100, 100)==-1);
+
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_timeout,
+	"Test that connect fails on timeout.",
+	.timeout = 2
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(10);
+	/* Give it a short timeout */
+	ASSERT(Connect(cli, 100, 100)==-1);
+
+	return 0;
+}
+
+
+
+BOOT_TEST(test_socket_small_transfer,
+	"Open a socket and put just a little data in it, in both directions, for many times."
+	)
+{
+	Fid_t sock[2], lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+
+	ASSERT(Listen(lsock)==0);
+
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	for(uint i=0; i< 32768; i++) {
+		check_transfer(sock[0], sock[1]);
+		check_transfer(sock[1], sock[0]);		
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_single_producer,
+	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	Fid_t fid = Socket(NOPORT);
+	ASSERT(fid!=NOFILE);
+	if(fid!=0) {
+		ASSERT(Dup2(fid,0)==0);
+		ASSERT(Close(fid)==0);
+	}
+
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	if(lsock!=2) {
+		ASSERT(Dup2(lsock,2)==0);
+		ASSERT(Close(lsock)==0);
+	}
+
+	ASSERT(Listen(2)==0);
+
+	Fid_t srv;
+	connect_sockets(0, 2, &srv, 100);
+
+	if(srv!=1) {
+		ASSERT(Dup2(srv,1)==0);
+		ASSERT(Close(srv)==0);
+	}
+
+	int N = 10000000;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+BOOT_TEST(test_socket_multi_producer,
+	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+	)
+{
+	Fid_t fid = Socket(NOPORT);
+	ASSERT(fid!=NOFILE);
+	if(fid!=0) {
+		ASSERT(Dup2(fid,0)==0);
+		ASSERT(Close(fid)==0);
+	}
+
 	Fid_t lsock = Socket(100);
 	ASSERT(lsock!=NOFILE);
+	if(lsock!=2) {
+		ASSERT(Dup2(lsock,2)==0);
+		ASSERT(Close(lsock)==0);
+	}
+
+	ASSERT(Listen(2)==0);
+
+	Fid_t srv;
+	connect_sockets(0, 2, &srv, 100);
+
+	if(srv!=1) {
+		ASSERT(Dup2(srv,1)==0);
+		ASSERT(Close(srv)==0);
+	}
+
+	int N = 1000000;
+	for(int i=0;i<10;i++)
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+	N = 10*N;
+	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+
+	Close(0);
+	Close(1);
+
+	for(int i=0;i<10;i++)
+		WaitChild(NOPROC,NULL);
+	WaitChild(NOPROC,NULL);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_shudown_read,
+	"Test that ShutDown with SHUTDOWN_READ blocks Write"
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(uint i=0; i< 2000; i++) {
+		check_transfer(cli, srv);
+		check_transfer(srv, cli);
+	}
+
+	ASSERT(Write(srv, "Hello world",12)==12);
+
+	ShutDown(cli, SHUTDOWN_READ);
+	char buffer[12];
+	ASSERT(Read(cli, buffer, 12)==-1);
+	ASSERT(Write(srv, "Hello world",12)==-1);
+
+	for(uint i=0; i< 2000; i++) {
+		ASSERT(Write(srv, "Hello world",12)==-1);
+		check_transfer(cli, srv);
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_shudown_write,
+	"Test that ShutDown with SHUTDOWN_WRITE first exhausts buffers and then causes Read to return 0"
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
 	ASSERT(Listen(lsock)==0);
 
-	Tid_t t = CreateThread(unblocking_accept_connection, lsock, NULL);
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+
+	connect_sockets(cli, lsock, &srv, 100);
+
+	for(uint i=0; i< 2000; i++) {
+		check_transfer(cli, srv);
+		check_transfer(srv, cli);
+	}
+
+	ASSERT(Write(srv, "Hello world",12)==12);
+	ASSERT(Write(srv, "Hello world",12)==12);
+	ASSERT(Write(srv, "Hello world",12)==12);
+
+	ShutDown(srv, SHUTDOWN_WRITE);
+	ASSERT(Write(srv, "Hello world",12)==-1);
+
+	/* We should still read the three writes before the close. */
+	char buffer[12];
+	for(uint i=0;i<3;i++) {
+		ASSERT(Read(cli, buffer, 12)==12);
+		ASSERT(strcmp(buffer,"Hello world")==0);
+	}
+
+	for(uint i=0; i< 2000; i++) {
+		ASSERT(Read(cli, buffer, 12)==0);
+		check_transfer(cli, srv);
+	}
+
+	return 0;
+}
+
+
+
+
+TEST_SUITE(socket_tests,
+	"A suite of tests for sockets."
+	)
+{
+	&test_socket_constructor_many_per_port,
+	&test_socket_constructor_out_of_fids,
+	&test_socket_constructor_illegal_port,
+	
+	&test_listen_success,
+	&test_listen_fails_on_bad_fid,
+	&test_listen_fails_on_NOPORT,
+	&test_listen_fails_on_occupied_port,
+	&test_listen_fails_on_initialized_socket,
+
+	&test_accept_succeds,
+	&test_accept_fails_on_bad_fid,
+	&test_accept_fails_on_unbound_socket,
+	&test_accept_fails_on_connected_socket,
+	&test_accept_reusable,
+	&test_accept_fails_on_exhausted_fid,
+	&test_accept_unblocks_on_close,
+
+	&test_connect_fails_on_bad_fid,
+	&test_connect_fails_on_bad_socket,
+	&test_connect_fails_on_illegal_port,
+	&test_connect_fails_on_non_listened_port,
+	&test_connect_fails_on_timeout,
+
+	&test_socket_small_transfer,
+	&test_socket_single_producer,
+	&test_socket_multi_producer,
+
+	&test_shudown_read,
+	&test_shudown_write,
+
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Concurrency tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+
+
+unsigned int timestamp=0;
+
+unsigned int get_timestamp()
+{
+	return __atomic_fetch_add(&timestamp, 1, __ATOMIC_SEQ_CST);	
+}
+
+
+BOOT_TEST(test_multitask,
+	"Test that Exec returns before execution of the child is finished."
+	)
+{
+	unsigned int tschild;
+	int child(int argl, void* args)
+	{
+		unsigned int f = fibo(38);
+		tschild = get_timestamp();
+		return f>10;
+	}	
+
+	Exec(child, 0, NULL);
+	unsigned int ts = get_timestamp();
+	WaitChild(NOPROC, NULL);
+
+	ASSERT(ts < tschild);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_preemption,
+	"Test that children are executed preemptively."
+	)
+{
+	int child(int argl, void* args)
+	{
+		unsigned int* ts[2];
+		assert(sizeof(ts)==argl);
+		memcpy(ts, args, sizeof(ts));
+
+		*(ts[0]) = get_timestamp();
+		fibo(40);
+		*(ts[1]) = get_timestamp();
+		return 0;
+	}
+
+#define NCHILDREN 2
+	unsigned int start[NCHILDREN], end[NCHILDREN];
+
+	for(int i=0;i<NCHILDREN;i++) {
+		unsigned int* args[2];
+		args[0] = &start[i];
+		args[1] = &end[i];
+
+		Exec(child, sizeof(args), args);
+	}
+
+
+	for(int i=0; i<NCHILDREN; i++)
+		WaitChild(NOPROC, NULL);
+
+	for(int i=0;i<NCHILDREN;i++)
+		for(int j=0; j<NCHILDREN; j++)
+			if(i!=j)
+				ASSERT(start[i] < end[j]);
+
+	return 0;
+
+#undef NCHILDREN
+}
+
+
+
+
+
+void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
+
+int compute_child(int argl, void* args)
+{
+	unsigned int fib = fibo(35);
+	return fib %3 ==1;
+}
+
+
+BARE_TEST(test_parallelism,
+	"This test tests whether multiple cores are used in parallel.",
+	.timeout = 30, .minimum_cores=2,
+	)
+{
+
+	struct timeval tstart;
+	double Trun;
+
+	int run_twice(int argl, void* args) {
+		mark_time(&tstart);
+		Exec(compute_child, 0, NULL);
+		Exec(compute_child, 0, NULL);
+		WaitChild(NOPROC, NULL);
+		WaitChild(NOPROC, NULL);
+		Trun = time_since(&tstart);
+		return 0;
+	}
+
+
+	double run_times(uint ntimes, uint ncores)
+	{
+		double minTrun=0.0;
+		for(int I=0;I<ntimes; I++) {
+			boot(ncores, 0, run_twice, 0, NULL);
+			if(I==0)
+				minTrun = Trun;
+			else 
+				if(Trun < minTrun) minTrun = Trun;
+		}
+		return minTrun;
+	}
+
+	if(sysconf(_SC_NPROCESSORS_ONLN)<2) {
+		MSG("Cannot run this test on this machine, there is only 1 core.\n");
+		return;
+	}
+
+	double T1 = run_times(10, 1);
+	double T2 = run_times(10, 2);
+
+	MSG("1-core: %f   2-core: %f\n", T1, T2);
+	ASSERT_MSG( fabs(T1/T2  - 2.0) < 0.4, 
+		"Runtimes did not decrease enough. one core: %f sec    two cores: %f sec\n", 
+		T1, T2);
+}
+
 
-	/* Here, we just wait some time, (of course, this is technically a race condition :-( */
-	fibo(30);
-	Close(lsock);
 
-	ThreadJoin(t,NULL);
-	return 0;
-}
+TEST_SUITE(concurrency_tests,
+	"A suite of tests which test the operational concurrency of the kernel."
+	)
+{
+	&test_multitask,
+	&test_preemption,
+	&test_parallelism,
+	NULL
+};
 
 
 
-BOOT_TEST(test_connect_fails_on_bad_fid,
-	"Test that Connect will fail if given a bad fid."
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Terminal I/O tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+
+
+BOOT_TEST(test_input_concurrency,
+	"Test that input from one terminal does not obstruct input from other terminals.",
+	.minimum_terminals = 2
 	)
 {
-	ASSERT(Accept(7)==-1);
-	ASSERT(Accept(OpenNull())==-1);
-	ASSERT(Accept(NOFILE)==-1);
-	ASSERT(Accept(MAX_FILEID)==-1);
+	void open_at_0(uint term)
+	{
+		Fid_t f = OpenTerminal(term);
+		ASSERT(f!=NOFILE);
+		if(f!=0) {
+			ASSERT(Dup2(f,0)==0);
+			ASSERT(Close(f)==0);
+		}
+	}
+
+	int input_line(int argl, void* args)
+	{
+		FILE* fin = fidopen(0, "r");
+		char* line=NULL;
+		size_t llen;
+
+		ASSERT(getline(&line, &llen, fin));
+		fclose(fin);
+		free(line);
+		return 0;
+	}
+
+
+	open_at_0(0);
+	Pid_t p0 = Exec(input_line, 0, NULL);
+	open_at_0(1);
+	Pid_t p1 = Exec(input_line, 0, NULL);
 
+	sendme(0, "Hello ");
+	sendme(1, "Hellow world\n");
+	ASSERT(WaitChild(p1, NULL)==p1);
+	sendme(0, " world\n");
+	ASSERT(WaitChild(p0, NULL)==p0);
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_bad_socket,
-	"Test that Connect will fail if given a listening or connected socket."
+
+
+BOOT_TEST(test_term_input_driver_interrupt,
+	"Test that terminal input is interrupt driven. This is done by\n"
+	"opening a huge number of processes reading from the terminal and\n"
+	"measuring the effect on a compute process.",
+	.minimum_terminals = 1, .timeout = 100
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
+	int input_char(int argl, void* args)
+	{
+		char c;
+		ASSERT(Read(0, &c, 1)==1);
+		return 0;
+	}
 
-	ASSERT(Connect(lsock, 100, 1000)==-1);
-	Fid_t cli, srv;
-	cli = Socket(NOPORT);
-	ASSERT(cli!=NOFILE);
-	connect_sockets(cli, lsock, &srv, 100);
+	struct timeval t0;
+	double minTrun, maxTrun;
 
-	ASSERT(Connect(cli, 100, 1000)==-1);
-	ASSERT(Connect(srv, 100, 1000)==-1);
+	void run_times(uint ntimes)
+	{
+		for(int I=0;I<ntimes; I++) {
+			mark_time(&t0);
+			Pid_t pid = Exec(compute_child,0,NULL);
+			ASSERT(pid!=NOPROC);
+			ASSERT(WaitChild(pid, NULL)==pid);
+			double Trun = time_since(&t0);
+
+			if(I==0)
+				minTrun = maxTrun = Trun;
+			else {
+				if( Trun < minTrun) minTrun = Trun;
+				if( Trun > maxTrun) maxTrun = Trun;
+			}
+		}
+	}
+
+	void run_with_io(int nioproc)
+	{
+		for(int i=0; i< nioproc; i++)
+			ASSERT(Exec(input_char, 0, NULL)!=NOPROC);
+
+		/* If the readers are polling as the compute task runs, 
+		   this will take a long time! */
+		run_times(10);
+
+		char* dummy_input = malloc((nioproc+1)*sizeof(char));
+		for(int i=0; i< nioproc; i++)
+			dummy_input[i] = 'A';
+		dummy_input[nioproc] = '\0';
+		sendme(0, dummy_input);
+
+		free(dummy_input);
+		for(int i=0; i< nioproc; i++)
+			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	}
+
+	Fid_t fid = OpenTerminal(0);
+	ASSERT(fid!=NOFILE);
+	if(fid!=0) {
+		ASSERT(Dup2(fid,0)==0);
+		ASSERT(Close(fid)==0);		
+	}
+
+	run_with_io(1000);
+	double T1000 = minTrun;
+
+	run_with_io(0);
+	double T0 = minTrun;
+
+	MSG("Trun(0)= %f   Trun(1000)= %f\n", T0, T1000);
+	ASSERT_MSG( (T1000-T0)/T0 < 0.1, "Failed: Trun(0)= %f   Trun(1000)= %f\n", T0, T1000 );
 
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_illegal_port,
-	"Test that connect fails if given an illegal port."
+
+
+
+TEST_SUITE(io_tests,
+	"A suite of tests which test the concurrency of terminal I/O."
 	)
 {
-	Fid_t cli = Socket(10);
-	ASSERT(Connect(cli, NOPORT, 100)==-1);
-	ASSERT(Connect(cli, MAX_PORT+1, 100)==-1);
+	&test_input_concurrency,
+	&test_term_input_driver_interrupt,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
 
+
+/* Number of yields made by each thread in bench_yield_latency */
+#define BENCH_YIELDS 20000
+
+static int yield_bench_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		yield(SCHED_USER);
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_non_listened_port,
-	"Test that Connect fails on a port that has no listener."
+static int yield_bench_main(int argl, void* args)
+{
+	Tid_t tids[argl];
+	for(int i=0; i<argl; i++)
+		tids[i] = CreateThread(yield_bench_thread, BENCH_YIELDS, NULL);
+	for(int i=0; i<argl; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_yield_latency,
+	"Measure the latency of yield() on one core, with a number of ready threads,\n"
+	"for each scheduling policy.\n"
+	"Uncomment the SCHED_LINEAR_SCAN define in kernel_policy.c and rebuild,\n"
+	"to compare the MLFQ bitmap with a linear scan.",
+	.timeout = 300
 	)
 {
-	Fid_t cli = Socket(10);
-	ASSERT(Connect(cli, 100, 100)==-1);
+	int nthreads[] = { 1, 8, 64 };
+	sched_policy policies[] = { SCHED_POLICY_MLFQ, SCHED_POLICY_RR, SCHED_POLICY_FAIR };
+	const char* pnames[] = { "mlfq", "rr", "fair" };
+
+	for(int p=0; p<3; p++) {
+		set_boot_policy(policies[p]);
+		for(int i=0; i<3; i++) {
+			struct timeval t0;
+			mark_time(&t0);
+			boot(1, 0, yield_bench_main, nthreads[i], NULL);
+			double T = time_since(&t0);
+
+			MSG("policy=%-4s   threads=%3d   yields=%8d   usec/yield=%8.3f\n", pnames[p], nthreads[i], 
+				nthreads[i]*BENCH_YIELDS, 1E6*T/(nthreads[i]*BENCH_YIELDS));
+		}
+	}
+	set_boot_policy(SCHED_POLICY_MLFQ);
+}
+
+
+/* Number of sleeps made in bench_timeout_latency */
+#define BENCH_SLEEPS 50
+
+static int timeout_bench_main(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double overshoot = 0.0, worst = 0.0;
+
+	Mutex_Lock(&mx);
+	for(int i=0; i<BENCH_SLEEPS; i++) {
+		struct timeval t0;
+		mark_time(&t0);
+		Cond_TimedWait(&mx, &cv, argl);
+		double late = time_since(&t0) - argl*1E-3;
+		overshoot += late;
+		if(late > worst) worst = late;
+	}
+	Mutex_Unlock(&mx);
 
+	MSG("timeout=%3d msec   avg overshoot=%8.3f msec   worst=%8.3f msec\n", argl,
+		1E3*overshoot/BENCH_SLEEPS, 1E3*worst);
 	return 0;
 }
 
-BOOT_TEST(test_connect_fails_on_timeout,
-	"Test that connect fails on timeout.",
-	.timeout = 2
+
+BARE_TEST(bench_timeout_latency,
+	"Measure how late a thread sleeping with a timeout is woken up, while the\n"
+	"cores are otherwise idle.",
+	.timeout = 120
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	ASSERT(Listen(lsock)==0);
+	int timeouts[] = { 1, 5, 20 };
+	for(int i=0; i<3; i++)
+		boot(2, 0, timeout_bench_main, timeouts[i], NULL);
+}
 
-	Fid_t cli = Socket(10);
-	/* Give it a short timeout */
-	ASSERT(Connect(cli, 100, 100)==-1);
 
+/* Return the number of context switches in the last boot */
+static unsigned long total_ctx_switches(uint ncores)
+{
+	unsigned long sum = 0;
+	for(uint c=0; c<ncores; c++)
+		sum += cctx[c].ctx_switches;
+	return sum;
+}
+
+/* CPU-bound threads, counting their progress for a fixed time */
+#define HOG_THREADS 8
+static struct timeval hog_start;
+static unsigned long hog_progress[HOG_THREADS];
+
+static int hog_thread(int argl, void* args)
+{
+	while(time_since(&hog_start) < 2.0) {
+		fibo(20);
+		hog_progress[argl]++;
+	}
 	return 0;
 }
 
+static int hog_main(int argl, void* args)
+{
+	Tid_t tids[HOG_THREADS];
+	mark_time(&hog_start);
+	for(int i=0; i<HOG_THREADS; i++) {
+		hog_progress[i] = 0;
+		tids[i] = CreateThread(hog_thread, i, NULL);
+	}
+	for(int i=0; i<HOG_THREADS; i++)
+		ThreadJoin(tids[i], NULL);
+	return 0;
+}
 
+/* Jain's fairness index of the progress of the hogs: 1.0 is perfectly fair */
+static double hog_fairness()
+{
+	double sum = 0.0, sumsq = 0.0;
+	for(int i=0; i<HOG_THREADS; i++) {
+		sum += hog_progress[i];
+		sumsq += (double)hog_progress[i] * hog_progress[i];
+	}
+	return (sum*sum) / (HOG_THREADS*sumsq);
+}
 
-BOOT_TEST(test_socket_small_transfer,
-	"Open a socket and put just a little data in it, in both directions, for many times."
+BARE_TEST(bench_mlfq_quantum,
+	"Compare the per-level quantum table of MLFQ to a uniform QUANTUM. Report the\n"
+	"context switches of a symposium of threads, and the context switches and the\n"
+	"fairness (Jain's index) of CPU-bound threads.",
+	.timeout = 300
 	)
 {
-	Fid_t sock[2], lsock;
+	symposium_t symp;
+	symp.N = 10;
+	symp.bites = 5;
+	adjust_symposium(&symp, 2, 0);
+
+	/* The symposium prints to stdout */
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	close(devnull);
+
+	TimerDuration table[QUEUE_NUMBER];
+	memcpy(table, mlfq_quantum, sizeof(table));
+
+	for(int uniform=0; uniform<2; uniform++) {
+		for(int i=0; i<QUEUE_NUMBER; i++)
+			mlfq_quantum[i] = uniform ? QUANTUM : table[i];
+
+		struct timeval t0;
+		mark_time(&t0);
+		boot(1, 0, SymposiumOfThreads, sizeof(symp), &symp);
+		double T = time_since(&t0);
+
+		MSG("quantum=%-7s   symposium: time=%7.3f sec   context switches=%8lu\n",
+			uniform ? "uniform" : "table", T, total_ctx_switches(1));
+
+		boot(1, 0, hog_main, 0, NULL);
+		MSG("quantum=%-7s   hogs:      fairness=%6.4f   context switches=%8lu\n",
+			uniform ? "uniform" : "table", hog_fairness(), total_ctx_switches(1));
+	}
 
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	memcpy(mlfq_quantum, table, sizeof(table));
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+}
 
-	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
 
-	ASSERT(Listen(lsock)==0);
+/* Round trips made in bench_wakeup_latency */
+#define BENCH_ROUNDTRIPS 100
 
-	connect_sockets(sock[0], lsock, sock+1, 100);
-	for(uint i=0; i< 32768; i++) {
-		check_transfer(sock[0], sock[1]);
-		check_transfer(sock[1], sock[0]);		
+static volatile int wakeup_bench_done;
+
+static int wakeup_bench_hog(int argl, void* args)
+{
+	if(argl >= 0)
+		ASSERT(SetThreadAffinity(ThreadSelf(), 1u << argl)==0);
+	while(!wakeup_bench_done)
+		fibo(15);
+	return 0;
+}
+
+static int wakeup_bench_server(int argl, void* args)
+{
+	pipe_t* p = args;
+	ASSERT(SetThreadAffinity(ThreadSelf(), 2)==0);
+	char c;
+	while(Read(p[0].read, &c, 1)==1)
+		Write(p[1].write, &c, 1);
+	return 0;
+}
+
+static int wakeup_bench_main(int argl, void* args)
+{
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0 && Pipe(&p[1])==0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1)==0);
+
+	wakeup_bench_done = 0;
+	Tid_t hog0 = CreateThread(wakeup_bench_hog, 0, NULL);
+	Tid_t hog1 = CreateThread(wakeup_bench_hog, 1, NULL);
+	Tid_t server = CreateThread(wakeup_bench_server, 0, p);
+
+	/* Let the hogs sink to the bottom levels */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 300);
+	Mutex_Unlock(&mx);
+
+	double total = 0.0, worst = 0.0;
+	for(int i=0; i<BENCH_ROUNDTRIPS; i++) {
+		char c = 'x';
+		struct timeval t0;
+		mark_time(&t0);
+		ASSERT(Write(p[0].write, &c, 1)==1);
+		ASSERT(Read(p[1].read, &c, 1)==1);
+		double T = time_since(&t0);
+		total += T;
+		if(T > worst) worst = T;
 	}
 
+	wakeup_bench_done = 1;
+	Close(p[0].write);
+	ThreadJoin(server, NULL);
+	ThreadJoin(hog0, NULL);
+	ThreadJoin(hog1, NULL);
+
+	MSG("preemption=%-3s   avg round trip=%8.3f msec   worst=%8.3f msec\n",
+		sched_wakeup_preemption ? "on" : "off", 1E3*total/BENCH_ROUNDTRIPS, 1E3*worst);
 	return 0;
 }
 
-
-BOOT_TEST(test_socket_single_producer,
-	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
+BARE_TEST(bench_wakeup_latency,
+	"Measure the round trip time between two threads on two cores, through pipes,\n"
+	"while a CPU-bound thread runs on each core, with and without preemption on wakeup.",
+	.timeout = 300
 	)
 {
-	Fid_t fid = Socket(NOPORT);
-	ASSERT(fid!=NOFILE);
-	if(fid!=0) {
-		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);
+	for(int pre=1; pre>=0; pre--) {
+		sched_wakeup_preemption = pre;
+		boot(2, 0, wakeup_bench_main, 0, NULL);
 	}
+	sched_wakeup_preemption = 1;
+}
 
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	if(lsock!=2) {
-		ASSERT(Dup2(lsock,2)==0);
-		ASSERT(Close(lsock)==0);
-	}
 
-	ASSERT(Listen(2)==0);
+/* Round trips made by bench_handoff_latency, for each kind of stream */
+#define HANDOFF_ROUNDTRIPS 1000
 
-	Fid_t srv;
-	connect_sockets(0, 2, &srv, 100);
+/* Echo bytes from in to out, until in is closed */
+struct echo_fids { Fid_t in, out; };
 
-	if(srv!=1) {
-		ASSERT(Dup2(srv,1)==0);
-		ASSERT(Close(srv)==0);
-	}
+static int echo_server(int argl, void* args)
+{
+	struct echo_fids* f = args;
+	char c;
+	while(Read(f->in, &c, 1)==1)
+		Write(f->out, &c, 1);
+	return 0;
+}
 
-	int N = 10000000;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
-	ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+/* Return the average round trip time, in msec, of a byte sent to out,
+   and echoed back from in */
+static double roundtrip_time(Fid_t out, Fid_t in)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<HANDOFF_ROUNDTRIPS; i++) {
+		char c = 'x';
+		ASSERT(Write(out, &c, 1)==1);
+		ASSERT(Read(in, &c, 1)==1);
+	}
+	return 1E3*time_since(&t0)/HANDOFF_ROUNDTRIPS;
+}
 
-	Close(0);
-	Close(1);
+static int handoff_bench_connect(int argl, void* args)
+{
+	Fid_t* sock = args;
+	ASSERT(Connect(*sock, 100, 1000)==0);
+	return 0;
+}
 
-	WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+static int handoff_bench_main(int argl, void* args)
+{
+	wakeup_bench_done = 0;
+	Tid_t hog = argl ? CreateThread(wakeup_bench_hog, -1, NULL) : NOTHREAD;
+
+	/* Pipes */
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0 && Pipe(&p[1])==0);
+	struct echo_fids pf = { p[0].read, p[1].write };
+	Tid_t server = CreateThread(echo_server, 0, &pf);
+	double tpipe = roundtrip_time(p[0].write, p[1].read);
+	Close(p[0].write);
+	ThreadJoin(server, NULL);
+
+	/* Sockets */
+	Fid_t lsock = Socket(100), sock1 = Socket(NOPORT);
+	ASSERT(Listen(lsock)==0);
+	Tid_t conn = CreateThread(handoff_bench_connect, 0, &sock1);
+	Fid_t sock2 = Accept(lsock);
+	ASSERT(sock2 != NOFILE);
+	ThreadJoin(conn, NULL);
+	struct echo_fids sf = { sock2, sock2 };
+	server = CreateThread(echo_server, 0, &sf);
+	double tsock = roundtrip_time(sock1, sock1);
+	ShutDown(sock1, SHUTDOWN_WRITE);
+	ThreadJoin(server, NULL);
+
+	wakeup_bench_done = 1;
+	if(argl) ThreadJoin(hog, NULL);
+
+	MSG("handoff=%-3s   pipe round trip=%8.3f msec   socket round trip=%8.3f msec\n",
+		sched_wakeup_handoff ? "on" : "off", tpipe, tsock);
 	return 0;
 }
 
-BOOT_TEST(test_socket_multi_producer,
-	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
+BARE_TEST(bench_handoff_latency,
+	"Measure the round trip time of a byte between two threads, over pipes and\n"
+	"over sockets, on 2 cores, with and without handing off the core on wakeup.",
+	.timeout = 300
 	)
 {
-	Fid_t fid = Socket(NOPORT);
-	ASSERT(fid!=NOFILE);
-	if(fid!=0) {
-		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);
+	for(int hog=0; hog<=1; hog++)
+	for(int h=0; h<=1; h++) {
+		sched_wakeup_handoff = h;
+		boot(2, 0, handoff_bench_main, hog, NULL);
 	}
+	sched_wakeup_handoff = 1;
+}
 
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
-	if(lsock!=2) {
-		ASSERT(Dup2(lsock,2)==0);
-		ASSERT(Close(lsock)==0);
-	}
 
-	ASSERT(Listen(2)==0);
+/* Waiters woken up in each round of bench_broadcast */
+#define BROADCAST_WAITERS 500
+#define BROADCAST_ROUNDS 10
 
-	Fid_t srv;
-	connect_sockets(0, 2, &srv, 100);
+static Mutex bcast_mx = MUTEX_INIT;
+static CondVar bcast_cv = COND_INIT;
+static CondVar bcast_ready = COND_INIT;
+static int bcast_waiting;
+static int bcast_round;
 
-	if(srv!=1) {
-		ASSERT(Dup2(srv,1)==0);
-		ASSERT(Close(srv)==0);
+static int bcast_waiter(int argl, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	for(int r=0; r<BROADCAST_ROUNDS; r++) {
+		bcast_waiting++;
+		Cond_Signal(&bcast_ready);
+		while(bcast_round == r)
+			Cond_Wait(&bcast_mx, &bcast_cv);
 	}
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
 
-	int N = 1000000;
-	for(int i=0;i<10;i++)
-		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
-	N = 10*N;
-	ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+static int bcast_main(int argl, void* args)
+{
+	Tid_t tids[BROADCAST_WAITERS];
+	bcast_waiting = 0;
+	bcast_round = 0;
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		tids[i] = CreateThread(bcast_waiter, 0, NULL);
+
+	double total = 0.0;
+	Mutex_Lock(&bcast_mx);
+	for(int r=0; r<BROADCAST_ROUNDS; r++) {
+		while(bcast_waiting < BROADCAST_WAITERS)
+			Cond_Wait(&bcast_mx, &bcast_ready);
+		bcast_waiting = 0;
+		bcast_round++;
+
+		struct timeval t0;
+		mark_time(&t0);
+		if(argl)
+			Cond_Broadcast(&bcast_cv);
+		else
+			for(int i=0; i<BROADCAST_WAITERS; i++) Cond_Signal(&bcast_cv);
+		total += time_since(&t0);
+	}
+	Mutex_Unlock(&bcast_mx);
 
-	Close(0);
-	Close(1);
+	for(int i=0; i<BROADCAST_WAITERS; i++)
+		ThreadJoin(tids[i], NULL);
 
-	for(int i=0;i<10;i++)
-		WaitChild(NOPROC,NULL);
-	WaitChild(NOPROC,NULL);
+	MSG("%-16s %4d waiters: %8.3f usec per wakeup\n", argl ? "Cond_Broadcast" : "Cond_Signal loop",
+		BROADCAST_WAITERS, 1E6*total/(BROADCAST_ROUNDS*BROADCAST_WAITERS));
 	return 0;
 }
 
-
-
-BOOT_TEST(test_shudown_read,
-	"Test that ShutDown with SHUTDOWN_READ blocks Write"
+BARE_TEST(bench_broadcast,
+	"Measure the cost of waking up many threads waiting on a condition variable,\n"
+	"by Cond_Broadcast and by calling Cond_Signal for each waiter.",
+	.timeout = 300
 	)
 {
-	Fid_t lsock;
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
-	ASSERT(Listen(lsock)==0);
-
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
-	Fid_t srv;
-
-	connect_sockets(cli, lsock, &srv, 100);
-
-	for(uint i=0; i< 2000; i++) {
-		check_transfer(cli, srv);
-		check_transfer(srv, cli);
+	for(int ncores=1; ncores<=2; ncores++) {
+		MSG("%d cores\n", ncores);
+		for(int b=0; b<=1; b++)
+			boot(ncores, 0, bcast_main, b, NULL);
 	}
+}
 
-	ASSERT(Write(srv, "Hello world",12)==12);
 
-	ShutDown(cli, SHUTDOWN_READ);
-	char buffer[12];
-	ASSERT(Read(cli, buffer, 12)==-1);
-	ASSERT(Write(srv, "Hello world",12)==-1);
+/* Threads created and joined in bench_thread_spawn */
+#define SPAWN_THREADS 5000
 
-	for(uint i=0; i< 2000; i++) {
-		ASSERT(Write(srv, "Hello world",12)==-1);
-		check_transfer(cli, srv);
+static int spawn_bench_thread(int argl, void* args) { return argl; }
+
+static int spawn_bench_main(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<SPAWN_THREADS; i++) {
+		int exitval;
+		Tid_t t = CreateThread(spawn_bench_thread, i, NULL);
+		ASSERT(ThreadJoin(t, &exitval)==0 && exitval==i);
 	}
+	double T = time_since(&t0);
 
+	MSG("thread cache=%-3s  %8.0f threads/sec", thread_cache_max ? "on" : "off", SPAWN_THREADS/T);
 	return 0;
 }
 
-
-BOOT_TEST(test_shudown_write,
-	"Test that ShutDown with SHUTDOWN_WRITE first exhausts buffers and then causes Read to return 0"
+BARE_TEST(bench_thread_spawn,
+	"Measure the throughput of creating and joining threads, with and without\n"
+	"the thread cache.",
+	.timeout = 300
 	)
 {
-	Fid_t lsock;
-	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
-	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
-	ASSERT(Listen(lsock)==0);
-
-	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
-	Fid_t srv;
-
-	connect_sockets(cli, lsock, &srv, 100);
-
-	for(uint i=0; i< 2000; i++) {
-		check_transfer(cli, srv);
-		check_transfer(srv, cli);
+	unsigned int cache_max = thread_cache_max;
+	for(int cache=0; cache<=1; cache++) {
+		thread_cache_max = cache ? cache_max : 0;
+		boot(1, 0, spawn_bench_main, 0, NULL);
+		MSG("   hits=%lu misses=%lu\n", cctx[0].thread_cache_hits, cctx[0].thread_cache_misses);
 	}
+	thread_cache_max = cache_max;
+}
 
-	ASSERT(Write(srv, "Hello world",12)==12);
-	ASSERT(Write(srv, "Hello world",12)==12);
-	ASSERT(Write(srv, "Hello world",12)==12);
 
-	ShutDown(srv, SHUTDOWN_WRITE);
-	ASSERT(Write(srv, "Hello world",12)==-1);
+/* Threads kept alive together in bench_many_threads */
+#define MANY_THREADS 10000
 
-	/* We should still read the three writes before the close. */
-	char buffer[12];
-	for(uint i=0;i<3;i++) {
-		ASSERT(Read(cli, buffer, 12)==12);
-		ASSERT(strcmp(buffer,"Hello world")==0);
-	}
+/* The resident memory of the process, in kbytes */
+static long resident_kbytes()
+{
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f == NULL) return 0;
+	if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
-	for(uint i=0; i< 2000; i++) {
-		ASSERT(Read(cli, buffer, 12)==0);
-		check_transfer(cli, srv);
-	}
+static Mutex many_mx = MUTEX_INIT;
+static CondVar many_cv = COND_INIT;
+static int many_done;
 
+static int many_threads_waiter(int argl, void* args)
+{
+	Mutex_Lock(&many_mx);
+	while(!many_done)
+		Cond_Wait(&many_mx, &many_cv);
+	Mutex_Unlock(&many_mx);
 	return 0;
 }
 
+static int many_threads_main(int argl, void* args)
+{
+	static Tid_t tids[MANY_THREADS];
+	thread_attr attr = { .stack_size = argl };
+	many_done = 0;
 
+	long rss0 = resident_kbytes();
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<MANY_THREADS; i++) {
+		tids[i] = CreateThreadEx(many_threads_waiter, 0, NULL, &attr);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	double T = time_since(&t0);
 
+	/* Let all threads block */
+	Mutex_Lock(&many_mx);
+	Cond_TimedWait(&many_mx, &many_cv, 100);
+	long rss1 = resident_kbytes();
+	many_done = 1;
+	Cond_Broadcast(&many_cv);
+	Mutex_Unlock(&many_mx);
 
-TEST_SUITE(socket_tests,
-	"A suite of tests for sockets."
-	)
-{
-	&test_socket_constructor_many_per_port,
-	&test_socket_constructor_out_of_fids,
-	&test_socket_constructor_illegal_port,
-	
-	&test_listen_success,
-	&test_listen_fails_on_bad_fid,
-	&test_listen_fails_on_NOPORT,
-	&test_listen_fails_on_occupied_port,
-	&test_listen_fails_on_initialized_socket,
+	for(int i=0; i<MANY_THREADS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
 
-	&test_accept_succeds,
-	&test_accept_fails_on_bad_fid,
-	&test_accept_fails_on_unbound_socket,
-	&test_accept_fails_on_connected_socket,
-	&test_accept_reusable,
-	&test_accept_fails_on_exhausted_fid,
-	&test_accept_unblocks_on_close,
+	MSG("stack=%4d kbytes   %8.0f threads/sec   %6.1f kbytes resident per thread\n",
+		argl/1024, MANY_THREADS/T, (double)(rss1-rss0)/MANY_THREADS);
+	return 0;
+}
 
-	&test_connect_fails_on_bad_fid,
-	&test_connect_fails_on_bad_socket,
-	&test_connect_fails_on_illegal_port,
-	&test_connect_fails_on_non_listened_port,
-	&test_connect_fails_on_timeout,
+BARE_TEST(bench_many_threads,
+	"Measure the resident memory of many blocked threads, for different stack sizes.",
+	.timeout = 300
+	)
+{
+	int sizes[] = { THREAD_STACK_MIN, THREAD_STACK_SIZE, 1 << 20 };
+	for(int i=0; i<3; i++)
+		boot(1, 0, many_threads_main, sizes[i], NULL);
+}
 
-	&test_socket_small_transfer,
-	&test_socket_single_producer,
-	&test_socket_multi_producer,
 
-	&test_shudown_read,
-	&test_shudown_write,
+/* Round trips between two contexts in bench_context_switch */
+#define SWITCH_ROUNDS 1000000
 
-	NULL
-};
+static cpu_context_t switch_bench_main_ctx, switch_bench_ctx;
 
+static void switch_bench_func()
+{
+	while(1)
+		cpu_swap_context(&switch_bench_ctx, &switch_bench_main_ctx);
+}
 
+BARE_TEST(bench_context_switch,
+	"Measure the cost of cpu_swap_context, with the fast context switch and with\n"
+	"swapcontext, and the latency of yield() in the VM with each.",
+	.timeout = 300
+	)
+{
+	int saved = cpu_fast_context_switch;
+	size_t stack_size = 64*1024;
+	void* stack = malloc(stack_size);
+
+#ifdef BIOS_FAST_CONTEXT_SWITCH
+	int maxfast = 1;
+#else
+	int maxfast = 0;
+#endif
+	for(int fast=0; fast<=maxfast; fast++) {
+		cpu_fast_context_switch = fast;
+
+		/* Switch back and forth between two contexts, outside the VM */
+		cpu_initialize_context(&switch_bench_ctx, stack, stack_size, switch_bench_func);
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i=0; i<SWITCH_ROUNDS; i++)
+			cpu_swap_context(&switch_bench_main_ctx, &switch_bench_ctx);
+		double Tswitch = time_since(&t0);
+
+		/* Yield in the VM */
+		mark_time(&t0);
+		boot(1, 0, yield_bench_main, 8, NULL);
+		double Tyield = time_since(&t0);
+
+		MSG("%-11s  nsec/switch=%7.1f   usec/yield=%7.3f\n", fast ? "fast" : "swapcontext",
+			1E9*Tswitch/(2*SWITCH_ROUNDS), 1E6*Tyield/(8*BENCH_YIELDS));
+	}
 
+	free(stack);
+	cpu_fast_context_switch = saved;
+}
 
-/*********************************************
- *
- *
- *
- *  Concurrency tests
- *
- *
- *
- *********************************************/
 
+/* Toggles of preemption in bench_preempt_toggle */
+#define PREEMPT_TOGGLES 1000000
 
+static double preempt_toggle_soft, preempt_toggle_sigmask;
 
+static int preempt_toggle_main(int argl, void* args)
+{
+	struct timeval t0;
 
+	mark_time(&t0);
+	for(int i=0; i<PREEMPT_TOGGLES; i++) {
+		int enabled = cpu_disable_interrupts();
+		if(enabled) cpu_enable_interrupts();
+	}
+	preempt_toggle_soft = time_since(&t0);
+
+	/* The cost of doing the same with the signal mask */
+	sigset_t usr1, saved;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	mark_time(&t0);
+	for(int i=0; i<PREEMPT_TOGGLES; i++) {
+		pthread_sigmask(SIG_BLOCK, &usr1, &saved);
+		if(!sigismember(&saved, SIGUSR1))
+			pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+	}
+	preempt_toggle_sigmask = time_since(&t0);
 
-unsigned int timestamp=0;
+	return 0;
+}
 
-unsigned int get_timestamp()
+BARE_TEST(bench_preempt_toggle,
+	"Measure the cost of a preempt_off/preempt_on pair in the VM, against\n"
+	"blocking and unblocking the interrupt signal with pthread_sigmask.",
+	.timeout = 300
+	)
 {
-	return __atomic_fetch_add(&timestamp, 1, __ATOMIC_SEQ_CST);	
+	boot(1, 0, preempt_toggle_main, 0, NULL);
+	MSG("soft flag    nsec/toggle=%7.1f\n", 1E9*preempt_toggle_soft/PREEMPT_TOGGLES);
+	MSG("sigmask      nsec/toggle=%7.1f\n", 1E9*preempt_toggle_sigmask/PREEMPT_TOGGLES);
 }
 
 
-BOOT_TEST(test_multitask,
-	"Test that Exec returns before execution of the child is finished."
-	)
-{
-	unsigned int tschild;
-	int child(int argl, void* args)
-	{
-		unsigned int f = fibo(38);
-		tschild = get_timestamp();
-		return f>10;
-	}	
+/* Parameters of bench_stream_throughput */
+#define STREAM_PAIRS 4
+#define STREAM_BYTES (32<<20)
+#define STREAM_CHUNK 4096
 
-	Exec(child, 0, NULL);
-	unsigned int ts = get_timestamp();
-	WaitChild(NOPROC, NULL);
+struct stream_pair { Fid_t in, out; int socket; };
 
-	ASSERT(ts < tschild);
+static int stream_writer(int argl, void* args)
+{
+	struct stream_pair* sp = args;
+	char buf[STREAM_CHUNK];
+	memset(buf, 'x', STREAM_CHUNK);
+	for(int n=0; n<STREAM_BYTES; ) {
+		int w = Write(sp->out, buf, STREAM_CHUNK);
+		ASSERT(w>0);
+		n += w;
+	}
+	if(sp->socket)
+		ShutDown(sp->out, SHUTDOWN_WRITE);
+	else
+		Close(sp->out);
 	return 0;
 }
 
-
-
-BOOT_TEST(test_preemption,
-	"Test that children are executed preemptively."
-	)
+static int stream_reader(int argl, void* args)
 {
-	int child(int argl, void* args)
-	{
-		unsigned int* ts[2];
-		assert(sizeof(ts)==argl);
-		memcpy(ts, args, sizeof(ts));
+	struct stream_pair* sp = args;
+	char buf[STREAM_CHUNK];
+	long total = 0;
+	int r;
+	while((r = Read(sp->in, buf, STREAM_CHUNK)) > 0)
+		total += r;
+	ASSERT(total >= STREAM_BYTES);
+	return 0;
+}
 
-		*(ts[0]) = get_timestamp();
-		fibo(40);
-		*(ts[1]) = get_timestamp();
-		return 0;
-	}
+static double stream_bench_time;
 
-#define NCHILDREN 2
-	unsigned int start[NCHILDREN], end[NCHILDREN];
+static int stream_bench_main(int argl, void* args)
+{
+	struct stream_pair sp[STREAM_PAIRS];
 
-	for(int i=0;i<NCHILDREN;i++) {
-		unsigned int* args[2];
-		args[0] = &start[i];
-		args[1] = &end[i];
+	if(argl == 0) {
+		for(int i=0; i<STREAM_PAIRS; i++) {
+			pipe_t p;
+			ASSERT(Pipe(&p)==0);
+			sp[i] = (struct stream_pair){ p.read, p.write, 0 };
+		}
+	} else {
+		Fid_t lsock = Socket(100);
+		ASSERT(Listen(lsock)==0);
+		for(int i=0; i<STREAM_PAIRS; i++) {
+			Fid_t sock = Socket(NOPORT);
+			Tid_t conn = CreateThread(handoff_bench_connect, 0, &sock);
+			Fid_t peer = Accept(lsock);
+			ASSERT(peer != NOFILE);
+			ThreadJoin(conn, NULL);
+			sp[i] = (struct stream_pair){ peer, sock, 1 };
+		}
+	}
 
-		Exec(child, sizeof(args), args);
+	/* Independent streams, a writer and a reader on each */
+	Tid_t t[2*STREAM_PAIRS];
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<STREAM_PAIRS; i++) {
+		t[2*i] = CreateThread(stream_writer, 0, &sp[i]);
+		t[2*i+1] = CreateThread(stream_reader, 0, &sp[i]);
 	}
+	for(int i=0; i<2*STREAM_PAIRS; i++)
+		ThreadJoin(t[i], NULL);
+	stream_bench_time = time_since(&t0);
+	return 0;
+}
 
+BARE_TEST(bench_stream_throughput,
+	"Measure the aggregate throughput of independent pipes and of independent\n"
+	"socket connections, with a writer and a reader thread on each, on 1, 2\n"
+	"and 4 cores.",
+	.timeout = 300
+	)
+{
+	for(int ncores=1; ncores<=4; ncores*=2) {
+		double mbps[2];
+		for(int sock=0; sock<=1; sock++) {
+			boot(ncores, 0, stream_bench_main, sock, NULL);
+			mbps[sock] = STREAM_PAIRS*(double)STREAM_BYTES/(1<<20)/stream_bench_time;
+		}
+		MSG("cores=%d  streams=%d   pipes=%8.1f MB/s   sockets=%8.1f MB/s\n",
+			ncores, STREAM_PAIRS, mbps[0], mbps[1]);
+	}
+}
 
-	for(int i=0; i<NCHILDREN; i++)
-		WaitChild(NOPROC, NULL);
 
-	for(int i=0;i<NCHILDREN;i++)
-		for(int j=0; j<NCHILDREN; j++)
-			if(i!=j)
-				ASSERT(start[i] < end[j]);
+/* Parameters of bench_mutex_contention */
+#define MUTEX_BENCH_THREADS 8
+#define MUTEX_BENCH_LOCKS 20000
+
+static Mutex mutex_bench_mx = MUTEX_INIT;
+static volatile long mutex_bench_counter;
 
+static int mutex_bench_thread(int argl, void* args)
+{
+	for(int i=0; i<MUTEX_BENCH_LOCKS; i++) {
+		Mutex_Lock(&mutex_bench_mx);
+		/* A short critical section, of argl iterations */
+		for(int j=0; j<argl; j++)
+			mutex_bench_counter++;
+		mutex_bench_counter++;
+		Mutex_Unlock(&mutex_bench_mx);
+	}
 	return 0;
+}
 
-#undef NCHILDREN
+static double mutex_bench_time;
+
+static int mutex_bench_main(int argl, void* args)
+{
+	Tid_t t[MUTEX_BENCH_THREADS];
+	mutex_bench_counter = 0;
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<MUTEX_BENCH_THREADS; i++)
+		t[i] = CreateThread(mutex_bench_thread, argl, NULL);
+	for(int i=0; i<MUTEX_BENCH_THREADS; i++)
+		ThreadJoin(t[i], NULL);
+	mutex_bench_time = time_since(&t0);
+	ASSERT(mutex_bench_counter == (long)MUTEX_BENCH_THREADS*MUTEX_BENCH_LOCKS*(argl+1));
+	return 0;
 }
 
+BARE_TEST(bench_mutex_contention,
+	"Measure the cost of a contended Mutex_Lock/Mutex_Unlock pair, with threads\n"
+	"locking the same mutex in a loop, for short and longer critical sections.",
+	.timeout = 300
+	)
+{
+	for(int ncores=1; ncores<=4; ncores*=2)
+	for(int cs=0; cs<=1000; cs+=1000) {
+		boot(ncores, 0, mutex_bench_main, cs, NULL);
+		MSG("cores=%d  threads=%d  critical section=%4d   usec/lock=%7.3f\n",
+			ncores, MUTEX_BENCH_THREADS, cs,
+			1E6*mutex_bench_time/(MUTEX_BENCH_THREADS*MUTEX_BENCH_LOCKS));
+	}
+}
 
 
+/* Parameters of bench_spinlock_contention */
+#define SPIN_BENCH_SECONDS 0.2
+#define SPIN_BENCH_SAMPLES 4096
 
+static spinlock_t spin_bench_tas = SPINLOCK_INIT;
+static ticketlock_t spin_bench_ticket = TICKETLOCK_INIT;
+static volatile long spin_bench_counter;
+static long spin_bench_acquired[MAX_CORES];
+static unsigned long spin_bench_wait[MAX_CORES][SPIN_BENCH_SAMPLES];
 
-void mark_time(struct timeval* t)
+static inline unsigned long spin_bench_nsec()
 {
-	CHECK(gettimeofday(t, NULL));
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ul + ts.tv_nsec;
 }
-double time_since(struct timeval* t0)
-{
-	struct timeval t1;
-	mark_time(&t1);
 
-	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+/* Lock in a loop, timing the wait of each acquisition. argl selects the lock. */
+static int spin_bench_thread(int argl, void* args)
+{
+	int id = *(int*)args;
+	unsigned long start = spin_bench_nsec();
+	unsigned long end = start + (unsigned long)(SPIN_BENCH_SECONDS*1E9);
+	long n = 0;
+
+	for(unsigned long now = start; now < end; n++) {
+		int pre = preempt_off;
+		if(argl) ticket_lock(&spin_bench_ticket); else spin_lock(&spin_bench_tas);
+		unsigned long t = spin_bench_nsec();
+		spin_bench_counter++;
+		if(argl) ticket_unlock(&spin_bench_ticket); else spin_unlock(&spin_bench_tas);
+		if(pre) preempt_on;
+
+		if(n < SPIN_BENCH_SAMPLES)
+			spin_bench_wait[id][n] = t - now;
+		now = t;
+	}
+	spin_bench_acquired[id] = n;
+	return 0;
 }
 
-
-int compute_child(int argl, void* args)
+static int spin_bench_main(int argl, void* args)
 {
-	unsigned int fib = fibo(35);
-	return fib %3 ==1;
+	int ncores = cpu_cores();
+	Tid_t t[MAX_CORES];
+	int id[MAX_CORES];
+	spin_bench_counter = 0;
+	for(int i=0; i<ncores; i++) {
+		id[i] = i;
+		t[i] = CreateThread(spin_bench_thread, argl, &id[i]);
+	}
+	for(int i=0; i<ncores; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
 }
 
+static int spin_bench_compare(const void* a, const void* b)
+{
+	unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+	return (x > y) - (x < y);
+}
 
-BARE_TEST(test_parallelism,
-	"This test tests whether multiple cores are used in parallel.",
-	.timeout = 30, .minimum_cores=2,
+BARE_TEST(bench_spinlock_contention,
+	"Measure a contended kernel spinlock, with one thread per core locking\n"
+	"it in a loop with preemption off, for the test-and-set spinlock and the\n"
+	"ticket lock of the scheduler. Report the acquisitions per second and the\n"
+	"tail of the time from one acquisition to the next in each thread. Ticket\n"
+	"locks only queue waiters up when no core has to share a host CPU.",
+	.timeout = 300
 	)
 {
+	static unsigned long wait[MAX_CORES*SPIN_BENCH_SAMPLES];
+	const char* name[2] = { "tas", "ticket" };
+
+	MSG("host CPUs=%d\n", get_nprocs());
+
+	for(int ncores=1; ncores<=MAX_CORES; ncores*=2)
+	for(int ticket=0; ticket<=1; ticket++) {
+		boot(ncores, 0, spin_bench_main, ticket, NULL);
+
+		long total = 0, nw = 0;
+		for(int i=0; i<ncores; i++) {
+			long n = spin_bench_acquired[i];
+			total += n;
+			if(n > SPIN_BENCH_SAMPLES) n = SPIN_BENCH_SAMPLES;
+			memcpy(wait+nw, spin_bench_wait[i], n*sizeof(unsigned long));
+			nw += n;
+		}
+		ASSERT(spin_bench_counter == total);
+		qsort(wait, nw, sizeof(unsigned long), spin_bench_compare);
 
-	struct timeval tstart;
-	double Trun;
-
-	int run_twice(int argl, void* args) {
-		mark_time(&tstart);
-		Exec(compute_child, 0, NULL);
-		Exec(compute_child, 0, NULL);
-		WaitChild(NOPROC, NULL);
-		WaitChild(NOPROC, NULL);
-		Trun = time_since(&tstart);
-		return 0;
+		MSG("cores=%2d  %-6s  acq/sec=%10.0f  p50=%8lu  p99=%9lu  max=%9lu nsec\n",
+			ncores, name[ticket], total/SPIN_BENCH_SECONDS, wait[nw/2], wait[nw*99/100], wait[nw-1]);
 	}
+}
 
 
-	double run_times(uint ntimes, uint ncores)
-	{
-		double minTrun=0.0;
-		for(int I=0;I<ntimes; I++) {
-			boot(ncores, 0, run_twice, 0, NULL);
-			if(I==0)
-				minTrun = Trun;
-			else 
-				if(Trun < minTrun) minTrun = Trun;
-		}
-		return minTrun;
-	}
-
-	if(sysconf(_SC_NPROCESSORS_ONLN)<2) {
-		MSG("Cannot run this test on this machine, there is only 1 core.\n");
-		return;
-	}
+/* Threads of bench_wait_morphing, turns taken by each, and the critical section */
+#define MORPH_BENCH_PLAYERS 4
+#define MORPH_BENCH_TURNS 200
+#define MORPH_BENCH_WORK 100000
 
-	double T1 = run_times(10, 1);
-	double T2 = run_times(10, 2);
+static double morph_bench_roundtrip;
+static Mutex morph_bench_mx = MUTEX_INIT;
+static CondVar morph_bench_cv = COND_INIT;
+static int morph_bench_turn;
+static volatile long morph_bench_work;
 
-	MSG("1-core: %f   2-core: %f\n", T1, T2);
-	ASSERT_MSG( fabs(T1/T2  - 2.0) < 0.4, 
-		"Runtimes did not decrease enough. one core: %f sec    two cores: %f sec\n", 
-		T1, T2);
+static int morph_bench_pipe(int argl, void* args)
+{
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0 && Pipe(&p[1])==0);
+	struct echo_fids pf = { p[0].read, p[1].write };
+	Tid_t server = CreateThread(echo_server, 0, &pf);
+	morph_bench_roundtrip = roundtrip_time(p[0].write, p[1].read);
+	Close(p[0].write);
+	ThreadJoin(server, NULL);
+	return 0;
 }
 
+/* Take turns with the other players. The turn is passed on by broadcast
+   while holding the mutex, which is kept for a critical section. */
+static int morph_bench_player(int argl, void* args)
+{
+	Mutex_Lock(&morph_bench_mx);
+	for(int i=0; i<MORPH_BENCH_TURNS; i++) {
+		while(morph_bench_turn != argl)
+			Cond_Wait(&morph_bench_mx, &morph_bench_cv);
+		morph_bench_turn = (argl+1) % MORPH_BENCH_PLAYERS;
+		Cond_Broadcast(&morph_bench_cv);
+		for(int j=0; j<MORPH_BENCH_WORK; j++)
+			morph_bench_work++;
+	}
+	Mutex_Unlock(&morph_bench_mx);
+	return 0;
+}
 
+static int morph_bench_turns(int argl, void* args)
+{
+	Tid_t t[MORPH_BENCH_PLAYERS];
+	morph_bench_turn = 0;
+	for(int i=0; i<MORPH_BENCH_PLAYERS; i++)
+		t[i] = CreateThread(morph_bench_player, i, NULL);
+	for(int i=0; i<MORPH_BENCH_PLAYERS; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
 
-TEST_SUITE(concurrency_tests,
-	"A suite of tests which test the operational concurrency of the kernel."
+BARE_TEST(bench_wait_morphing,
+	"Count the context switches of a pipe round trip, and of threads that take\n"
+	"turns on a condition variable, broadcasting while they hold the mutex,\n"
+	"with and without wait morphing, on 1, 2 and 4 cores.",
+	.timeout = 300
 	)
 {
-	&test_multitask,
-	&test_preemption,
-	&test_parallelism,
-	NULL
-};
-
-
+	for(int ncores=1; ncores<=4; ncores*=2)
+	for(int morph=0; morph<=1; morph++) {
+		cv_wait_morphing = morph;
+
+		boot(ncores, 0, morph_bench_pipe, 0, NULL);
+		double pipe_cs = (double)total_ctx_switches(ncores)/HANDOFF_ROUNDTRIPS;
+
+		struct timeval t0;
+		mark_time(&t0);
+		boot(ncores, 0, morph_bench_turns, 0, NULL);
+		double turn_time = time_since(&t0)/(MORPH_BENCH_PLAYERS*MORPH_BENCH_TURNS);
+		double turn_cs = (double)total_ctx_switches(ncores)/(MORPH_BENCH_PLAYERS*MORPH_BENCH_TURNS);
+
+		MSG("cores=%d  morphing=%-3s  ctx switches: pipe round trip=%5.2f   "
+			"turn=%5.2f (%6.2f usec)\n", ncores, morph ? "on" : "off",
+			pipe_cs, turn_cs, 1E6*turn_time);
+	}
+	cv_wait_morphing = 1;
+}
 
 
+/* Phases of bench_barrier, and the work of each thread at each phase */
+#define BARRIER_BENCH_PHASES 500
+#define BARRIER_BENCH_WORK 2000
 
-/*********************************************
- *
- *
- *
- *  Terminal I/O tests
- *
- *
- *
- *********************************************/
+/* The barrier of BarrierSync before Barrier_Wait, kept for comparison */
+typedef struct {
+	Mutex mx;
+	CondVar cv;
+	unsigned int count, epoch;
+} cv_barrier;
 
+static void cv_barrier_sync(cv_barrier* bar, unsigned int n)
+{
+	Mutex_Lock(& bar->mx);
+	unsigned int epoch = bar->epoch;
+	if(++bar->count == n) {
+		bar->epoch ++;
+		bar->count = 0;
+		Cond_Broadcast(&bar->cv);
+	}
+	while(epoch == bar->epoch)
+		Cond_Wait(&bar->mx, &bar->cv);
+	Mutex_Unlock(& bar->mx);
+}
 
+static cv_barrier barrier_bench_cvb;
+static Barrier barrier_bench_bar;
+static volatile long barrier_bench_work[MAX_CORES];
 
+static int barrier_bench_thread(int argl, void* args)
+{
+	int native = (args != NULL);
+	for(int p=0; p<BARRIER_BENCH_PHASES; p++) {
+		for(int j=0; j<BARRIER_BENCH_WORK; j++)
+			barrier_bench_work[argl]++;
+		if(native)
+			Barrier_Wait(&barrier_bench_bar, cpu_cores());
+		else
+			cv_barrier_sync(&barrier_bench_cvb, cpu_cores());
+	}
+	return 0;
+}
 
+static int barrier_bench_main(int argl, void* args)
+{
+	Tid_t t[MAX_CORES];
+	barrier_bench_cvb = (cv_barrier){ MUTEX_INIT, COND_INIT, 0, 0 };
+	barrier_bench_bar = BARRIER_INIT;
+	for(int i=1; i<cpu_cores(); i++)
+		t[i] = CreateThread(barrier_bench_thread, i, args);
+	barrier_bench_thread(0, args);
+	for(int i=1; i<cpu_cores(); i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
 
-BOOT_TEST(test_input_concurrency,
-	"Test that input from one terminal does not obstruct input from other terminals.",
-	.minimum_terminals = 2
+BARE_TEST(bench_barrier,
+	"Measure the time of a phase of threads that synchronize at a barrier,\n"
+	"with one thread per core, for the barrier built on a mutex and a condition\n"
+	"variable and for Barrier_Wait, on 1 to 32 cores.",
+	.timeout = 300
 	)
 {
-	void open_at_0(uint term)
-	{
-		Fid_t f = OpenTerminal(term);
-		ASSERT(f!=NOFILE);
-		if(f!=0) {
-			ASSERT(Dup2(f,0)==0);
-			ASSERT(Close(f)==0);
-		}
-	}
+	const char* name[2] = { "condvar", "native" };
 
-	int input_line(int argl, void* args)
-	{
-		FILE* fin = fidopen(0, "r");
-		char* line=NULL;
-		size_t llen;
+	MSG("host CPUs=%d\n", get_nprocs());
 
-		ASSERT(getline(&line, &llen, fin));
-		fclose(fin);
-		free(line);
-		return 0;
+	for(int ncores=1; ncores<=MAX_CORES; ncores*=2)
+	for(int native=0; native<=1; native++) {
+		struct timeval t0;
+		mark_time(&t0);
+		boot(ncores, 0, barrier_bench_main, 0, native ? (void*)&barrier_bench_bar : NULL);
+		double phase_time = time_since(&t0)/BARRIER_BENCH_PHASES;
+		double phase_cs = (double)total_ctx_switches(ncores)/BARRIER_BENCH_PHASES;
+
+		MSG("cores=%2d  %-7s  phase=%8.2f usec  ctx switches/phase=%6.2f\n",
+			ncores, name[native], 1E6*phase_time, phase_cs);
 	}
+}
 
+/* Operations of each thread in bench_rwlock, and the size of the table */
+#define RW_BENCH_OPS 200000
+#define RW_BENCH_TABLE 16
 
-	open_at_0(0);
-	Pid_t p0 = Exec(input_line, 0, NULL);
-	open_at_0(1);
-	Pid_t p1 = Exec(input_line, 0, NULL);
+static Mutex rw_bench_mx;
+static RwLock rw_bench_rw;
+static RwLockSlot rw_bench_slots[RWLOCK_SLOTS];
+static long rw_bench_table[RW_BENCH_TABLE];
+static volatile long rw_bench_sum;
 
-	sendme(0, "Hello ");
-	sendme(1, "Hellow world\n");
-	ASSERT(WaitChild(p1, NULL)==p1);
-	sendme(0, " world\n");
-	ASSERT(WaitChild(p0, NULL)==p0);
+/* argl is the percentage of writes, and args points to the lock kind */
+static int rw_bench_thread(int argl, void* args)
+{
+	int kind = *(int*)args;
+	long sum = 0;
+	for(int i=0; i<RW_BENCH_OPS; i++) {
+		int write = (i % 100) < argl;
+		if(kind == 0)
+			Mutex_Lock(&rw_bench_mx);
+		else if(write)
+			RwLock_WriteLock(&rw_bench_rw);
+		else
+			RwLock_ReadLock(&rw_bench_rw);
+
+		for(int j=0; j<RW_BENCH_TABLE; j++) {
+			if(write) rw_bench_table[j]++;
+			else sum += rw_bench_table[j];
+		}
+
+		if(kind == 0)
+			Mutex_Unlock(&rw_bench_mx);
+		else
+			RwLock_Unlock(&rw_bench_rw);
+	}
+	rw_bench_sum += sum;
 	return 0;
 }
 
+static int rw_bench_main(int argl, void* args)
+{
+	Tid_t t[MAX_CORES];
+	rw_bench_mx = MUTEX_INIT;
+	memset(rw_bench_slots, 0, sizeof(rw_bench_slots));
+	rw_bench_rw = (*(int*)args == 2) ? RWLOCK_PERCORE_INIT(rw_bench_slots) : RWLOCK_INIT;
+	for(int i=1; i<cpu_cores(); i++)
+		t[i] = CreateThread(rw_bench_thread, argl, args);
+	rw_bench_thread(argl, args);
+	for(int i=1; i<cpu_cores(); i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
 
-
-BOOT_TEST(test_term_input_driver_interrupt,
-	"Test that terminal input is interrupt driven. This is done by\n"
-	"opening a huge number of processes reading from the terminal and\n"
-	"measuring the effect on a compute process.",
-	.minimum_terminals = 1, .timeout = 100
+BARE_TEST(bench_rwlock,
+	"Measure the throughput of threads that read or update a small table,\n"
+	"under a Mutex, an RwLock and a per-core RwLock, with one thread per core\n"
+	"and 0%, 1%, 10% and 50% of the operations being updates.",
+	.timeout = 300
 	)
 {
-	int input_char(int argl, void* args)
-	{
-		char c;
-		ASSERT(Read(0, &c, 1)==1);
-		return 0;
-	}
+	const char* name[3] = { "Mutex", "RwLock", "per-core" };
+	const int wpct[4] = { 0, 1, 10, 50 };
 
-	struct timeval t0;
-	double minTrun, maxTrun;
+	MSG("host CPUs=%d\n", get_nprocs());
 
-	void run_times(uint ntimes)
-	{
-		for(int I=0;I<ntimes; I++) {
+	for(int ncores=1; ncores<=MAX_CORES; ncores*=4)
+	for(int w=0; w<4; w++) {
+		double rate[3];
+		for(int kind=0; kind<3; kind++) {
+			struct timeval t0;
 			mark_time(&t0);
-			Pid_t pid = Exec(compute_child,0,NULL);
-			ASSERT(pid!=NOPROC);
-			ASSERT(WaitChild(pid, NULL)==pid);
-			double Trun = time_since(&t0);
-
-			if(I==0)
-				minTrun = maxTrun = Trun;
-			else {
-				if( Trun < minTrun) minTrun = Trun;
-				if( Trun > maxTrun) maxTrun = Trun;
-			}
+			boot(ncores, 0, rw_bench_main, wpct[w], &kind);
+			rate[kind] = ncores*RW_BENCH_OPS/time_since(&t0);
 		}
+		MSG("cores=%2d  writes=%2d%%  ops/msec: %s=%7.0f  %s=%7.0f  %s=%7.0f\n",
+			ncores, wpct[w], name[0], rate[0]/1E3, name[1], rate[1]/1E3, name[2], rate[2]/1E3);
 	}
+}
 
-	void run_with_io(int nioproc)
-	{
-		for(int i=0; i< nioproc; i++)
-			ASSERT(Exec(input_char, 0, NULL)!=NOPROC);
-
-		/* If the readers are polling as the compute task runs, 
-		   this will take a long time! */
-		run_times(10);
+/* Rounds of bench_priority_inversion, the time (in usec) that the
+   low-priority thread holds the mutex, and the time that the medium-priority
+   threads run in each round */
+#define PI_BENCH_ROUNDS 40
+#define PI_BENCH_HOLD 200
+#define PI_BENCH_BURST 20000
 
-		char* dummy_input = malloc((nioproc+1)*sizeof(char));
-		for(int i=0; i< nioproc; i++)
-			dummy_input[i] = 'A';
-		dummy_input[nioproc] = '\0';
-		sendme(0, dummy_input);
+static Mutex pi_bench_mx;
+static int pi_bench_low_round, pi_bench_locked, pi_bench_round;
+static double pi_bench_wait[PI_BENCH_ROUNDS];
 
-		free(dummy_input);
-		for(int i=0; i< nioproc; i++)
-			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
-	}
+static void pi_bench_spin(TimerDuration usec)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < usec*1E-6);
+}
 
-	Fid_t fid = OpenTerminal(0);
-	ASSERT(fid!=NOFILE);
-	if(fid!=0) {
-		ASSERT(Dup2(fid,0)==0);
-		ASSERT(Close(fid)==0);		
-	}
+/* Wait until *round changes from r, and return the new value */
+static int pi_bench_next(int* round, int r)
+{
+	while(__atomic_load_n(round, __ATOMIC_ACQUIRE) == r)
+		FutexWait(round, r, NO_TIMEOUT);
+	return __atomic_load_n(round, __ATOMIC_ACQUIRE);
+}
 
-	run_with_io(1000);
-	double T1000 = minTrun;
+static void pi_bench_advance(int* round, int r)
+{
+	__atomic_store_n(round, r, __ATOMIC_RELEASE);
+	FutexWake(round, MAX_CORES);
+}
 
-	run_with_io(0);
-	double T0 = minTrun;
+/* The levels are set directly, since the MLFQ would move them around */
+static int pi_bench_low(int argl, void* args)
+{
+	for(int r = 0; (r = pi_bench_next(&pi_bench_low_round, r)) > 0; ) {
+		cur_thread()->priority = 0;
+		Mutex_Lock(&pi_bench_mx);
+		pi_bench_advance(&pi_bench_locked, r);
+		yield(SCHED_USER);	/* FutexWake does not preempt */
+		pi_bench_spin(PI_BENCH_HOLD);
+		Mutex_Unlock(&pi_bench_mx);
+	}
+	return 0;
+}
 
-	MSG("Trun(0)= %f   Trun(1000)= %f\n", T0, T1000);
-	ASSERT_MSG( (T1000-T0)/T0 < 0.1, "Failed: Trun(0)= %f   Trun(1000)= %f\n", T0, T1000 );
+static int pi_bench_medium(int argl, void* args)
+{
+	for(int r = 0; (r = pi_bench_next(&pi_bench_round, r)) > 0; ) {
+		cur_thread()->priority = QUEUE_NUMBER/2;
+		pi_bench_spin(PI_BENCH_BURST);
+	}
+	return 0;
+}
 
+/*
+	In each round, the low-priority thread takes the mutex. Then the 
+	high-priority thread wakes up the medium-priority threads, which keep 
+	every core busy for a while, and asks for the mutex.
+ */
+static int pi_bench_high(int argl, void* args)
+{
+	for(int r = 1; r <= PI_BENCH_ROUNDS; r++) {
+		cur_thread()->priority = QUEUE_NUMBER-1;
+		pi_bench_advance(&pi_bench_low_round, r);
+		pi_bench_next(&pi_bench_locked, r-1);
+		pi_bench_advance(&pi_bench_round, r);
+
+		struct timeval t0;
+		mark_time(&t0);
+		Mutex_Lock(&pi_bench_mx);
+		pi_bench_wait[r-1] = time_since(&t0);
+		Mutex_Unlock(&pi_bench_mx);
+
+		/* Let the medium-priority threads finish the round */
+		int dummy = 0;
+		FutexWait(&dummy, 0, 2*PI_BENCH_BURST/1000);
+	}
 	return 0;
 }
 
+static int pi_bench_main(int argl, void* args)
+{
+	Tid_t t[MAX_CORES+1];
+	pi_bench_mx = MUTEX_INIT;
+	pi_bench_low_round = pi_bench_locked = pi_bench_round = 0;
+	t[0] = CreateThread(pi_bench_low, 0, NULL);
+	for(int i=1; i<=cpu_cores(); i++)
+		t[i] = CreateThread(pi_bench_medium, 0, NULL);
+	ThreadJoin(CreateThread(pi_bench_high, 0, NULL), NULL);
+	pi_bench_advance(&pi_bench_low_round, -1);
+	pi_bench_advance(&pi_bench_round, -1);
+	for(int i=0; i<=cpu_cores(); i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
 
+static int pi_bench_compare(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
 
+BARE_TEST(bench_priority_inversion,
+	"Measure how long a high-priority thread waits for a mutex that a\n"
+	"low-priority thread holds, while one medium-priority CPU-bound thread\n"
+	"per core keeps the low-priority thread from running, with and without\n"
+	"priority inheritance, on 1 and 2 cores.",
+	.timeout = 300
+	)
+{
+	for(int ncores=1; ncores<=2; ncores++)
+	for(int pi=0; pi<=1; pi++) {
+		mutex_priority_inheritance = pi;
+		boot(ncores, 0, pi_bench_main, 0, NULL);
+
+		qsort(pi_bench_wait, PI_BENCH_ROUNDS, sizeof(double), pi_bench_compare);
+		MSG("cores=%d  inheritance=%-3s  mutex wait: p50=%7.3f  p90=%7.3f  max=%7.3f msec\n",
+			ncores, pi ? "on" : "off", pi_bench_wait[PI_BENCH_ROUNDS/2]*1E3,
+			pi_bench_wait[PI_BENCH_ROUNDS*9/10]*1E3, pi_bench_wait[PI_BENCH_ROUNDS-1]*1E3);
+	}
+	mutex_priority_inheritance = 1;
+}
 
-TEST_SUITE(io_tests,
-	"A suite of tests which test the concurrency of terminal I/O."
+TEST_SUITE(benchmark_tests,
+	"A suite of benchmarks for the kernel. They report timings and do not fail."
 	)
 {
-	&test_input_concurrency,
-	&test_term_input_driver_interrupt,
+	&bench_yield_latency,
+	&bench_timeout_latency,
+	&bench_mlfq_quantum,
+	&bench_wakeup_latency,
+	&bench_handoff_latency,
+	&bench_broadcast,
+	&bench_thread_spawn,
+	&bench_many_threads,
+	&bench_context_switch,
+	&bench_preempt_toggle,
+	&bench_stream_throughput,
+	&bench_mutex_contention,
+	&bench_spinlock_contention,
+	&bench_wait_morphing,
+	&bench_barrier,
+	&bench_rwlock,
+	&bench_priority_inversion,
 	NULL
 };
 
 
 
-
 /*********************************************
  *
  *
@@ -2569,6 +4639,7 @@ TEST_SUITE(all_tests,
 	//&concurrency_tests,
 	//&io_tests,
 	&thread_tests,
+	&sync_tests,
 	&pipe_tests,
 	&socket_tests,
 	NULL
@@ -2611,6 +4682,7 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&benchmark_tests);
 	return run_program(argc, argv, &all_tests);
 }
 